@@ -206,7 +206,7 @@ with open('src/board-defs.inc', 'w') as f:
             board.moves_name, board.moves_length = moves
 
     for board in boards.values():
-        f.write('const Board {}{{{}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}}};\n\n'.format(
+        f.write('constexpr Board {}{{{}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}}};\n\n'.format(
             board.name, '"{}"'.format(board.name),
             len(board.topology.anchorable) + len(board.topology.unanchorable),
             len(board.topology.anchorable),
@@ -217,3 +217,11 @@ with open('src/board-defs.inc', 'w') as f:
             board.moves_name, board.moves_length,
         ))
 
+    f.write('const Board* const all_boards[] = {{{}}};\n'.format(
+        ', '.join('&' + name for name in boards.keys())))
+    # The move generator doesn't depend on the pieces, so boards sharing a
+    # topology and moves share a specialization.
+    compiled = {}
+    for board in boards.values():
+        compiled.setdefault((board.topology, board.moves_name), board.name)
+    f.write('using compiled_boards = BoardList<{}>;\n'.format(', '.join(compiled.values())))
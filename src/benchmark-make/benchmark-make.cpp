@@ -4,6 +4,7 @@
 #include "board-defs.inc"
 
 using namespace pushfight;
+using namespace std::literals::string_view_literals;
 
 struct StateCounter : public StateVisitor {
 	unsigned long began = 0, accepted = 0, ended = 0;
@@ -13,8 +14,45 @@ struct StateCounter : public StateVisitor {
 };
 
 int main(int argc, char* argv[]) { //genbuild {'entrypoint': True, 'ldflags': ''}
+	const Board* board = &traditional;
+	bool transposition_report = false;
+	for (int i = 1; i < argc; ++i)
+		if (argv[i] == "--walk-pushes"sv)
+			generator_options().push_tables = false;
+		else if (argv[i] == "--expand-moves"sv)
+			generator_options().shift_fill = false;
+		else if (argv[i] == "--fill-per-piece"sv)
+			generator_options().share_fills = false;
+		else if (argv[i] == "--expand-transpositions"sv)
+			generator_options().dedupe_transpositions = false;
+		else if (argv[i] == "--generic-boards"sv)
+			generator_options().compiled_boards = false;
+		else if (argv[i] == "--transposition-report"sv)
+			transposition_report = true;
+		else if (argv[i] == "--board"sv) {
+			std::string_view name = argv[++i];
+			auto it = std::find_if(std::begin(all_boards), std::end(all_boards), [=](const Board* b) {return b->name() == name;});
+			if (it == std::end(all_boards)) {
+				fmt::print(stderr, "unknown board: {}\n", name);
+				return 1;
+			}
+			board = *it;
+		} else {
+			fmt::print(stderr, "unknown option: {}\n", argv[i]);
+			return 1;
+		}
 	StateCounter counter;
-	pushfight::enumerate_anchored_states(pushfight::traditional, counter);
+	pushfight::enumerate_anchored_states(*board, counter);
 	fmt::print("{} {} {}\n", counter.began, counter.accepted, counter.ended);
+	if (transposition_report) {
+		//enumerate again the other way to count the accepts deduping saves
+		bool dedupe = generator_options().dedupe_transpositions;
+		generator_options().dedupe_transpositions = !dedupe;
+		StateCounter other;
+		pushfight::enumerate_anchored_states(*board, other);
+		auto deduped = dedupe ? counter.accepted : other.accepted, expanded = dedupe ? other.accepted : counter.accepted;
+		fmt::print("{} accepts with transpositions deduped, {} without ({:.1f}% fewer)\n",
+				deduped, expanded, 100.0 * static_cast<double>(expanded - deduped) / static_cast<double>(expanded));
+	}
 	return 0;
 }
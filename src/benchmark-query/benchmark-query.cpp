@@ -0,0 +1,115 @@
+#include "precompiled.hpp"
+#include "state.hpp"
+#include "board.hpp"
+#include "board-defs.inc"
+#include "database.hpp"
+#include "stopwatch.hpp"
+#include "util.hpp"
+
+using namespace pushfight;
+using std::vector;
+using namespace std::literals::string_view_literals;
+
+/**
+ * Times WinLossUnknownDatabase queries under each search strategy.  The
+ * queries are uniformly random valid ranks of --board, like the solver's
+ * successor lookups; then the same queries are sorted and passed to
+ * query_sorted.  Each run maps the files afresh, so its page fault count
+ * includes populating the page tables.  A dense table, if present, answers
+ * for the generations it covers regardless of strategy.
+ */
+int main(int argc, char* argv[]) { //genbuild {'entrypoint': True, 'ldflags': ''}
+	std::optional<unsigned int> generations;
+	std::optional<std::filesystem::path> data_dir;
+	unsigned long query_count = 1'000'000, seed = 0;
+	vector<SearchStrategy> strategies;
+	const Board* board = &traditional;
+	for (int i = 1; i < argc; ++i)
+		if (argv[i] == "--generation"sv)
+			generations = from_string<unsigned int>(argv[++i]);
+		else if (argv[i] == "--data-dir"sv || argv[i] == "--data"sv)
+			data_dir = argv[++i];
+		else if (argv[i] == "--queries"sv)
+			query_count = from_string<unsigned long>(argv[++i]);
+		else if (argv[i] == "--seed"sv)
+			seed = from_string<unsigned long>(argv[++i]);
+		else if (argv[i] == "--search"sv)
+			strategies.push_back(search_strategy_from_string(argv[++i]));
+		else if (argv[i] == "--board"sv) {
+			std::string_view name = argv[++i];
+			auto it = std::find_if(std::begin(all_boards), std::end(all_boards), [=](const Board* b) {return b->name() == name;});
+			if (it == std::end(all_boards)) {
+				fmt::print(stderr, "unknown board: {}\n", name);
+				return 1;
+			}
+			board = *it;
+		} else {
+			fmt::print(stderr, "unknown option: {}\n", argv[i]);
+			return 1;
+		}
+	if (!data_dir) {
+		fmt::print(stderr, "required options not passed\n");
+		return 1;
+	}
+	if (strategies.empty())
+		for (auto [strategy, name] : SEARCH_STRATEGY_NAMES)
+			strategies.push_back(strategy);
+
+	Unranker unranker(*board);
+	std::mt19937_64 gen(seed);
+	std::uniform_int_distribution<unsigned long> dist(0, unranker.rank_limit() - 1);
+	vector<unsigned long> queries;
+	queries.reserve(query_count);
+	State state;
+	while (queries.size() < query_count) {
+		unsigned long r = dist(gen);
+		if (unranker.try_unrank(r, state))
+			queries.push_back(r);
+	}
+
+	std::optional<std::array<unsigned long, 4>> expected_counts;
+	std::string_view expected_name;
+	for (SearchStrategy strategy : strategies) {
+		auto wldb = load_database(*data_dir, generations, board);
+		wldb->strategy = strategy;
+		//Time the searches themselves.
+		wldb->cache_entries = 0;
+		std::array<unsigned long, 4> counts = {};
+		Stopwatch stopwatch = Stopwatch::thread();
+		for (unsigned long r : queries)
+			++counts[wldb->query(r)];
+		auto times = stopwatch.elapsed();
+
+		auto name = std::find_if(SEARCH_STRATEGY_NAMES.begin(), SEARCH_STRATEGY_NAMES.end(),
+				[=](auto& p) {return p.first == strategy;})->second;
+		fmt::print("{:>13}: {:.1f} ns/query, {} soft faults, {} hard faults ({} wins, {} losses, {} draws, {} unknown)\n",
+				name, (double)times.nanos() / (double)queries.size(), times.softFaults(), times.hardFaults(),
+				counts[WIN], counts[LOSS], counts[DRAW], counts[UNKNOWN]);
+		if (!expected_counts) {
+			expected_counts = counts;
+			expected_name = name;
+		} else if (counts != *expected_counts) {
+			fmt::print(stderr, "{} disagrees with {}\n", name, expected_name);
+			return 1;
+		}
+	}
+
+	//The same queries, sorted and batched as OutcountingVisitor::flush does.
+	std::sort(queries.begin(), queries.end());
+	auto wldb = load_database(*data_dir, generations, board);
+	vector<GameValue> values(queries.size());
+	Stopwatch stopwatch = Stopwatch::thread();
+	wldb->query_sorted(queries, values);
+	auto times = stopwatch.elapsed();
+	std::array<unsigned long, 4> counts = {};
+	for (GameValue v : values)
+		++counts[v];
+	fmt::print("{:>13}: {:.1f} ns/query, {} soft faults, {} hard faults ({} wins, {} losses, {} draws, {} unknown)\n",
+			"query_sorted", (double)times.nanos() / (double)queries.size(), times.softFaults(), times.hardFaults(),
+			counts[WIN], counts[LOSS], counts[DRAW], counts[UNKNOWN]);
+	if (counts != *expected_counts) {
+		fmt::print(stderr, "query_sorted disagrees with {}\n", expected_name);
+		return 1;
+	}
+	return 0;
+}
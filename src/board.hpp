@@ -13,7 +13,7 @@ enum Dir {LEFT, UP, RIGHT, DOWN};
 
 class Board {
 public:
-	Board(std::string_view name, unsigned int squares, unsigned int anchorables,
+	constexpr Board(std::string_view name, unsigned int squares, unsigned int anchorables,
 			unsigned int pushers, unsigned int pawns, const unsigned int* topology,
 			const std::pair<unsigned int, unsigned int>* square_to_coord,
 			const unsigned int* placement_first, unsigned int placement_first_len,
@@ -25,15 +25,16 @@ public:
 			placement_first_len_(placement_first_len), placement_second_len_(placement_second_len),
 			allowed_moves_(allowed_moves), allowed_moves_len_(allowed_moves_len) {}
 
-	unsigned int pushers() const {return pushers_;}
-	unsigned int pawns() const {return pawns_;}
-	unsigned int squares() const {return squares_;}
-	unsigned int anchorable_squares() const {return anchorables_;}
+	constexpr std::string_view name() const {return name_;}
+	constexpr unsigned int pushers() const {return pushers_;}
+	constexpr unsigned int pawns() const {return pawns_;}
+	constexpr unsigned int squares() const {return squares_;}
+	constexpr unsigned int anchorable_squares() const {return anchorables_;}
 
-	unsigned int neighbor(unsigned int square, Dir dir) const {
+	constexpr unsigned int neighbor(unsigned int square, Dir dir) const {
 		return topology_[square*4 + static_cast<unsigned int>(dir)];
 	}
-	std::array<unsigned int, 4> neighbors(unsigned int square) const {
+	constexpr std::array<unsigned int, 4> neighbors(unsigned int square) const {
 		return {
 			neighbor(square, LEFT),
 			neighbor(square, UP),
@@ -41,7 +42,7 @@ public:
 			neighbor(square, DOWN)
 		};
 	}
-	std::uint32_t neighbors_mask(unsigned int square) const {
+	constexpr std::uint32_t neighbors_mask(unsigned int square) const {
 		std::uint32_t m = 0;
 		for (unsigned int n : neighbors(square))
 			if (n != VOID && n != RAIL)
@@ -51,40 +52,40 @@ public:
 
 	//we should really just expose moves as a std::span and let SharedWorkspace
 	//process it as it wants, but this is expedient while we wait for std::span
-	unsigned int max_moves() const {
+	constexpr unsigned int max_moves() const {
 		return *std::max_element(allowed_moves_, allowed_moves_+allowed_moves_len_);
 	}
-	std::uint32_t allowed_moves_mask() const {
+	constexpr std::uint32_t allowed_moves_mask() const {
 		std::uint32_t m = 0;
 		for (unsigned int i = 0; i < allowed_moves_len_; ++i)
 			m |= 1 << allowed_moves_[i];
 		return m;
 	}
 
-	const unsigned int* placement0_begin() const {
+	constexpr const unsigned int* placement0_begin() const {
 		return placement_first_;
 	}
-	const unsigned int* placement0_end() const {
+	constexpr const unsigned int* placement0_end() const {
 		return placement_first_ + placement_first_len_;
 	}
-	const unsigned int* placement1_begin() const {
+	constexpr const unsigned int* placement1_begin() const {
 		return placement_second_;
 	}
-	const unsigned int* placement1_end() const {
+	constexpr const unsigned int* placement1_end() const {
 		return placement_second_ + placement_first_len_;
 	}
 
-	std::pair<unsigned int, unsigned int> coord_for_square(unsigned int square) const {
+	constexpr std::pair<unsigned int, unsigned int> coord_for_square(unsigned int square) const {
 		return square_to_coord_[square];
 	}
-	unsigned int square_for_coord(std::pair<unsigned int, unsigned int> coord) const {
+	constexpr unsigned int square_for_coord(std::pair<unsigned int, unsigned int> coord) const {
 		for (unsigned int square = 0; square < squares_; ++square) {
 			if (square_to_coord_[square] == coord)
 				return square;
 		}
 		throw std::logic_error(fmt::format("bad square_for_coord: {} {}", coord.first, coord.second));
 	}
-	unsigned int square_for_coord(unsigned int row, unsigned int col) const {
+	constexpr unsigned int square_for_coord(unsigned int row, unsigned int col) const {
 		return square_for_coord({row, col});
 	}
 private:
@@ -99,6 +100,11 @@ private:
 	unsigned int allowed_moves_len_;
 };
 
+//The boards the move generator is specialized for at compile time, as listed
+//by board_compiler.py.
+template<const Board&... Boards>
+struct BoardList {};
+
 }
 
 #endif /* PUSHFIGHT_BOARD_HPP_INCLUDED */
@@ -0,0 +1,103 @@
+#include "precompiled.hpp"
+#include "bulk-writer.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace pushfight {
+
+static void pwrite_fully(int fd, const char* p, std::size_t size, std::uintmax_t offset, const std::filesystem::path& file) {
+	while (size) {
+		ssize_t written = pwrite(fd, p, size, static_cast<off_t>(offset));
+		if (written < 0) {
+			auto saved_errno = errno;
+			if (saved_errno == EINTR) continue;
+			throw std::runtime_error(fmt::format("error writing {}: error {} ({})",
+					file.c_str(), strerror(saved_errno), saved_errno));
+		}
+		p += written;
+		size -= static_cast<std::size_t>(written);
+		offset += static_cast<std::uintmax_t>(written);
+	}
+}
+
+BulkWriter::BulkWriter(const std::filesystem::path& file, bool direct) : file_(file), direct_(direct) {
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	fd_ = open(file.c_str(), flags | (direct ? O_DIRECT : 0), 0644);
+	//tmpfs and some other filesystems reject O_DIRECT.
+	if (fd_ == -1 && direct && errno == EINVAL) {
+		direct_ = false;
+		fd_ = open(file.c_str(), flags, 0644);
+	}
+	if (fd_ == -1) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error opening {}: error {} ({})",
+				file.c_str(), strerror(saved_errno), saved_errno));
+	}
+	for (auto& b : buffers_) {
+		b.reset(static_cast<char*>(std::aligned_alloc(ALIGNMENT, BUFFER_BYTES)));
+		if (!b)
+			throw std::bad_alloc();
+	}
+}
+
+BulkWriter::~BulkWriter() {
+	if (fd_ == -1) return;
+	if (pending_.valid())
+		pending_.wait();
+	::close(fd_);
+}
+
+void BulkWriter::write_slow(const void* p, std::size_t size) {
+	const char* q = static_cast<const char*>(p);
+	while (size) {
+		std::size_t n = std::min(size, BUFFER_BYTES - fill_);
+		std::memcpy(buffers_[current_].get() + fill_, q, n);
+		fill_ += n;
+		q += n;
+		size -= n;
+		if (fill_ == BUFFER_BYTES)
+			submit();
+	}
+}
+
+void BulkWriter::wait() {
+	if (pending_.valid())
+		pending_.get();
+}
+
+void BulkWriter::submit() {
+	wait();
+	pending_ = std::async(std::launch::async, pwrite_fully, fd_, buffers_[current_].get(), fill_, offset_, std::cref(file_));
+	offset_ += fill_;
+	fill_ = 0;
+	current_ ^= 1;
+}
+
+void BulkWriter::close() {
+	wait();
+	//O_DIRECT can only write whole blocks, so pad the tail and truncate after.
+	std::size_t size = fill_;
+	if (direct_ && size % ALIGNMENT) {
+		std::size_t aligned = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+		std::memset(buffers_[current_].get() + size, 0, aligned - size);
+		size = aligned;
+	}
+	pwrite_fully(fd_, buffers_[current_].get(), size, offset_, file_);
+	bool padded = size != fill_;
+	offset_ += fill_;
+	fill_ = 0;
+	if ((padded && ftruncate(fd_, static_cast<off_t>(offset_))) || fsync(fd_)) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error writing {}: failed to sync; error {} ({})",
+				file_.c_str(), strerror(saved_errno), saved_errno));
+	}
+	int fd = fd_;
+	fd_ = -1;
+	if (::close(fd)) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error writing {}: failed to close; error {} ({})",
+				file_.c_str(), strerror(saved_errno), saved_errno));
+	}
+}
+
+}//namespace pushfight
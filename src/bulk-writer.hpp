@@ -0,0 +1,70 @@
+#ifndef BULK_WRITER_HPP
+#define BULK_WRITER_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <memory>
+
+namespace pushfight {
+
+/**
+ * Writes a file sequentially through two large aligned buffers: while one is
+ * written with pwrite on a background thread, the other fills.  With direct,
+ * the file is opened with O_DIRECT (falling back to buffered I/O where the
+ * filesystem doesn't support it), so writes bypass the page cache.
+ * Destroying a writer without calling close() abandons the file's contents.
+ */
+class BulkWriter {
+public:
+	static constexpr std::size_t BUFFER_BYTES = 8*1024*1024;
+	//O_DIRECT requires buffers, offsets and sizes aligned to the logical block
+	//size, which this covers.
+	static constexpr std::size_t ALIGNMENT = 4096;
+
+	BulkWriter(const std::filesystem::path& file, bool direct);
+	BulkWriter(const BulkWriter&) = delete;
+	BulkWriter& operator=(const BulkWriter&) = delete;
+	~BulkWriter();
+
+	void write(const void* p, std::size_t size) {
+		if (size <= BUFFER_BYTES - fill_) {
+			std::memcpy(buffers_[current_].get() + fill_, p, size);
+			fill_ += size;
+		} else
+			write_slow(p, size);
+	}
+	template<typename T>
+	void write(const T& x) {
+		write(&x, sizeof(x));
+	}
+	//Writes any buffered data, then syncs and closes the file.
+	void close();
+	//Bytes written so far, including buffered ones.
+	std::uintmax_t bytes() const {return offset_ + fill_;}
+private:
+	void write_slow(const void* p, std::size_t size);
+	//Hands the current buffer to the background thread, after waiting for the
+	//previous one's write to finish, and switches to the other buffer.
+	void submit();
+	//Waits for the background write, if any, rethrowing its exception.
+	void wait();
+
+	struct Free {
+		void operator()(char* p) const {std::free(p);}
+	};
+	std::filesystem::path file_;
+	int fd_;
+	bool direct_;
+	std::unique_ptr<char, Free> buffers_[2];
+	int current_ = 0;
+	std::size_t fill_ = 0;
+	//The file offset at which the current buffer starts.
+	std::uintmax_t offset_ = 0;
+	std::future<void> pending_;
+};
+
+}//namespace pushfight
+
+#endif /* BULK_WRITER_HPP */
@@ -0,0 +1,194 @@
+#include "precompiled.hpp"
+#include "compressed-intervals.hpp"
+#include "unique-file.hpp"
+
+using std::vector;
+
+namespace pushfight {
+
+static constexpr char MAGIC[8] = {'P', 'F', 'I', 'V', 'C', '0', '1', '\0'};
+static constexpr std::size_t HEADER_BYTES = 64;
+struct Header {
+	char magic[8];
+	unsigned long intervals, blocks, flags, data_bytes;
+};
+static_assert(sizeof(Header) <= HEADER_BYTES);
+
+static void put_varint(vector<std::uint8_t>& out, unsigned long x) {
+	while (x >= 0x80) {
+		out.push_back(static_cast<std::uint8_t>(x | 0x80));
+		x >>= 7;
+	}
+	out.push_back(static_cast<std::uint8_t>(x));
+}
+
+static unsigned long get_varint(const std::uint8_t*& p) {
+	unsigned long x = 0;
+	for (unsigned int shift = 0;; shift += 7) {
+		std::uint8_t b = *p++;
+		x |= static_cast<unsigned long>(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return x;
+	}
+}
+
+CompressedIntervals::CompressedIntervals(const void* data, std::size_t size, const std::filesystem::path& file) {
+	Header h;
+	if (size < HEADER_BYTES)
+		throw std::logic_error(fmt::format("{} is too small to be a compressed interval file", file.c_str()));
+	std::memcpy(&h, data, sizeof(h));
+	if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)))
+		throw std::logic_error(fmt::format("{} is not a compressed interval file", file.c_str()));
+	if (h.blocks != (h.intervals + BLOCK_INTERVALS - 1) / BLOCK_INTERVALS ||
+			size != HEADER_BYTES + (2 * h.blocks + 1) * sizeof(unsigned long) + h.data_bytes)
+		throw std::logic_error(fmt::format("{} is truncated or corrupt", file.c_str()));
+	intervals_ = h.intervals;
+	blocks_ = h.blocks;
+	tagged_ = h.flags & 1;
+	block_firsts_ = reinterpret_cast<const unsigned long*>(static_cast<const char*>(data) + HEADER_BYTES);
+	block_offsets_ = block_firsts_ + blocks_;
+	data_ = reinterpret_cast<const std::uint8_t*>(block_offsets_ + blocks_ + 1);
+	if (block_offsets_[blocks_] != h.data_bytes)
+		throw std::logic_error(fmt::format("{} is truncated or corrupt", file.c_str()));
+}
+
+std::size_t CompressedIntervals::block_for(unsigned long r) const {
+	auto it = std::upper_bound(block_firsts_, block_firsts_ + blocks_, r);
+	return it == block_firsts_ ? 0 : static_cast<std::size_t>(it - block_firsts_) - 1;
+}
+
+void CompressedIntervals::decode(const std::uint8_t*& p, Interval& i) const {
+	i.first = i.last + get_varint(p);
+	i.last = i.first + get_varint(p);
+	if (tagged_)
+		i.tag = *p++;
+}
+
+std::optional<CompressedIntervals::Interval> CompressedIntervals::find(unsigned long r) const {
+	if (!blocks_ || r < block_firsts_[0])
+		return {};
+	std::size_t block = block_for(r);
+	const std::uint8_t* p = data_ + block_offsets_[block], *end = data_ + block_offsets_[block+1];
+	Interval i{block_firsts_[block], block_firsts_[block], 0};
+	while (p != end) {
+		decode(p, i);
+		if (r < i.first)
+			return {};
+		if (r < i.last)
+			return i;
+	}
+	return {};
+}
+
+CompressedIntervals::Interval CompressedIntervals::span() const {
+	if (!blocks_)
+		return {0, 0, 0};
+	const std::uint8_t* p = data_ + block_offsets_[blocks_-1], *end = data_ + block_offsets_[blocks_];
+	Interval i{block_firsts_[blocks_-1], block_firsts_[blocks_-1], 0};
+	while (p != end)
+		decode(p, i);
+	return {block_firsts_[0], i.last, 0};
+}
+
+std::optional<CompressedIntervals::Interval> CompressedIntervals::Cursor::find(unsigned long r) {
+	const auto& c = intervals_;
+	if (!c.blocks_ || r < c.block_firsts_[0])
+		return {};
+	if (block_ == ~std::size_t(0) || (block_ + 1 < c.blocks_ && c.block_firsts_[block_+1] <= r)) {
+		block_ = c.block_for(r);
+		p_ = c.data_ + c.block_offsets_[block_];
+		end_ = c.data_ + c.block_offsets_[block_+1];
+		i_ = {c.block_firsts_[block_], c.block_firsts_[block_], 0};
+	}
+	while (i_.last <= r && p_ != end_)
+		c.decode(p_, i_);
+	if (i_.first <= r && r < i_.last)
+		return i_;
+	return {};
+}
+
+void CompressedIntervalWriter::add(unsigned long first, unsigned long last, std::uint8_t tag) {
+	if (first >= last)
+		throw std::logic_error(fmt::format("empty or inverted interval [{}, {})", first, last));
+	if (pending_ && first < pending_->last)
+		throw std::logic_error(fmt::format("interval [{}, {}) out of order or overlapping", first, last));
+	if (pending_ && pending_->last == first && (!tagged_ || pending_->tag == tag)) {
+		pending_->last = last;
+		return;
+	}
+	flush_pending();
+	pending_ = CompressedIntervals::Interval{first, last, tag};
+}
+
+void CompressedIntervalWriter::flush_pending() {
+	if (!pending_) return;
+	if (intervals_ % CompressedIntervals::BLOCK_INTERVALS == 0) {
+		block_firsts_.push_back(pending_->first);
+		block_offsets_.push_back(data_.size());
+		previous_last_ = pending_->first;
+	}
+	put_varint(data_, pending_->first - previous_last_);
+	put_varint(data_, pending_->last - pending_->first);
+	if (tagged_)
+		data_.push_back(pending_->tag);
+	previous_last_ = pending_->last;
+	++intervals_;
+	pending_.reset();
+}
+
+void CompressedIntervalWriter::write(const std::filesystem::path& file) {
+	flush_pending();
+	Header h = {};
+	std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.intervals = intervals_;
+	h.blocks = block_firsts_.size();
+	h.flags = tagged_ ? 1 : 0;
+	h.data_bytes = data_.size();
+	std::array<char, HEADER_BYTES> header = {};
+	std::memcpy(header.data(), &h, sizeof(h));
+	block_offsets_.push_back(data_.size());
+
+	std::filesystem::path tmp_file = file.parent_path() / "tmp" / file.filename();
+	std::filesystem::create_directories(tmp_file.parent_path());
+	UniqueFile f = open_for_writing(tmp_file);
+	write_or_throw(header.data(), 1, header.size(), f.get(), tmp_file);
+	write_or_throw(block_firsts_.data(), sizeof(unsigned long), block_firsts_.size(), f.get(), tmp_file);
+	write_or_throw(block_offsets_.data(), sizeof(unsigned long), block_offsets_.size(), f.get(), tmp_file);
+	write_or_throw(data_.data(), 1, data_.size(), f.get(), tmp_file);
+	sync_and_close(std::move(f), tmp_file);
+	std::filesystem::rename(tmp_file, file);
+	block_offsets_.pop_back();
+}
+
+std::size_t compress_interval_file(const std::filesystem::path& starts, const std::filesystem::path& lengths,
+		const std::optional<std::filesystem::path>& tags, const std::filesystem::path& out) {
+	auto intervals = std::filesystem::file_size(lengths);
+	if (std::filesystem::file_size(starts) != intervals * sizeof(unsigned long) ||
+			(tags && std::filesystem::file_size(*tags) != intervals))
+		throw std::logic_error(fmt::format("size mismatch between {} and its lengths or tags", starts.c_str()));
+	UniqueFile sf = open_or_throw(starts, "r"), lf = open_or_throw(lengths, "r"),
+			tf = tags ? open_or_throw(*tags, "r") : UniqueFile(nullptr, &std::fclose);
+
+	CompressedIntervalWriter writer(tags.has_value());
+	vector<unsigned long> start_buffer(1024*1024);
+	vector<std::uint8_t> length_buffer(start_buffer.size()), tag_buffer(start_buffer.size());
+	while (std::size_t read = std::fread(start_buffer.data(), sizeof(unsigned long), start_buffer.size(), sf.get())) {
+		if (std::fread(length_buffer.data(), 1, read, lf.get()) != read ||
+				(tf && std::fread(tag_buffer.data(), 1, read, tf.get()) != read))
+			throw std::runtime_error(fmt::format("error reading lengths or tags for {}", starts.c_str()));
+		for (std::size_t i = 0; i < read; ++i)
+			writer.add(start_buffer[i], start_buffer[i] + length_buffer[i], tf ? tag_buffer[i] : 0);
+	}
+	if (std::ferror(sf.get())) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error reading {}: error {} ({})",
+				starts.c_str(), strerror(saved_errno), saved_errno));
+	}
+	sf.reset();
+	lf.reset();
+	tf.reset();
+	writer.write(out);
+	return writer.size();
+}
+
+}//namespace pushfight
@@ -0,0 +1,108 @@
+#ifndef COMPRESSED_INTERVALS_HPP
+#define COMPRESSED_INTERVALS_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+namespace pushfight {
+
+/**
+ * A read-only view of a block-compressed interval file (.ivc), which replaces
+ * a .bin/.len (and, for merged indices, .tag) set.  The file is
+ *
+ *   header: 8-byte magic, then interval count, block count, flags (1 if
+ *           tagged) and data bytes as unsigned longs, padded to 64 bytes
+ *   the first start of each block, as unsigned longs
+ *   the byte offset of each block in the data, plus the data size
+ *   data: per interval, LEB128 varints of the gap from the previous
+ *         interval's end (or the block's first start) and the length, then a
+ *         tag byte if tagged
+ *
+ * with BLOCK_INTERVALS intervals per block (fewer in the last).  Lengths
+ * aren't limited to a byte, so runs split by IntervalRuns::write are coalesced.
+ * A lookup binary searches the block starts and decodes one block.
+ */
+class CompressedIntervals {
+public:
+	static constexpr std::size_t BLOCK_INTERVALS = 64;
+	struct Interval {
+		unsigned long first, last;
+		std::uint8_t tag;
+	};
+	//Throws std::logic_error if the data isn't a valid file.
+	CompressedIntervals(const void* data, std::size_t size, const std::filesystem::path& file);
+	std::size_t size() const {return intervals_;}
+	bool tagged() const {return tagged_;}
+	//Returns the interval containing r, if any.
+	std::optional<Interval> find(unsigned long r) const;
+	//Returns the first interval's first and the last interval's last (both 0
+	//if there are none), decoding the last block.
+	Interval span() const;
+	//Calls f(const Interval&) for each interval overlapping [first, last), in order.
+	template<typename F>
+	void for_each(unsigned long first, unsigned long last, F f) const {
+		std::size_t block = block_for(first);
+		for (; block < blocks_ && block_firsts_[block] < last; ++block) {
+			const std::uint8_t* p = data_ + block_offsets_[block], *end = data_ + block_offsets_[block+1];
+			Interval i{block_firsts_[block], block_firsts_[block], 0};
+			while (p != end) {
+				decode(p, i);
+				if (i.first >= last) return;
+				if (i.last > first) f(i);
+			}
+		}
+	}
+	//Looks up a nondecreasing sequence of ranks, decoding forward from the
+	//previous one's interval when it's in the same block.
+	class Cursor {
+	public:
+		explicit Cursor(const CompressedIntervals& intervals) : intervals_(intervals) {}
+		std::optional<Interval> find(unsigned long r);
+	private:
+		const CompressedIntervals& intervals_;
+		std::size_t block_ = ~std::size_t(0);
+		const std::uint8_t* p_ = nullptr, *end_ = nullptr;
+		Interval i_ = {};
+	};
+private:
+	//the block that would contain r (0 if r precedes every interval)
+	std::size_t block_for(unsigned long r) const;
+	//Decodes the interval after i (in place), advancing p.
+	void decode(const std::uint8_t*& p, Interval& i) const;
+
+	std::size_t intervals_, blocks_;
+	bool tagged_;
+	const unsigned long* block_firsts_, *block_offsets_;
+	const std::uint8_t* data_;
+};
+
+//Accumulates sorted, disjoint intervals and writes them as a .ivc file.
+class CompressedIntervalWriter {
+public:
+	explicit CompressedIntervalWriter(bool tagged) : tagged_(tagged) {}
+	//Adjacent intervals with the same tag are coalesced.
+	void add(unsigned long first, unsigned long last, std::uint8_t tag = 0);
+	//The number of intervals after coalescing so far.
+	std::size_t size() const {return intervals_ + (pending_ ? 1 : 0);}
+	//Writes through the file's directory's tmp subdirectory and renames into place.
+	void write(const std::filesystem::path& file);
+private:
+	void flush_pending();
+	bool tagged_;
+	std::optional<CompressedIntervals::Interval> pending_;
+	unsigned long previous_last_ = 0;
+	std::size_t intervals_ = 0;
+	std::vector<unsigned long> block_firsts_, block_offsets_;
+	std::vector<std::uint8_t> data_;
+};
+
+//Converts a .bin/.len (and .tag, if tags is non-empty) set to a .ivc file.
+//Returns the number of intervals written after coalescing.
+std::size_t compress_interval_file(const std::filesystem::path& starts, const std::filesystem::path& lengths,
+		const std::optional<std::filesystem::path>& tags, const std::filesystem::path& out);
+
+}//namespace pushfight
+
+#endif /* COMPRESSED_INTERVALS_HPP */
@@ -0,0 +1,911 @@
+#include "precompiled.hpp"
+#include "database.hpp"
+#include "bulk-writer.hpp"
+#include "intervals.hpp"
+#include "interpolation.hpp"
+#include "unique-file.hpp"
+#include <bit>
+#include <cstring>
+#include <charconv>
+#include <numeric>
+#include <queue>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h> //for mmap
+
+using std::vector;
+using std::pair;
+
+namespace pushfight {
+
+WinLossUnknownDatabase::~WinLossUnknownDatabase() {
+	drop_replicas();
+	for (auto [p, size] : mappings)
+		munmap(p, size);
+}
+
+const void* WinLossUnknownDatabase::map(const std::filesystem::path& file, std::size_t size) {
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd == -1) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error opening {}: error {} ({})",
+				file.c_str(), strerror(saved_errno), saved_errno));
+	}
+	void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED_VALIDATE, fd, 0);
+	auto saved_errno = errno;
+	close(fd);
+	if (p == MAP_FAILED)
+		throw std::runtime_error(fmt::format("error mapping {}: error {} ({})",
+				file.c_str(), strerror(saved_errno), saved_errno));
+	//Disable readahead.
+	madvise(p, size, MADV_RANDOM);
+	mappings.emplace_back(p, size);
+	return p;
+}
+
+void WinLossUnknownDatabase::add_generation(const std::filesystem::path& starts, const std::filesystem::path& lengths, GameValue v, unsigned int generation) {
+	drop_replicas();
+	auto ssz = std::filesystem::file_size(starts);
+	auto lsz = std::filesystem::file_size(lengths);
+	if (ssz == 0 && lsz == 0) return;
+	if (ssz == 0 || lsz == 0)
+		throw std::logic_error(fmt::format("empty/nonempty mismatch between {} and {}",
+				starts.c_str(), lengths.c_str()));
+
+	Data d;
+	d.start.first = reinterpret_cast<const unsigned long*>(map(starts, ssz));
+	d.start.second = d.start.first + ssz / sizeof(unsigned long);
+	d.length.first = reinterpret_cast<const std::uint8_t*>(map(lengths, lsz));
+	d.length.second = d.length.first + lsz / sizeof(std::uint8_t);
+	d.tag = nullptr;
+	d.v = v;
+	d.generation = generation;
+	map_btree(starts, d);
+	map_bloom(starts, d);
+	data.push_back(std::move(d));
+}
+
+//Dense table entries are 2 bits, four to a byte, lowest first.  Zero is
+//UNKNOWN so a fresh table is all unknown.
+static constexpr GameValue DENSE_VALUES[4] = {UNKNOWN, WIN, LOSS, DRAW};
+static constexpr std::uint8_t dense_code(GameValue v) {
+	return v == WIN ? 1 : v == LOSS ? 2 : v == DRAW ? 3 : 0;
+}
+
+std::size_t dense_table_bytes(const Board& board) {
+	return (Unranker(board).dense_limit() + 3) / 4;
+}
+
+void WinLossUnknownDatabase::add_dense_table(const std::filesystem::path& file, const Board& board) {
+	if (dense)
+		throw std::logic_error(fmt::format("adding {}, but already have a dense table", file.c_str()));
+	drop_replicas();
+	auto size = std::filesystem::file_size(file);
+	if (size != dense_table_bytes(board))
+		throw std::logic_error(fmt::format("{} has size {}, expected {} for {}",
+				file.c_str(), size, dense_table_bytes(board), board.name()));
+	dense = reinterpret_cast<const std::uint8_t*>(map(file, size));
+	dense_bytes = size;
+	dense_unranker.emplace(board);
+}
+
+GameValue WinLossUnknownDatabase::query_dense(const std::uint8_t* table, unsigned long r) const {
+	auto index = dense_unranker->dense_index(r);
+	if (index == dense_unranker->dense_limit())
+		return UNKNOWN;
+	return DENSE_VALUES[(table[index / 4] >> (2 * (index % 4))) & 3];
+}
+
+void WinLossUnknownDatabase::add_merged_index(const std::filesystem::path& starts, const std::filesystem::path& lengths, const std::filesystem::path& tags) {
+	drop_replicas();
+	auto ssz = std::filesystem::file_size(starts);
+	auto lsz = std::filesystem::file_size(lengths);
+	auto tsz = std::filesystem::file_size(tags);
+	if (ssz != lsz * sizeof(unsigned long) || lsz != tsz)
+		throw std::logic_error(fmt::format("size mismatch between {}, {} and {}",
+				starts.c_str(), lengths.c_str(), tags.c_str()));
+	if (ssz == 0) return;
+
+	Data d;
+	d.start.first = reinterpret_cast<const unsigned long*>(map(starts, ssz));
+	d.start.second = d.start.first + ssz / sizeof(unsigned long);
+	d.length.first = reinterpret_cast<const std::uint8_t*>(map(lengths, lsz));
+	d.length.second = d.length.first + lsz / sizeof(std::uint8_t);
+	d.tag = reinterpret_cast<const std::uint8_t*>(map(tags, tsz));
+	d.v = UNKNOWN;
+	d.generation = 0;
+	map_btree(starts, d);
+	map_bloom(starts, d);
+	data.push_back(std::move(d));
+}
+
+void WinLossUnknownDatabase::add_compressed(const std::filesystem::path& file, GameValue v, unsigned int generation) {
+	drop_replicas();
+	auto size = std::filesystem::file_size(file);
+	Data d = {};
+	d.compressed.emplace(map(file, size), size, file);
+	if (d.compressed->size() == 0) return;
+	d.tag = nullptr;
+	d.v = v;
+	d.generation = generation;
+	map_bloom(file, d);
+	data.push_back(std::move(d));
+}
+
+void WinLossUnknownDatabase::replicate_hot_index(const vector<NumaNode>& nodes) {
+	drop_replicas();
+	for (const NumaNode& node : nodes) {
+		auto copy = [&](const void* p, std::size_t size) -> void* {
+			void* q = map_node_memory(size, node.id);
+			replica_mappings.emplace_back(q, size);
+			std::memcpy(q, p, size);
+			return q;
+		};
+		auto replica = std::make_unique<Replica>();
+		replica->dense = dense ? static_cast<const std::uint8_t*>(copy(dense, dense_bytes)) : nullptr;
+		replica->data = data;
+		for (Data& d : replica->data) {
+			auto sizes = btree_level_sizes(static_cast<std::size_t>(d.start.second - d.start.first));
+			for (std::size_t i = 0; i < d.btree_levels.size(); ++i)
+				d.btree_levels[i] = static_cast<const unsigned long*>(copy(d.btree_levels[i], sizes[i] * sizeof(unsigned long)));
+			if (!d.bloom.empty())
+				d.bloom = {static_cast<const std::uint64_t*>(copy(d.bloom.data(), d.bloom.size_bytes())), d.bloom.size()};
+		}
+		if (replicas.size() <= node.id)
+			replicas.resize(node.id + 1);
+		replicas[node.id] = std::move(replica);
+	}
+}
+
+void WinLossUnknownDatabase::drop_replicas() {
+	replicas.clear();
+	for (auto [p, size] : replica_mappings)
+		unmap_node_memory(p, size);
+	replica_mappings.clear();
+}
+
+//Pool threads in NUMA mode stay on their node, so look it up once.
+static unsigned int thread_numa_node() {
+	static thread_local unsigned int node = current_numa_node();
+	return node;
+}
+
+const WinLossUnknownDatabase::Replica* WinLossUnknownDatabase::local_replica() const {
+	if (replicas.empty()) return nullptr;
+	unsigned int node = thread_numa_node();
+	return node < replicas.size() ? replicas[node].get() : nullptr;
+}
+
+void WinLossUnknownDatabase::invalidate_query_caches() {
+	//Caches reset when their stats pointer doesn't match.
+	cache_stats = std::make_shared<CacheStats>();
+}
+
+//Index files built from interval files end with this, identifying the
+//intervals they were built from so one left over from other data is rejected
+//rather than giving wrong answers.
+static constexpr char SIDECAR_MAGIC[8] = {'P', 'F', 'S', 'I', 'D', 'E', '0', '1'};
+struct SidecarTrailer {
+	char magic[8];
+	//the interval count, the first interval's start and the last one's end
+	unsigned long intervals, first, last;
+};
+
+static SidecarTrailer make_trailer(std::size_t intervals, unsigned long first, unsigned long last) {
+	SidecarTrailer t;
+	std::memcpy(t.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC));
+	t.intervals = intervals;
+	t.first = first;
+	t.last = last;
+	return t;
+}
+
+static SidecarTrailer make_trailer(const WinLossUnknownDatabase::Data& d) {
+	if (d.compressed) {
+		auto span = d.compressed->span();
+		return make_trailer(d.compressed->size(), span.first, span.last);
+	}
+	std::size_t n = static_cast<std::size_t>(d.start.second - d.start.first);
+	return make_trailer(n, d.start.first[0], d.start.second[-1] + d.length.second[-1]);
+}
+
+//Throws if the trailer at the end of the mapped file doesn't match expected.
+static void check_trailer(const std::filesystem::path& file, const void* p, std::size_t size, const SidecarTrailer& expected) {
+	SidecarTrailer t;
+	std::memcpy(&t, static_cast<const char*>(p) + size - sizeof(t), sizeof(t));
+	if (std::memcmp(t.magic, SIDECAR_MAGIC, sizeof(SIDECAR_MAGIC)))
+		throw std::logic_error(fmt::format("{} has no trailer; rebuild it", file.c_str()));
+	if (t.intervals != expected.intervals || t.first != expected.first || t.last != expected.last)
+		throw std::logic_error(fmt::format("{} was built from {} intervals over [{}, {}), not the {} over [{}, {}) beside it",
+				file.c_str(), t.intervals, t.first, t.last, expected.intervals, expected.first, expected.last));
+}
+
+void WinLossUnknownDatabase::map_btree(const std::filesystem::path& starts, Data& d) {
+	std::filesystem::path file = starts;
+	file.replace_extension(".btree");
+	if (!std::filesystem::is_regular_file(file))
+		return;
+	auto sizes = btree_level_sizes(static_cast<std::size_t>(d.start.second - d.start.first));
+	std::size_t keys = std::accumulate(sizes.begin(), sizes.end(), std::size_t(0));
+	auto size = std::filesystem::file_size(file);
+	if (size != keys * sizeof(unsigned long) + sizeof(SidecarTrailer))
+		throw std::logic_error(fmt::format("{} has size {}, expected {}",
+				file.c_str(), size, keys * sizeof(unsigned long) + sizeof(SidecarTrailer)));
+	const unsigned long* p = reinterpret_cast<const unsigned long*>(map(file, size));
+	check_trailer(file, p, size, make_trailer(d));
+	for (std::size_t s : sizes) {
+		d.btree_levels.push_back(p);
+		p += s;
+	}
+}
+
+static std::uint64_t mix64(std::uint64_t x) {
+	//splitmix64's finalizer
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9UL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebUL;
+	x ^= x >> 31;
+	return x;
+}
+
+//Bloom filters hold which 256-rank buckets an interval file touches; a
+//length is a byte, so each interval touches at most two.  Filters are arrays
+//of 64-byte blocks; a bucket sets one bit in each of its block's 8 words.
+constexpr unsigned int BLOOM_BUCKET_BITS = 8;
+constexpr std::size_t BLOOM_BLOCK_WORDS = 8;
+
+//Calls f(word index, bit mask) for each bit of the given bucket.
+template<typename F>
+static void bloom_probe(std::size_t blocks, unsigned long bucket, F f) {
+	std::uint64_t h = mix64(bucket), bits = mix64(h);
+	std::size_t block = h & (blocks - 1);
+	for (std::size_t i = 0; i < BLOOM_BLOCK_WORDS; ++i)
+		f(block * BLOOM_BLOCK_WORDS + i, std::uint64_t(1) << ((bits >> (6 * i)) & 63));
+}
+
+static bool bloom_may_contain(std::span<const std::uint64_t> bloom, unsigned long r) {
+	bool present = true;
+	bloom_probe(bloom.size() / BLOOM_BLOCK_WORDS, r >> BLOOM_BUCKET_BITS, [&](std::size_t word, std::uint64_t mask) {
+		present &= (bloom[word] & mask) != 0;
+	});
+	return present;
+}
+
+void WinLossUnknownDatabase::map_bloom(const std::filesystem::path& starts, Data& d) {
+	std::filesystem::path file = starts;
+	file.replace_extension(".bloom");
+	if (!std::filesystem::is_regular_file(file))
+		return;
+	auto size = std::filesystem::file_size(file);
+	std::size_t bytes = size - std::min<std::size_t>(size, sizeof(SidecarTrailer)),
+			blocks = bytes / (BLOOM_BLOCK_WORDS * sizeof(std::uint64_t));
+	if (size < sizeof(SidecarTrailer) || bytes % (BLOOM_BLOCK_WORDS * sizeof(std::uint64_t)) || !std::has_single_bit(blocks))
+		throw std::logic_error(fmt::format("{} has size {}, not a power-of-two number of blocks and a trailer", file.c_str(), size));
+	const void* p = map(file, size);
+	check_trailer(file, p, size, make_trailer(d));
+	d.bloom = {reinterpret_cast<const std::uint64_t*>(p), bytes / sizeof(std::uint64_t)};
+}
+
+//Counts the keys <= r.  Written without branches so it vectorizes.
+static std::size_t count_le(const unsigned long* keys, std::size_t size, unsigned long r) {
+	std::size_t c = 0;
+	for (std::size_t k = 0; k < size; ++k)
+		c += keys[k] <= r;
+	return c;
+}
+
+SearchStrategy search_strategy_from_string(std::string_view name) {
+	for (auto [strategy, strategy_name] : SEARCH_STRATEGY_NAMES)
+		if (name == strategy_name)
+			return strategy;
+	throw std::logic_error(fmt::format("unknown search strategy: {}", name));
+}
+
+static const unsigned long* hybrid_upper_bound(const unsigned long* first, const unsigned long* last, unsigned long r) {
+	if (first == last || r < *first)
+		return first;
+	if (*(last-1) <= r)
+		return last;
+	//Now first[0] <= r < first[n-1], so the guess is in [0, n-1).
+	std::size_t n = static_cast<std::size_t>(last - first);
+	auto guess = static_cast<std::size_t>((double)(r - *first) / (double)(*(last-1) - *first) * (double)(n - 1));
+	std::size_t step = 1;
+	if (first[guess] <= r) {
+		//The answer is in (lo, lo+step].
+		std::size_t lo = guess;
+		while (lo + step < n && first[lo + step] <= r) {
+			lo += step;
+			step *= 2;
+		}
+		return std::upper_bound(first + lo + 1, first + std::min(n, lo + step), r);
+	} else {
+		//The answer is in (hi-step, hi].
+		std::size_t hi = guess;
+		while (hi >= step && first[hi - step] > r) {
+			hi -= step;
+			step *= 2;
+		}
+		return std::upper_bound(first + (hi >= step ? hi - step + 1 : 0), first + hi, r);
+	}
+}
+
+std::ptrdiff_t WinLossUnknownDatabase::Data::floor(unsigned long r, SearchStrategy strategy) const {
+	if (strategy == SearchStrategy::INTERPOLATION)
+		return std::distance(start.first, interp::upper_bound(start.first, start.second, r)) - 1;
+	if (strategy == SearchStrategy::HYBRID)
+		return std::distance(start.first, hybrid_upper_bound(start.first, start.second, r)) - 1;
+	if (strategy == SearchStrategy::BINARY || btree_levels.empty())
+		return std::distance(start.first, std::upper_bound(start.first, start.second, r)) - 1;
+
+	//Each node's keys are the first keys of its children, so we descend into
+	//the child before the first key > r.  Padding keys are ~0UL, which is
+	//never a rank.  Only the root can have no keys <= r (if r < start[0]).
+	std::size_t node = 0;
+	for (const unsigned long* level : btree_levels) {
+		std::size_t c = count_le(level + node * BTREE_NODE_KEYS, BTREE_NODE_KEYS, r);
+		if (c == 0) return -1;
+		node = node * BTREE_NODE_KEYS + c - 1;
+	}
+	//The leaves are blocks of the (unpadded) start array.  The caller will want
+	//the length (and tag) next, so get those loads going while we scan.
+	std::size_t first = node * BTREE_NODE_KEYS;
+	__builtin_prefetch(length.first + first);
+	if (tag) __builtin_prefetch(tag + first);
+	std::size_t size = std::min(BTREE_NODE_KEYS, static_cast<std::size_t>(start.second - start.first) - first);
+	return static_cast<std::ptrdiff_t>(first + count_le(start.first + first, size, r)) - 1;
+}
+
+namespace {
+struct QueryCache {
+	std::shared_ptr<WinLossUnknownDatabase::CacheStats> stats;
+	//rank << 2 | GameValue, or ~0UL if empty (which is never a rank << 2)
+	vector<unsigned long> entries;
+	unsigned long hits = 0, misses = 0;
+	~QueryCache() {
+		publish();
+	}
+	void publish() {
+		if (!stats) return;
+		stats->hits += hits;
+		stats->misses += misses;
+		hits = misses = 0;
+	}
+	void reset(const std::shared_ptr<WinLossUnknownDatabase::CacheStats>& new_stats, std::size_t size) {
+		publish();
+		stats = new_stats;
+		entries.assign(std::bit_ceil(size), ~0UL);
+	}
+};
+}
+static thread_local QueryCache query_cache;
+
+void publish_query_cache_stats(ThreadPool& pool) {
+	pool.run_on_each([](unsigned int) {query_cache.publish();});
+	query_cache.publish();
+}
+
+GameValue WinLossUnknownDatabase::query(unsigned long r) const {
+	if (!cache_entries || data.empty())
+		return query_resolution(r).value;
+	QueryCache& cache = query_cache;
+	if (cache.stats != cache_stats)
+		cache.reset(cache_stats, cache_entries);
+	unsigned long& entry = cache.entries[mix64(r) & (cache.entries.size() - 1)];
+	GameValue v;
+	if (entry >> 2 == r) {
+		++cache.hits;
+		v = static_cast<GameValue>(entry & 3);
+	} else {
+		++cache.misses;
+		v = query_resolution(r).value;
+		entry = r << 2 | v;
+	}
+	if (cache.hits + cache.misses == 64*1024)
+		cache.publish();
+	return v;
+}
+
+bool WinLossUnknownDatabase::sample_numa_access() const {
+	static thread_local unsigned int numa_sample_counter = 0;
+	return numa_stats && ++numa_sample_counter % 256 == 0;
+}
+
+void WinLossUnknownDatabase::count_numa_access(const void* p) const {
+	int node = memory_node(p);
+	if (node < 0) return;
+	++(static_cast<unsigned int>(node) == thread_numa_node() ? numa_stats->local : numa_stats->remote);
+}
+
+Resolution WinLossUnknownDatabase::query_resolution(unsigned long r) const {
+	const std::uint8_t* table = dense;
+	const vector<Data>* ds = &data;
+	if (const Replica* replica = local_replica()) {
+		table = replica->dense;
+		ds = &replica->data;
+	}
+	bool sample = sample_numa_access();
+
+	if (table) {
+		if (sample)
+			if (auto index = dense_unranker->dense_index(r); index != dense_unranker->dense_limit())
+				count_numa_access(table + index / 4);
+		if (GameValue v = query_dense(table, r); v != UNKNOWN)
+			return {v, UNKNOWN_GENERATION};
+	}
+	for (const Data& d : *ds) {
+		if (!d.bloom.empty() && !bloom_may_contain(d.bloom, r))
+			continue;
+		if (d.compressed) {
+			if (auto i = d.compressed->find(r)) {
+				if (d.compressed->tagged())
+					return {i->tag & 1 ? LOSS : WIN, static_cast<unsigned int>(i->tag >> 1)};
+				return {d.v, d.generation};
+			}
+			continue;
+		}
+		auto offset = d.floor(r, strategy);
+		if (offset < 0) continue;
+		auto p = d.start.first + offset;
+		if (sample)
+			count_numa_access(p);
+		if (r < *p + d.length.first[offset]) {
+			if (d.tag)
+				return {d.tag[offset] & 1 ? LOSS : WIN, static_cast<unsigned int>(d.tag[offset] >> 1)};
+			return {d.v, d.generation};
+		}
+	}
+	return {UNKNOWN, 0};
+}
+
+void WinLossUnknownDatabase::query_sorted(std::span<const unsigned long> ranks, std::span<GameValue> values) const {
+	if (ranks.size() != values.size())
+		throw std::logic_error(fmt::format("query_sorted size mismatch: {} ranks, {} values", ranks.size(), values.size()));
+	assert(std::is_sorted(ranks.begin(), ranks.end()));
+	const std::uint8_t* table = dense;
+	if (const Replica* replica = local_replica())
+		table = replica->dense;
+	//Batches are large, so sample one access from each.
+	bool sample = numa_stats && !ranks.empty();
+	if (table) {
+		if (sample)
+			if (auto index = dense_unranker->dense_index(ranks[0]); index != dense_unranker->dense_limit())
+				count_numa_access(table + index / 4);
+		for (std::size_t i = 0; i < ranks.size(); ++i)
+			values[i] = query_dense(table, ranks[i]);
+	} else
+		std::fill(values.begin(), values.end(), UNKNOWN);
+	for (const Data& d : data) {
+		if (d.compressed) {
+			CompressedIntervals::Cursor cursor(*d.compressed);
+			for (std::size_t i = 0; i < ranks.size(); ++i)
+				if (values[i] == UNKNOWN)
+					if (auto interval = cursor.find(ranks[i]))
+						values[i] = d.compressed->tagged() ? (interval->tag & 1 ? LOSS : WIN) : d.v;
+			continue;
+		}
+		const unsigned long* start = d.start.first;
+		std::size_t n = static_cast<std::size_t>(d.start.second - d.start.first);
+		if (sample && n)
+			count_numa_access(start);
+		//lo is the upper bound of the previous rank, so every start before it is
+		//<= the current rank.
+		std::size_t lo = 0;
+		for (std::size_t i = 0; i < ranks.size(); ++i) {
+			if (values[i] != UNKNOWN) continue;
+			unsigned long r = ranks[i];
+			std::size_t hi = lo, step = 1;
+			while (hi < n && start[hi] <= r) {
+				lo = hi + 1;
+				hi += step;
+				step *= 2;
+			}
+			lo = static_cast<std::size_t>(std::upper_bound(start + lo, start + std::min(hi, n), r) - start);
+			if (lo == 0) continue;
+			std::size_t offset = lo - 1;
+			if (r < start[offset] + d.length.first[offset])
+				values[i] = d.tag ? (d.tag[offset] & 1 ? LOSS : WIN) : d.v;
+		}
+	}
+}
+
+vector<pair<unsigned long, unsigned long>> WinLossUnknownDatabase::known_intervals(unsigned long first, unsigned long last) const {
+	vector<pair<unsigned long, unsigned long>> known;
+	if (dense) {
+		//Most numbers in a rank range aren't ranks, so unrank to find the ones
+		//that are.
+		constexpr unsigned long chunk_size = 64*1024;
+		vector<State> states(chunk_size);
+		vector<unsigned long> ranks(chunk_size), resolved;
+		for (unsigned long chunk = first; chunk < last; chunk += std::min(chunk_size, last - chunk)) {
+			std::size_t count = dense_unranker->unrank(chunk, chunk + std::min(chunk_size, last - chunk), states.data(), ranks.data());
+			for (std::size_t i = 0; i < count; ++i)
+				if (query_dense(dense, ranks[i]) != UNKNOWN)
+					resolved.push_back(ranks[i]);
+		}
+		known = maximal_intervals(resolved);
+	}
+	for (const Data& d : data) {
+		if (d.compressed) {
+			d.compressed->for_each(first, last, [&](const CompressedIntervals::Interval& i) {
+				known.emplace_back(std::max(i.first, first), std::min(i.last, last));
+			});
+			continue;
+		}
+		//The interval containing first (if any) starts at or before it.
+		auto p = d.start.first + std::max(d.floor(first, strategy), std::ptrdiff_t(0));
+		auto q = d.length.first + std::distance(d.start.first, p);
+		for (; p != d.start.second && *p < last; ++p, ++q)
+			if (*p + *q > first)
+				known.emplace_back(std::max(*p, first), std::min(*p + *q, last));
+	}
+	std::sort(known.begin(), known.end());
+	return interval_coalesce(known.begin(), known.end());
+}
+
+//Parses G from {prefix}-{G}{suffix}.
+static std::optional<unsigned int> generation_of_file(const std::filesystem::path& file, std::string_view prefix, std::string_view suffix) {
+	std::string name = file.filename();
+	if (name.size() <= prefix.size() + 1 + suffix.size() || !name.starts_with(prefix) ||
+			name[prefix.size()] != '-' || !name.ends_with(suffix))
+		return {};
+	unsigned int generations;
+	const char* first = name.data() + prefix.size() + 1, *last = name.data() + name.size() - suffix.size();
+	if (auto [ptr, ec] = std::from_chars(first, last, generations, 10); ec != std::errc() || ptr != last)
+		return {};
+	return generations;
+}
+
+//Returns the largest G (<= max_generations, if given) for which the
+//{prefix}-{G}{extensions...} files all exist, or 0 if none.
+static unsigned int largest_generation_file(const std::filesystem::path& data_dir, std::optional<unsigned int> max_generations,
+		std::string_view prefix, std::initializer_list<std::string_view> extensions) {
+	unsigned int largest = 0;
+	for (const auto& entry : std::filesystem::directory_iterator(data_dir)) {
+		auto g = generation_of_file(entry.path(), prefix, *extensions.begin());
+		if (!g || (max_generations && *g > *max_generations) || *g <= largest) continue;
+		if (std::all_of(extensions.begin(), extensions.end(), [&](std::string_view ext) {
+					return std::filesystem::is_regular_file(data_dir / fmt::format("{}-{}{}", prefix, *g, ext));
+				}))
+			largest = *g;
+	}
+	return largest;
+}
+
+std::unique_ptr<WinLossUnknownDatabase> load_database(const std::filesystem::path& data_dir, std::optional<unsigned int> generations,
+		const Board* dense_board) {
+	auto wldb = std::make_unique<WinLossUnknownDatabase>();
+
+	//Added first so they're searched first, as they cover the most ranks.
+	unsigned int merged = largest_generation_file(data_dir, generations, "merged", {".bin", ".len", ".tag"});
+	unsigned int merged_compressed = largest_generation_file(data_dir, generations, "merged", {".ivc"});
+	unsigned int dense = dense_board ? largest_generation_file(data_dir, generations, "dense", {".bits"}) : 0;
+	if (dense && dense >= std::max(merged, merged_compressed))
+		wldb->add_dense_table(data_dir / fmt::format("dense-{}.bits", dense), *dense_board);
+	else if (merged_compressed && merged_compressed >= merged)
+		wldb->add_compressed(data_dir / fmt::format("merged-{}.ivc", merged_compressed), UNKNOWN, 0);
+	else if (merged)
+		wldb->add_merged_index(data_dir / fmt::format("merged-{}.bin", merged),
+				data_dir / fmt::format("merged-{}.len", merged),
+				data_dir / fmt::format("merged-{}.tag", merged));
+
+	for (unsigned int g = std::max({merged, merged_compressed, dense}); !generations || g < *generations; ++g) {
+		//Each of the win and loss files may be compressed or not.
+		std::array<std::filesystem::path, 2> compressed = {
+			data_dir / fmt::format("win-{}.ivc", g),
+			data_dir / fmt::format("loss-{}.ivc", g),
+		};
+		vector<std::filesystem::path> expected;
+		for (int i = 0; i < 2; ++i)
+			if (std::filesystem::is_regular_file(compressed[i]))
+				expected.push_back(compressed[i]);
+			else {
+				expected.push_back(data_dir / fmt::format("{}-{}.bin", i ? "loss" : "win", g));
+				expected.push_back(data_dir / fmt::format("{}-{}.len", i ? "loss" : "win", g));
+			}
+		auto present_count = std::count_if(expected.begin(), expected.end(), [](const auto& p) {
+			return std::filesystem::is_regular_file(p);
+		});
+		if (present_count == 0 && !generations)
+			break;
+		else if (present_count != static_cast<std::ptrdiff_t>(expected.size()))
+			for (const auto& p : expected)
+				if (!std::filesystem::is_regular_file(p))
+					throw std::runtime_error(fmt::format("expected {} to exist", p.c_str()));
+		for (int i = 0; i < 2; ++i) {
+			GameValue v = i ? LOSS : WIN;
+			if (std::filesystem::is_regular_file(compressed[i]))
+				wldb->add_compressed(compressed[i], v, g);
+			else
+				wldb->add_generation(data_dir / fmt::format("{}-{}.bin", i ? "loss" : "win", g),
+						data_dir / fmt::format("{}-{}.len", i ? "loss" : "win", g), v, g);
+		}
+	}
+	return wldb;
+}
+
+vector<std::size_t> btree_level_sizes(std::size_t n) {
+	vector<std::size_t> sizes;
+	if (n == 0) return sizes;
+	//Each level has one key per node of the level below, starting with one
+	//per leaf node (block of the start array), until one node suffices.
+	std::size_t keys = (n + BTREE_NODE_KEYS - 1) / BTREE_NODE_KEYS;
+	while (true) {
+		sizes.push_back((keys + BTREE_NODE_KEYS - 1) / BTREE_NODE_KEYS * BTREE_NODE_KEYS);
+		if (keys <= BTREE_NODE_KEYS) break;
+		keys = (keys + BTREE_NODE_KEYS - 1) / BTREE_NODE_KEYS;
+	}
+	std::reverse(sizes.begin(), sizes.end());
+	return sizes;
+}
+
+void build_btree_index(const std::filesystem::path& starts) {
+	UniqueFile in = open_or_throw(starts, "r");
+	//Stream the start file, keeping the first key of each leaf node.
+	vector<vector<unsigned long>> levels(1);
+	vector<unsigned long> buffer(1024*1024);
+	std::size_t n = 0;
+	unsigned long previous = 0;
+	while (std::size_t read = std::fread(buffer.data(), sizeof(unsigned long), buffer.size(), in.get())) {
+		for (std::size_t i = 0; i < read; ++i, ++n) {
+			if (n && buffer[i] <= previous)
+				throw std::logic_error(fmt::format("{} is not sorted at index {}", starts.c_str(), n));
+			previous = buffer[i];
+			if (n % BTREE_NODE_KEYS == 0)
+				levels.back().push_back(buffer[i]);
+		}
+	}
+	if (std::ferror(in.get())) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error reading {}: error {} ({})",
+				starts.c_str(), strerror(saved_errno), saved_errno));
+	}
+	in.reset();
+	//The trailer needs the last interval's end, from the last length.
+	unsigned long last = 0;
+	if (n) {
+		std::filesystem::path lengths = starts;
+		lengths.replace_extension(".len");
+		if (std::filesystem::file_size(lengths) != n)
+			throw std::logic_error(fmt::format("size mismatch between {} and {}", starts.c_str(), lengths.c_str()));
+		UniqueFile lf(std::fopen(lengths.c_str(), "r"), &std::fclose);
+		int length = lf && std::fseek(lf.get(), static_cast<long>(n) - 1, SEEK_SET) == 0 ? std::fgetc(lf.get()) : EOF;
+		auto saved_errno = errno;
+		if (length == EOF)
+			throw std::runtime_error(fmt::format("error reading {}: error {} ({})",
+					lengths.c_str(), strerror(saved_errno), saved_errno));
+		last = previous + static_cast<unsigned long>(length);
+	}
+
+	while (levels.back().size() > BTREE_NODE_KEYS) {
+		vector<unsigned long> next;
+		for (std::size_t i = 0; i < levels.back().size(); i += BTREE_NODE_KEYS)
+			next.push_back(levels.back()[i]);
+		levels.push_back(std::move(next));
+	}
+	std::reverse(levels.begin(), levels.end());
+	auto sizes = btree_level_sizes(n);
+	if (n == 0) levels.clear();
+	assert(levels.size() == sizes.size());
+	for (std::size_t i = 0; i < levels.size(); ++i)
+		levels[i].resize(sizes[i], ~0UL);
+
+	std::filesystem::path file = starts, tmp_file = starts.parent_path() / "tmp" / starts.filename();
+	file.replace_extension(".btree");
+	tmp_file.replace_extension(".btree");
+	std::filesystem::create_directories(tmp_file.parent_path());
+	UniqueFile out = open_for_writing(tmp_file);
+	for (const auto& level : levels)
+		write_or_throw(level.data(), sizeof(unsigned long), level.size(), out.get(), tmp_file);
+	SidecarTrailer trailer = make_trailer(n, n ? levels.back()[0] : 0, last);
+	write_or_throw(&trailer, sizeof(trailer), 1, out.get(), tmp_file);
+	sync_and_close(std::move(out), tmp_file);
+	std::filesystem::rename(tmp_file, file);
+}
+
+void build_bloom_filter(const std::filesystem::path& starts, const std::filesystem::path& lengths) {
+	auto intervals = std::filesystem::file_size(lengths);
+	if (std::filesystem::file_size(starts) != intervals * sizeof(unsigned long))
+		throw std::logic_error(fmt::format("size mismatch between {} and {}", starts.c_str(), lengths.c_str()));
+	//16 bits per interval, rounded up to a power of two blocks.
+	std::size_t blocks = std::bit_ceil(std::max<std::size_t>(1, intervals * 16 / (BLOOM_BLOCK_WORDS * 64)));
+	vector<std::uint64_t> bloom(blocks * BLOOM_BLOCK_WORDS);
+
+	UniqueFile sf = open_or_throw(starts, "r"), lf = open_or_throw(lengths, "r");
+	vector<unsigned long> start_buffer(1024*1024);
+	vector<std::uint8_t> length_buffer(start_buffer.size());
+	unsigned long first_start = 0, last_end = 0;
+	while (std::size_t read = std::fread(start_buffer.data(), sizeof(unsigned long), start_buffer.size(), sf.get())) {
+		if (std::fread(length_buffer.data(), sizeof(std::uint8_t), read, lf.get()) != read)
+			throw std::runtime_error(fmt::format("error reading {}", lengths.c_str()));
+		if (!last_end)
+			first_start = start_buffer[0];
+		last_end = start_buffer[read - 1] + length_buffer[read - 1];
+		for (std::size_t i = 0; i < read; ++i) {
+			unsigned long first = start_buffer[i] >> BLOOM_BUCKET_BITS,
+					last = (start_buffer[i] + length_buffer[i] - 1) >> BLOOM_BUCKET_BITS;
+			for (unsigned long bucket = first; bucket <= last; ++bucket)
+				bloom_probe(blocks, bucket, [&](std::size_t word, std::uint64_t mask) {
+					bloom[word] |= mask;
+				});
+		}
+	}
+	if (std::ferror(sf.get()) || std::ferror(lf.get())) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error reading {} or {}: error {} ({})",
+				starts.c_str(), lengths.c_str(), strerror(saved_errno), saved_errno));
+	}
+	sf.reset();
+	lf.reset();
+
+	std::filesystem::path file = starts, tmp_file = starts.parent_path() / "tmp" / starts.filename();
+	file.replace_extension(".bloom");
+	tmp_file.replace_extension(".bloom");
+	std::filesystem::create_directories(tmp_file.parent_path());
+	UniqueFile out = open_for_writing(tmp_file);
+	write_or_throw(bloom.data(), sizeof(std::uint64_t), bloom.size(), out.get(), tmp_file);
+	SidecarTrailer trailer = make_trailer(intervals, first_start, last_end);
+	write_or_throw(&trailer, sizeof(trailer), 1, out.get(), tmp_file);
+	sync_and_close(std::move(out), tmp_file);
+	std::filesystem::rename(tmp_file, file);
+}
+
+void build_dense_table(const std::filesystem::path& data_dir, unsigned int generations, const Board& board) {
+	//This may itself use a smaller dense table, which we start from.
+	auto wldb = load_database(data_dir, generations, &board);
+	Unranker unranker(board);
+	vector<std::uint8_t> table(dense_table_bytes(board));
+	if (wldb->dense)
+		std::copy(wldb->dense, wldb->dense + table.size(), table.begin());
+	auto set = [&](unsigned long r, GameValue v) {
+		auto index = unranker.dense_index(r);
+		if (index == unranker.dense_limit())
+			throw std::logic_error(fmt::format("{} has no dense index", r));
+		table[index / 4] = static_cast<std::uint8_t>(table[index / 4] | dense_code(v) << (2 * (index % 4)));
+	};
+	for (const auto& d : wldb->data) {
+		if (d.compressed) {
+			d.compressed->for_each(0, std::numeric_limits<unsigned long>::max(), [&](const CompressedIntervals::Interval& i) {
+				GameValue v = d.compressed->tagged() ? (i.tag & 1 ? LOSS : WIN) : d.v;
+				for (unsigned long r = i.first; r < i.last; ++r)
+					set(r, v);
+			});
+			continue;
+		}
+		for (auto p = d.start.first; p != d.start.second; ++p) {
+			auto offset = p - d.start.first;
+			GameValue v = d.tag ? (d.tag[offset] & 1 ? LOSS : WIN) : d.v;
+			for (unsigned long r = *p; r < *p + d.length.first[offset]; ++r)
+				set(r, v);
+		}
+	}
+
+	std::string name = fmt::format("dense-{}.bits", generations);
+	std::filesystem::path tmp_file = data_dir / "tmp" / name;
+	std::filesystem::create_directories(tmp_file.parent_path());
+	UniqueFile f = open_for_writing(tmp_file);
+	write_or_throw(table.data(), sizeof(std::uint8_t), table.size(), f.get(), tmp_file);
+	sync_and_close(std::move(f), tmp_file);
+	std::filesystem::rename(tmp_file, data_dir / name);
+}
+
+void build_merged_index(const std::filesystem::path& data_dir, unsigned int generations) {
+	if (generations > std::numeric_limits<std::uint8_t>::max() >> 1)
+		throw std::logic_error(fmt::format("too many generations for a merged index: {}", generations));
+	//This may itself use a smaller merged index, which is fine.
+	auto wldb = load_database(data_dir, generations);
+	for (const auto& d : wldb->data)
+		if (d.compressed)
+			throw std::logic_error(fmt::format("can't merge compressed generations in {}", data_dir.c_str()));
+
+	std::filesystem::path tmp_dir = data_dir / "tmp";
+	std::filesystem::create_directories(tmp_dir);
+	std::array<std::string, 3> names = {
+		fmt::format("merged-{}.bin", generations),
+		fmt::format("merged-{}.len", generations),
+		fmt::format("merged-{}.tag", generations),
+	};
+	BulkWriter sf(tmp_dir / names[0], false), lf(tmp_dir / names[1], false), tf(tmp_dir / names[2], false);
+
+	//k-way merge by start, with the cursor's position in each Data.
+	using Cursor = pair<unsigned long, std::size_t>;
+	std::priority_queue<Cursor, vector<Cursor>, std::greater<>> heap;
+	vector<std::size_t> positions(wldb->data.size(), 0);
+	for (std::size_t i = 0; i < wldb->data.size(); ++i)
+		heap.push(Cursor(wldb->data[i].start.first[0], i));
+
+	//Coalesce adjacent intervals with the same tag, up to the length limit.
+	unsigned long pending_start = 0;
+	unsigned int pending_length = 0;
+	std::uint8_t pending_tag = 0;
+	auto flush_pending = [&]() {
+		if (!pending_length) return;
+		sf.write(pending_start);
+		lf.write(static_cast<std::uint8_t>(pending_length));
+		tf.write(pending_tag);
+	};
+	while (!heap.empty()) {
+		auto [start, i] = heap.top();
+		heap.pop();
+		const auto& d = wldb->data[i];
+		std::size_t pos = positions[i]++;
+		if (d.start.first + positions[i] != d.start.second)
+			heap.push(Cursor(d.start.first[positions[i]], i));
+
+		unsigned int length = d.length.first[pos];
+		std::uint8_t tag = d.tag ? d.tag[pos] : static_cast<std::uint8_t>(d.generation << 1 | (d.v == LOSS));
+		if (start < pending_start + pending_length)
+			throw std::logic_error(fmt::format("intervals overlap at {}", start));
+		if (start == pending_start + pending_length && tag == pending_tag &&
+				pending_length + length <= std::numeric_limits<std::uint8_t>::max())
+			pending_length += length;
+		else {
+			flush_pending();
+			pending_start = start;
+			pending_length = length;
+			pending_tag = tag;
+		}
+	}
+	flush_pending();
+
+	sf.close();
+	lf.close();
+	tf.close();
+	//A B+tree index or Bloom filter left over from a previous build would no longer match.
+	std::filesystem::remove(data_dir / fmt::format("merged-{}.btree", generations));
+	std::filesystem::remove(data_dir / fmt::format("merged-{}.bloom", generations));
+	//Rename the tag file last; load_database ignores a merged index without one.
+	std::filesystem::rename(tmp_dir / names[0], data_dir / names[0]);
+	std::filesystem::rename(tmp_dir / names[1], data_dir / names[1]);
+	std::filesystem::rename(tmp_dir / names[2], data_dir / names[2]);
+}
+
+//Rewrites the interval count in the trailer of the given index file.
+static void set_trailer_intervals(const std::filesystem::path& file, std::size_t intervals) {
+	UniqueFile f = open_or_throw(file, "r+");
+	if (std::fseek(f.get(), static_cast<long>(offsetof(SidecarTrailer, intervals)) - static_cast<long>(sizeof(SidecarTrailer)), SEEK_END)) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error seeking {}: error {} ({})",
+				file.c_str(), strerror(saved_errno), saved_errno));
+	}
+	unsigned long n = intervals;
+	write_or_throw(&n, sizeof(n), 1, f.get(), file);
+	sync_and_close(std::move(f), file);
+}
+
+std::pair<std::uintmax_t, std::uintmax_t> compress_database(const std::filesystem::path& data_dir, unsigned int generations) {
+	//(starts, tags if merged, output)
+	using Conversion = std::tuple<std::filesystem::path, std::optional<std::filesystem::path>, std::filesystem::path>;
+	vector<Conversion> conversions;
+	for (unsigned int g = 0; g < generations; ++g)
+		for (const char* prefix : {"win", "loss"})
+			if (auto bin = data_dir / fmt::format("{}-{}.bin", prefix, g); std::filesystem::is_regular_file(bin))
+				conversions.emplace_back(bin, std::nullopt, data_dir / fmt::format("{}-{}.ivc", prefix, g));
+	if (auto bin = data_dir / fmt::format("merged-{}.bin", generations); std::filesystem::is_regular_file(bin))
+		conversions.emplace_back(bin, data_dir / fmt::format("merged-{}.tag", generations),
+				data_dir / fmt::format("merged-{}.ivc", generations));
+
+	std::uintmax_t before = 0, after = 0;
+	for (const auto& [starts, tags, out] : conversions) {
+		std::filesystem::path lengths = starts, btree = starts;
+		lengths.replace_extension(".len");
+		btree.replace_extension(".btree");
+		before += std::filesystem::file_size(starts) + std::filesystem::file_size(lengths);
+		if (tags)
+			before += std::filesystem::file_size(*tags);
+		std::size_t intervals = compress_interval_file(starts, lengths, tags, out);
+		after += std::filesystem::file_size(out);
+		//Coalescing changes the interval count a Bloom filter's trailer
+		//records, though not the buckets or span.
+		if (std::filesystem::path bloom = std::filesystem::path(starts).replace_extension(".bloom"); std::filesystem::is_regular_file(bloom))
+			set_trailer_intervals(bloom, intervals);
+		//The B+tree index only applies to the uncompressed starts.
+		for (const auto& p : {starts, lengths, btree})
+			std::filesystem::remove(p);
+		if (tags)
+			std::filesystem::remove(*tags);
+	}
+	return {before, after};
+}
+
+}//namespace pushfight
@@ -0,0 +1,228 @@
+#ifndef DATABASE_HPP
+#define DATABASE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "compressed-intervals.hpp"
+#include "numa.hpp"
+#include "state.hpp"
+
+namespace pushfight {
+
+enum GameValue {WIN, LOSS, UNKNOWN, DRAW};
+
+//A resolved value and the generation that resolved it.  For a win, the
+//generation is one less than the number of moves to win; for a loss, it's the
+//number of moves the loser can hold out.  Dense tables don't record
+//generations, so values from them have UNKNOWN_GENERATION.
+constexpr unsigned int UNKNOWN_GENERATION = ~0u;
+struct Resolution {
+	GameValue value;
+	unsigned int generation;
+};
+
+//How WinLossUnknownDatabase searches the interval start arrays.
+enum class SearchStrategy {
+	//std::upper_bound
+	BINARY,
+	//interp::upper_bound; ranks are close to uniform within a slice, but
+	//skewed data can make it take many probes
+	INTERPOLATION,
+	//one interpolation probe, then galloping out from it to bracket the
+	//answer, then binary search within the bracket
+	HYBRID,
+	//the .btree index if present, else BINARY
+	BTREE,
+};
+constexpr std::array<std::pair<SearchStrategy, std::string_view>, 4> SEARCH_STRATEGY_NAMES = {{
+	{SearchStrategy::BINARY, "binary"},
+	{SearchStrategy::INTERPOLATION, "interpolation"},
+	{SearchStrategy::HYBRID, "hybrid"},
+	{SearchStrategy::BTREE, "btree"},
+}};
+//Returns the strategy with the given name, or throws.
+SearchStrategy search_strategy_from_string(std::string_view name);
+
+/**
+ * Answers queries for the value of a rank from mmapped interval files.  Each
+ * generation's win-{g}.bin holds interval start ranks as unsigned longs and
+ * win-{g}.len the corresponding lengths as bytes (splitting longer runs), and
+ * likewise for losses.  A merged index (merged-{G}.bin/.len/.tag) holds the
+ * intervals of generations [0, G) in one sorted array, with a tag byte per
+ * interval holding generation << 1 | (1 if loss), so a query does one search
+ * no matter how many generations it covers.  Any of these .bin files may have
+ * a .btree index alongside it (see build_btree_index) and a .bloom filter (see
+ * build_bloom_filter), which are used if present.  Either kind of interval
+ * file may instead be a single block-compressed .ivc file (see
+ * CompressedIntervals), which load_database prefers when present.
+ *
+ * For boards with few enough states, a dense table (dense-{G}.bits) holds a
+ * 2-bit value per state for generations [0, G), indexed by
+ * Unranker::dense_index, making queries O(1).  Generations after G still come
+ * from interval files.
+ */
+struct WinLossUnknownDatabase {
+	struct Data {
+		std::pair<const unsigned long*, const unsigned long*> start;
+		std::pair<const std::uint8_t*, const std::uint8_t*> length;
+		//non-null only for a merged index, in which case v and generation are unused
+		const std::uint8_t* tag;
+		GameValue v;
+		unsigned int generation;
+		//Internal levels of the B+tree index over start, root first, or empty
+		//if no .btree file was present.
+		std::vector<const unsigned long*> btree_levels;
+		//The Bloom filter over start, or empty if no .bloom file was present.
+		std::span<const std::uint64_t> bloom;
+		//If present, the intervals come from this instead of start, length and
+		//tag, which are empty, and strategy and btree_levels are unused.
+		std::optional<CompressedIntervals> compressed;
+
+		//Returns the index of the last start <= r, or -1 if none.
+		std::ptrdiff_t floor(unsigned long r, SearchStrategy strategy) const;
+	};
+	std::vector<Data> data;
+	SearchStrategy strategy = SearchStrategy::BTREE;
+	//Entries in each thread's query() cache (rounded up to a power of two), or
+	//0 to disable it.  The cache is bypassed if only a dense table is loaded.
+	std::size_t cache_entries = 64*1024;
+	struct CacheStats {
+		std::atomic<unsigned long> hits = 0, misses = 0;
+	};
+	//Threads add their counts every 64K queries, when they exit and when
+	//publish_query_cache_stats runs on them.  The caches also hold this, so
+	//its address identifies the database.
+	std::shared_ptr<CacheStats> cache_stats = std::make_shared<CacheStats>();
+	//The dense table, if any, which is consulted before data.
+	const std::uint8_t* dense = nullptr;
+	std::optional<Unranker> dense_unranker;
+	struct NumaStats {
+		std::atomic<unsigned long> local = 0, remote = 0;
+	};
+	//If non-null, one in 256 of query_resolution's calls (and one read from
+	//each query_sorted batch) counts whether the memory it read (the dense
+	//table entry and the start array entries it found) was on the calling
+	//thread's NUMA node.
+	std::shared_ptr<NumaStats> numa_stats;
+
+	WinLossUnknownDatabase() = default;
+	WinLossUnknownDatabase(const WinLossUnknownDatabase&) = delete;
+	WinLossUnknownDatabase& operator=(const WinLossUnknownDatabase&) = delete;
+	~WinLossUnknownDatabase();
+
+	//Adds one generation's win or loss intervals.  (Each add drops any
+	//replicas.)
+	void add_generation(const std::filesystem::path& starts, const std::filesystem::path& lengths, GameValue v, unsigned int generation);
+	//Adds a dense table written by build_dense_table.
+	void add_dense_table(const std::filesystem::path& file, const Board& board);
+	//Adds a merged index written by build_merged_index.
+	void add_merged_index(const std::filesystem::path& starts, const std::filesystem::path& lengths, const std::filesystem::path& tags);
+	//Adds a .ivc file written by compress_interval_file, holding one
+	//generation's intervals (if untagged) or a merged index (if tagged).
+	void add_compressed(const std::filesystem::path& file, GameValue v, unsigned int generation);
+	//Copies the dense table, B+tree levels and Bloom filters (the parts every
+	//query reads, unlike the start arrays, which it reads once) into memory
+	//bound to each of the nodes, for queries from threads on that node to
+	//use.  Adding anything afterwards drops the copies.
+	void replicate_hot_index(const std::vector<NumaNode>& nodes);
+	//Makes threads' query caches drop their entries on their next query, as
+	//needed after adding a generation.  Also resets the cache statistics.
+	void invalidate_query_caches();
+
+	//Like query_resolution(r).value, but through a per-thread direct-mapped
+	//cache, as neighboring states share many successors.
+	GameValue query(unsigned long r) const;
+	//Like query, but also returns the generation that resolved the rank (if any).
+	Resolution query_resolution(unsigned long r) const;
+	//Queries each of the sorted (duplicates allowed) ranks, storing the results
+	//in values, by galloping forward through each start array once rather than
+	//searching it for each rank.  Ignores strategy and Bloom filters.
+	void query_sorted(std::span<const unsigned long> ranks, std::span<GameValue> values) const;
+
+	//Returns the resolved (win or loss) ranks in [first, last) as sorted,
+	//coalesced intervals.
+	std::vector<std::pair<unsigned long, unsigned long>> known_intervals(unsigned long first, unsigned long last) const;
+private:
+	GameValue query_dense(const std::uint8_t* table, unsigned long r) const;
+	//The hot index and the data referring to it, for one node.
+	struct Replica {
+		const std::uint8_t* dense;
+		std::vector<Data> data;
+	};
+	//indexed by node id; null for nodes without a replica
+	std::vector<std::unique_ptr<Replica>> replicas;
+	std::vector<std::pair<void*, std::size_t>> replica_mappings;
+	std::size_t dense_bytes = 0;
+	void drop_replicas();
+	//The calling thread's node's replica, if any.
+	const Replica* local_replica() const;
+	bool sample_numa_access() const;
+	void count_numa_access(const void* p) const;
+	std::vector<std::pair<void*, std::size_t>> mappings;
+	const void* map(const std::filesystem::path& file, std::size_t size);
+	void map_btree(const std::filesystem::path& starts, Data& d);
+	void map_bloom(const std::filesystem::path& starts, Data& d);
+};
+
+//Adds the query cache counts of the calling thread and each of pool's
+//threads to their databases' cache_stats, so the totals are complete once
+//queries on those threads have finished.
+void publish_query_cache_stats(ThreadPool& pool);
+
+//Loads generations [0, generations), or every generation present if
+//generations is empty, using the merged index (or, if dense_board is
+//non-null, the dense table for that board) covering the most of them.
+//Throws if a generation's files are only partly present.
+std::unique_ptr<WinLossUnknownDatabase> load_database(const std::filesystem::path& data_dir, std::optional<unsigned int> generations,
+		const Board* dense_board = nullptr);
+
+//The size of a dense table for the given board.
+std::size_t dense_table_bytes(const Board& board);
+//Writes the values from generations [0, generations) to dense-{generations}.bits
+//in data_dir, writing through data_dir/tmp and renaming into place.
+void build_dense_table(const std::filesystem::path& data_dir, unsigned int generations, const Board& board);
+
+//Merges generations [0, generations) into merged-{generations}.bin/.len/.tag
+//in data_dir, writing through data_dir/tmp and renaming into place.  The
+//generations must not be compressed.
+void build_merged_index(const std::filesystem::path& data_dir, unsigned int generations);
+
+//Number of keys in a B+tree node; 8 unsigned longs fill one cache line.
+constexpr std::size_t BTREE_NODE_KEYS = 8;
+//Returns the sizes (in keys, padded to whole nodes) of the internal levels of
+//the B+tree index over n starts, root first.
+std::vector<std::size_t> btree_level_sizes(std::size_t n);
+//Writes the B+tree index for the given start file to the same path with a
+//.btree extension: an implicit static B+tree with 64-byte nodes whose leaves
+//are the start file itself, so a query touches one cache line per level
+//rather than one per halving.  A trailer records the interval count and span
+//(read with the .len file alongside), and mapping an index whose trailer
+//doesn't match its start file throws.
+void build_btree_index(const std::filesystem::path& starts);
+
+//Writes a Bloom filter for the given interval files to the start file's path
+//with a .bloom extension, letting most queries for ranks not in the files
+//skip searching them.  The filter holds the 256-rank buckets the intervals
+//touch and is sized from the interval count for about 16 bits per interval.
+//Like a .btree index, it ends with a trailer identifying its intervals, which
+//is checked when it's mapped (against the .ivc file, once compressed).
+void build_bloom_filter(const std::filesystem::path& starts, const std::filesystem::path& lengths);
+
+//Writes a .ivc file alongside each .bin/.len file of generations
+//[0, generations) and of the merged index for exactly that many generations,
+//if present, then removes the uncompressed files (keeping .bloom files, which
+//remain valid once their trailers have the coalesced interval count).
+//Returns the total bytes before and after.
+std::pair<std::uintmax_t, std::uintmax_t> compress_database(const std::filesystem::path& data_dir, unsigned int generations);
+
+}//namespace pushfight
+
+#endif /* DATABASE_HPP */
@@ -0,0 +1,342 @@
+#include "precompiled.hpp"
+#include "generation-merge.hpp"
+#include "database.hpp"
+#include "interval-runs.hpp"
+#include "state.hpp"
+#include <charconv>
+#include <future>
+#include <map>
+#include <queue>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h> //for mmap
+
+using std::vector;
+using std::pair;
+
+namespace pushfight {
+
+namespace {
+
+constexpr std::array<const char*, 2> KINDS = {"win", "loss"};
+constexpr std::array<const char*, 2> EXTENSIONS = {".bin", ".len"};
+//Merged outputs also get a Bloom filter, published with them.
+constexpr std::array<const char*, 3> PUBLISHED_EXTENSIONS = {".bloom", ".bin", ".len"};
+//Generation 0 outputs have no subslice.
+constexpr unsigned int NO_SUBSLICE = ~0u;
+using PieceId = pair<unsigned int, unsigned int>;
+
+std::string piece_name(const char* kind, unsigned int generation, PieceId piece, const char* extension) {
+	if (piece.second == NO_SUBSLICE)
+		return fmt::format("{}-{}-{:02}{}", kind, generation, piece.first, extension);
+	return fmt::format("{}-{}-{:02}-{:03}{}", kind, generation, piece.first, piece.second, extension);
+}
+
+//Parses {kind}-{generation}-{slice}[-{subslice}]{extension}, returning the
+//piece and the index of its kind and extension (as kind * 2 + extension).
+std::optional<pair<PieceId, unsigned int>> parse_piece_name(const std::string& name, unsigned int generation) {
+	for (unsigned int k = 0; k < KINDS.size(); ++k)
+		for (unsigned int e = 0; e < EXTENSIONS.size(); ++e) {
+			std::string prefix = fmt::format("{}-{}-", KINDS[k], generation);
+			if (!name.starts_with(prefix) || !name.ends_with(EXTENSIONS[e]))
+				continue;
+			const char* first = name.data() + prefix.size(), *last = name.data() + name.size() - std::strlen(EXTENSIONS[e]);
+			PieceId piece;
+			auto [ptr, ec] = std::from_chars(first, last, piece.first, 10);
+			if (ec != std::errc()) return {};
+			if (generation == 0) {
+				if (ptr != last) return {};
+				piece.second = NO_SUBSLICE;
+			} else {
+				if (ptr == last || *ptr != '-') return {};
+				auto [ptr2, ec2] = std::from_chars(ptr + 1, last, piece.second, 10);
+				if (ec2 != std::errc() || ptr2 != last) return {};
+			}
+			return pair(piece, k * 2 + e);
+		}
+	return {};
+}
+
+class MappedFile {
+public:
+	explicit MappedFile(const std::filesystem::path& file) : size_(std::filesystem::file_size(file)) {
+		if (!size_) return;
+		int fd = open(file.c_str(), O_RDONLY);
+		if (fd == -1) {
+			auto saved_errno = errno;
+			throw std::runtime_error(fmt::format("error opening {}: error {} ({})",
+					file.c_str(), strerror(saved_errno), saved_errno));
+		}
+		data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+		auto saved_errno = errno;
+		close(fd);
+		if (data_ == MAP_FAILED)
+			throw std::runtime_error(fmt::format("error mapping {}: error {} ({})",
+					file.c_str(), strerror(saved_errno), saved_errno));
+		madvise(data_, size_, MADV_SEQUENTIAL);
+	}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() {
+		if (size_)
+			munmap(data_, size_);
+	}
+	template<typename T>
+	const T* begin() const {return static_cast<const T*>(data_);}
+	template<typename T>
+	const T* end() const {return begin<T>() + size_ / sizeof(T);}
+private:
+	std::size_t size_;
+	void* data_ = nullptr;
+};
+
+struct Input {
+	const unsigned long* start, *end;
+	const std::uint8_t* length;
+};
+
+//Merges the inputs' intervals with starts in [lo, hi) into runs, coalescing
+//them and checking for overlaps.
+void merge_range(const vector<Input>& inputs, unsigned long lo, unsigned long hi, IntervalRuns& runs, const char* kind) {
+	struct Cursor {
+		const unsigned long* p, *end;
+		const std::uint8_t* length;
+	};
+	vector<Cursor> cursors;
+	for (const Input& in : inputs) {
+		const unsigned long* p = std::lower_bound(in.start, in.end, lo), *q = std::lower_bound(p, in.end, hi);
+		if (p != q)
+			cursors.push_back({p, q, in.length + (p - in.start)});
+	}
+	using HeapEntry = pair<unsigned long, std::size_t>;
+	std::priority_queue<HeapEntry, vector<HeapEntry>, std::greater<>> heap;
+	for (std::size_t i = 0; i < cursors.size(); ++i)
+		heap.push(HeapEntry(*cursors[i].p, i));
+
+	constexpr std::size_t run_size = 1024*1024;
+	vector<pair<unsigned long, unsigned long>> run;
+	run.reserve(run_size);
+	while (!heap.empty()) {
+		std::size_t i = heap.top().second;
+		heap.pop();
+		//Drain this input while it stays ahead of the others; slice and
+		//subslice outputs cover disjoint rank ranges, so usually it's all of it.
+		unsigned long bound = heap.empty() ? std::numeric_limits<unsigned long>::max() : heap.top().first;
+		Cursor& c = cursors[i];
+		for (; c.p != c.end && *c.p <= bound; ++c.p, ++c.length) {
+			unsigned long first = *c.p, last = first + *c.length;
+			if (!run.empty() && first < run.back().second)
+				throw std::logic_error(fmt::format("{} intervals overlap at {}", kind, first));
+			if (!run.empty() && first == run.back().second)
+				run.back().second = last;
+			else {
+				if (run.size() == run_size) {
+					runs.add(std::move(run));
+					run = {};
+					run.reserve(run_size);
+				}
+				run.emplace_back(first, last);
+			}
+		}
+		if (c.p != c.end)
+			heap.push(HeapEntry(*c.p, i));
+	}
+	runs.add(std::move(run));
+}
+
+//Returns the first rank in both the given interval files, if any.
+std::optional<unsigned long> first_overlap(const MappedFile& ws, const MappedFile& wl, const MappedFile& ls, const MappedFile& ll) {
+	const unsigned long* w = ws.begin<unsigned long>(), *w_end = ws.end<unsigned long>();
+	const unsigned long* l = ls.begin<unsigned long>(), *l_end = ls.end<unsigned long>();
+	const std::uint8_t* w_length = wl.begin<std::uint8_t>(), *l_length = ll.begin<std::uint8_t>();
+	while (w != w_end && l != l_end) {
+		unsigned long first = std::max(*w, *l), last = std::min(*w + *w_length, *l + *l_length);
+		if (first < last)
+			return first;
+		if (*w + *w_length < *l + *l_length)
+			++w, ++w_length;
+		else
+			++l, ++l_length;
+	}
+	return {};
+}
+
+void sync_directory(const std::filesystem::path& dir) {
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd == -1 || fsync(fd)) {
+		auto saved_errno = errno;
+		if (fd != -1) close(fd);
+		throw std::runtime_error(fmt::format("error syncing {}: error {} ({})",
+				dir.c_str(), strerror(saved_errno), saved_errno));
+	}
+	close(fd);
+}
+
+std::filesystem::path staging_dir(const std::filesystem::path& data_dir, unsigned int generation) {
+	return data_dir / "tmp" / fmt::format("merge-{}", generation);
+}
+
+//Counts the published files of a generation, as merging them would have.
+GenerationMergeStats published_stats(const std::filesystem::path& data_dir, unsigned int generation) {
+	GenerationMergeStats stats = {0, 0, 0, 0, true};
+	for (const char* kind : KINDS)
+		for (const char* extension : EXTENSIONS)
+			stats.bytes += std::filesystem::file_size(data_dir / fmt::format("{}-{}{}", kind, generation, extension));
+	stats.win_intervals = std::filesystem::file_size(data_dir / fmt::format("win-{}.len", generation));
+	stats.loss_intervals = std::filesystem::file_size(data_dir / fmt::format("loss-{}.len", generation));
+	return stats;
+}
+
+//Written once staging finishes; holds REMOVE_INPUTS if the merge was to
+//remove its inputs.
+constexpr const char* COMPLETE_MARKER = "complete";
+constexpr std::string_view REMOVE_INPUTS = "remove-inputs";
+
+}//namespace
+
+bool recover_generation_merge(const std::filesystem::path& data_dir, unsigned int generation) {
+	std::filesystem::path staging = staging_dir(data_dir, generation);
+	if (!std::filesystem::exists(staging))
+		return false;
+	if (!std::filesystem::exists(staging / COMPLETE_MARKER)) {
+		std::filesystem::remove_all(staging);
+		return false;
+	}
+	std::string marker;
+	std::ifstream(staging / COMPLETE_MARKER) >> marker;
+	//A B+tree index or compressed file for the generation left from earlier
+	//data would be used in place of, or alongside, the new files.
+	for (const char* kind : KINDS)
+		for (const char* extension : {".btree", ".ivc"})
+			std::filesystem::remove(data_dir / fmt::format("{}-{}{}", kind, generation, extension));
+	//Some files may already have been renamed; rename the rest.
+	for (const char* kind : KINDS)
+		for (const char* extension : PUBLISHED_EXTENSIONS) {
+			std::string name = fmt::format("{}-{}{}", kind, generation, extension);
+			if (std::filesystem::exists(staging / name))
+				std::filesystem::rename(staging / name, data_dir / name);
+		}
+	sync_directory(data_dir);
+	//The staging directory stays until the inputs are gone, so a crash while
+	//removing them is finished by the next recovery.
+	if (marker == REMOVE_INPUTS)
+		for (const auto& entry : std::filesystem::directory_iterator(data_dir))
+			if (parse_piece_name(entry.path().filename(), generation))
+				std::filesystem::remove(entry.path());
+	std::filesystem::remove_all(staging);
+	return true;
+}
+
+GenerationMergeStats merge_generation(const std::filesystem::path& data_dir, unsigned int generation, const Board* board,
+		const GenerationMergeOptions& options) {
+	if (recover_generation_merge(data_dir, generation))
+		return published_stats(data_dir, generation);
+	for (const char* kind : KINDS)
+		for (const char* extension : EXTENSIONS)
+			if (auto file = data_dir / fmt::format("{}-{}{}", kind, generation, extension); std::filesystem::exists(file))
+				throw std::runtime_error(fmt::format("{} already exists", file.c_str()));
+
+	//Find the pieces, with a bit for each of their files.
+	std::map<PieceId, unsigned int> pieces;
+	for (const auto& entry : std::filesystem::directory_iterator(data_dir))
+		if (auto parsed = parse_piece_name(entry.path().filename(), generation))
+			pieces[parsed->first] |= 1u << parsed->second;
+	for (auto [piece, files] : pieces)
+		if (files != 0b1111)
+			for (const char* kind : KINDS)
+				for (const char* extension : EXTENSIONS)
+					if (auto file = data_dir / piece_name(kind, generation, piece, extension); !std::filesystem::exists(file))
+						throw std::runtime_error(fmt::format("expected {} to exist", file.c_str()));
+	if (board) {
+		for (unsigned int slice = 0; slice < board->anchorable_squares(); ++slice)
+			for (unsigned int subslice = 0; subslice < (generation ? subslice_count(*board) : 1); ++subslice)
+				if (PieceId piece(slice, generation ? subslice : NO_SUBSLICE); !pieces.contains(piece))
+					throw std::runtime_error(fmt::format("expected {} to exist",
+							(data_dir / piece_name("win", generation, piece, ".bin")).c_str()));
+	}
+	if (pieces.empty())
+		throw std::runtime_error(fmt::format("no outputs for generation {} in {}", generation, data_dir.c_str()));
+
+	std::filesystem::path staging = staging_dir(data_dir, generation);
+	std::filesystem::create_directories(staging);
+	unsigned int threads_per_kind = std::max(1u, options.threads / 2);
+	std::array<std::string, 4> names;
+	auto merge_kind = [&](unsigned int k) {
+		vector<std::unique_ptr<MappedFile>> files;
+		vector<Input> inputs;
+		for (auto [piece, present] : pieces) {
+			files.push_back(std::make_unique<MappedFile>(data_dir / piece_name(KINDS[k], generation, piece, ".bin")));
+			files.push_back(std::make_unique<MappedFile>(data_dir / piece_name(KINDS[k], generation, piece, ".len")));
+			const MappedFile& s = *files[files.size() - 2], &l = *files.back();
+			if (s.end<unsigned long>() - s.begin<unsigned long>() != l.end<std::uint8_t>() - l.begin<std::uint8_t>())
+				throw std::logic_error(fmt::format("size mismatch between {} and its lengths",
+						piece_name(KINDS[k], generation, piece, ".bin")));
+			inputs.push_back({s.begin<unsigned long>(), s.end<unsigned long>(), l.begin<std::uint8_t>()});
+		}
+
+		//Split the rank space at quantiles of a sample of the starts.
+		vector<unsigned long> sample;
+		for (const Input& in : inputs) {
+			std::size_t n = static_cast<std::size_t>(in.end - in.start);
+			for (std::size_t i = 0; i < std::min<std::size_t>(n, 64); ++i)
+				sample.push_back(in.start[i * n / std::min<std::size_t>(n, 64)]);
+		}
+		std::sort(sample.begin(), sample.end());
+		vector<unsigned long> splitters = {0};
+		for (unsigned int t = 1; t < threads_per_kind && !sample.empty(); ++t)
+			if (unsigned long s = sample[t * sample.size() / threads_per_kind]; s > splitters.back())
+				splitters.push_back(s);
+		splitters.push_back(std::numeric_limits<unsigned long>::max());
+
+		IntervalRuns runs(staging / KINDS[k], options.spill_budget / 2);
+		vector<std::future<void>> futures;
+		for (std::size_t t = 0; t + 1 < splitters.size(); ++t)
+			futures.push_back(std::async(std::launch::async, merge_range, std::cref(inputs),
+					splitters[t], splitters[t+1], std::ref(runs), KINDS[k]));
+		for (auto& f : futures)
+			f.get();
+		names[k * 2] = fmt::format("{}-{}.bin", KINDS[k], generation);
+		names[k * 2 + 1] = fmt::format("{}-{}.len", KINDS[k], generation);
+		return runs.write(staging / names[k * 2], staging / names[k * 2 + 1], options.direct_io);
+	};
+	auto loss_bytes = std::async(std::launch::async, merge_kind, 1);
+	std::uintmax_t bytes = merge_kind(0);
+	bytes += loss_bytes.get();
+
+	GenerationMergeStats stats;
+	stats.pieces = pieces.size();
+	stats.bytes = bytes;
+	stats.win_intervals = std::filesystem::file_size(staging / names[1]);
+	stats.loss_intervals = std::filesystem::file_size(staging / names[3]);
+	{
+		MappedFile ws(staging / names[0]), wl(staging / names[1]), ls(staging / names[2]), ll(staging / names[3]);
+		if (auto r = first_overlap(ws, wl, ls, ll))
+			throw std::logic_error(fmt::format("generation {} has rank {} as both a win and a loss", generation, *r));
+	}
+	build_bloom_filter(staging / names[0], staging / names[1]);
+	build_bloom_filter(staging / names[2], staging / names[3]);
+
+	//Once the marker is durable, recover_generation_merge will finish the job,
+	//including removing the inputs.
+	std::filesystem::path marker = staging / COMPLETE_MARKER;
+	int fd = open(marker.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1 && options.remove_inputs &&
+			write(fd, REMOVE_INPUTS.data(), REMOVE_INPUTS.size()) != static_cast<ssize_t>(REMOVE_INPUTS.size())) {
+		auto saved_errno = errno;
+		close(fd);
+		throw std::runtime_error(fmt::format("error writing {}: error {} ({})",
+				marker.c_str(), strerror(saved_errno), saved_errno));
+	}
+	if (fd == -1 || fsync(fd)) {
+		auto saved_errno = errno;
+		if (fd != -1) close(fd);
+		throw std::runtime_error(fmt::format("error creating {}: error {} ({})",
+				marker.c_str(), strerror(saved_errno), saved_errno));
+	}
+	close(fd);
+	sync_directory(staging);
+	recover_generation_merge(data_dir, generation);
+	return stats;
+}
+
+}//namespace pushfight
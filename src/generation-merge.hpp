@@ -0,0 +1,58 @@
+#ifndef GENERATION_MERGE_HPP
+#define GENERATION_MERGE_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include "board.hpp"
+
+namespace pushfight {
+
+struct GenerationMergeStats {
+	//slice (generation 0) or subslice outputs merged
+	std::size_t pieces;
+	unsigned long win_intervals, loss_intervals;
+	std::uintmax_t bytes;
+	//true if this finished publishing an interrupted merge instead, in which
+	//case pieces is 0 and the rest describe the published files
+	bool recovered = false;
+};
+
+struct GenerationMergeOptions {
+	unsigned int threads = 1;
+	//memory for merged intervals before they spill to disk
+	std::size_t spill_budget = 2UL*1024*1024*1024;
+	bool direct_io = false;
+	//remove the slice or subslice outputs once the merge is published
+	bool remove_inputs = false;
+};
+
+/**
+ * Merges the solver's per-slice (win-0-SS.bin, for generation 0) or
+ * per-subslice (win-G-SS-SSS.bin) outputs in data_dir into win-G.bin/.len and
+ * loss-G.bin/.len, coalescing intervals across file boundaries, and builds
+ * their Bloom filters (see build_bloom_filter).  If board is non-null, every
+ * slice or subslice of it must be present; in any case each present one must
+ * have all four of its files.  Throws if the inputs' win and loss intervals
+ * overlap.
+ *
+ * Each of the win and loss merges is split by rank range across
+ * options.threads / 2 (at least 1) threads.  The outputs are staged in
+ * data_dir/tmp/merge-G and published by renaming once a marker file records
+ * that staging finished, so a crash during publishing is completed by
+ * recover_generation_merge rather than leaving a partial generation.  This
+ * calls it first, returning at once if it finished an earlier merge, and
+ * throws if the generation's merged files already exist otherwise.
+ * Publishing replaces any .bloom file for the generation and removes any
+ * .btree or .ivc file, which would describe other data.
+ */
+GenerationMergeStats merge_generation(const std::filesystem::path& data_dir, unsigned int generation, const Board* board,
+		const GenerationMergeOptions& options);
+
+//Finishes publishing an interrupted merge of the generation, if its staging
+//completed (and then removes its inputs, if the merge was to), or discards
+//the staged files if not.  Returns true if it published anything.
+bool recover_generation_merge(const std::filesystem::path& data_dir, unsigned int generation);
+
+}//namespace pushfight
+
+#endif /* GENERATION_MERGE_HPP */
@@ -0,0 +1,316 @@
+#include "precompiled.hpp"
+#include "interval-runs.hpp"
+#include "bulk-writer.hpp"
+#include <bit>
+#include <queue>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h> //for mmap
+
+using std::vector;
+using std::pair;
+
+namespace pushfight {
+
+IntervalRuns::IntervalRuns(std::filesystem::path spill_prefix, std::size_t memory_budget)
+	: spill_prefix_(std::move(spill_prefix)), memory_budget_(memory_budget) {}
+
+IntervalRuns::~IntervalRuns() {
+	try {
+		remove_spill_files(false);
+	} catch (...) {}
+}
+
+void IntervalRuns::remove_spill_files(bool kept) {
+	auto it = std::remove_if(spilled_.begin(), spilled_.end(), [=](const Spill& s) {
+		if (s.kept && !kept) return false;
+		std::filesystem::remove(s.file);
+		return true;
+	});
+	spilled_.erase(it, spilled_.end());
+}
+
+std::filesystem::path IntervalRuns::next_spill_file() {
+	std::filesystem::path file;
+	//Files left by an earlier process may be adopted, or may be its
+	//uncheckpointed spills, but either way aren't ours to overwrite.
+	do
+		file = fmt::format("{}-{}.run", spill_prefix_.native(), next_spill_++);
+	while (std::filesystem::exists(file));
+	return file;
+}
+
+static void write_spill_file(const std::filesystem::path& file, const vector<IntervalRuns::Interval>& run, bool sync) {
+	std::filesystem::create_directories(file.parent_path());
+	int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error opening {}: error {} ({})",
+				file.c_str(), strerror(saved_errno), saved_errno));
+	}
+	const char* p = reinterpret_cast<const char*>(run.data());
+	for (std::size_t left = run.size() * sizeof(run.front()); left;) {
+		ssize_t written = ::write(fd, p, left);
+		if (written < 0) {
+			auto saved_errno = errno;
+			if (saved_errno == EINTR) continue;
+			close(fd);
+			throw std::runtime_error(fmt::format("error writing {}: error {} ({})",
+					file.c_str(), strerror(saved_errno), saved_errno));
+		}
+		p += written;
+		left -= static_cast<std::size_t>(written);
+	}
+	if (sync && fsync(fd) == -1) {
+		auto saved_errno = errno;
+		close(fd);
+		throw std::runtime_error(fmt::format("error syncing {}: error {} ({})",
+				file.c_str(), strerror(saved_errno), saved_errno));
+	}
+	close(fd);
+}
+
+//Merges two sorted runs of disjoint intervals, coalescing adjacent ones.
+static vector<IntervalRuns::Interval> merge_runs(const vector<IntervalRuns::Interval>& a, const vector<IntervalRuns::Interval>& b) {
+	vector<IntervalRuns::Interval> result;
+	result.reserve(a.size() + b.size());
+	auto i = a.begin(), j = b.begin();
+	while (i != a.end() || j != b.end()) {
+		const IntervalRuns::Interval& next = j == b.end() || (i != a.end() && i->first < j->first) ? *i++ : *j++;
+		if (!result.empty() && next.first < result.back().second)
+			throw std::logic_error(fmt::format("intervals overlap at {}", next.first));
+		if (!result.empty() && next.first == result.back().second)
+			result.back().second = next.second;
+		else
+			result.push_back(next);
+	}
+	return result;
+}
+
+template<typename F>
+void IntervalRuns::unlocked(std::unique_lock<std::mutex>& lock, F&& f) {
+	++in_flight_;
+	lock.unlock();
+	struct Relock {
+		IntervalRuns& runs;
+		std::unique_lock<std::mutex>& lock;
+		~Relock() {
+			lock.lock();
+			if (--runs.in_flight_ == 0)
+				runs.landed_.notify_all();
+		}
+	} relock{*this, lock};
+	f();
+}
+
+void IntervalRuns::place(std::unique_lock<std::mutex>& lock, vector<Interval>&& run, const void* owner) {
+	std::size_t bytes = run.size() * sizeof(Interval);
+	if (resident_bytes_ + bytes <= memory_budget_) {
+		resident_bytes_ += bytes;
+		runs_.push_back({std::move(run), owner});
+		return;
+	}
+
+	//Write outside the lock so other threads can keep adding.  No fsync
+	//unless checkpointed; other spill files don't outlive the process.
+	std::filesystem::path file = next_spill_file();
+	std::size_t size = run.size();
+	unlocked(lock, [&] {
+		write_spill_file(file, run, false);
+		vector<Interval> free_memory(std::move(run));
+	});
+	spilled_.push_back({file, size, owner, false});
+}
+
+bool IntervalRuns::take_committed(std::size_t level, vector<Interval>& run) {
+	auto it = std::find_if(runs_.begin(), runs_.end(), [=](const Run& r) {
+		return r.owner == nullptr && std::bit_width(r.intervals.size()) == level;
+	});
+	if (it == runs_.end()) return false;
+	resident_bytes_ -= it->intervals.size() * sizeof(Interval);
+	run = std::move(it->intervals);
+	runs_.erase(it);
+	return true;
+}
+
+vector<IntervalRuns::Interval> IntervalRuns::fold(std::unique_lock<std::mutex>& lock, vector<Interval> run) {
+	vector<Interval> partner;
+	while (take_committed(std::bit_width(run.size()), partner))
+		unlocked(lock, [&] {
+			run = merge_runs(partner, run);
+		});
+	return run;
+}
+
+void IntervalRuns::add(vector<Interval>&& run, const void* owner) {
+	if (run.empty()) return;
+	std::unique_lock<std::mutex> lock(mutex_);
+	intervals_ += run.size();
+	//Commits don't fold, so fold one level they left doubled here, letting
+	//provisional adds do their share too.
+	std::uint64_t levels = 0;
+	for (const Run& r : runs_) {
+		if (r.owner) continue;
+		std::size_t level = std::bit_width(r.intervals.size());
+		if (levels >> level & 1) {
+			vector<Interval> committed;
+			take_committed(level, committed);
+			place(lock, fold(lock, std::move(committed)), nullptr);
+			break;
+		}
+		levels |= std::uint64_t{1} << level;
+	}
+	if (!owner)
+		run = fold(lock, std::move(run));
+	place(lock, std::move(run), owner);
+}
+
+void IntervalRuns::commit(const void* owner) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto& run : runs_)
+		if (run.owner == owner)
+			run.owner = nullptr;
+	for (auto& spill : spilled_)
+		if (spill.owner == owner)
+			spill.owner = nullptr;
+}
+
+vector<pair<std::filesystem::path, std::size_t>> IntervalRuns::checkpoint() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	landed_.wait(lock, [&] {return in_flight_ == 0;});
+	auto provisional = std::partition(runs_.begin(), runs_.end(), [](const Run& r) {return r.owner == nullptr;});
+	for (auto it = runs_.begin(); it != provisional; ++it) {
+		std::filesystem::path file = next_spill_file();
+		write_spill_file(file, it->intervals, true);
+		resident_bytes_ -= it->intervals.size() * sizeof(Interval);
+		spilled_.push_back({file, it->intervals.size(), nullptr, false});
+	}
+	runs_.erase(runs_.begin(), provisional);
+
+	vector<pair<std::filesystem::path, std::size_t>> result;
+	for (auto& spill : spilled_)
+		if (spill.owner == nullptr) {
+			if (!spill.kept) {
+				//Spilled by add without syncing.
+				int fd = open(spill.file.c_str(), O_RDONLY);
+				if (fd == -1 || fsync(fd) == -1) {
+					auto saved_errno = errno;
+					if (fd != -1) close(fd);
+					throw std::runtime_error(fmt::format("error syncing {}: error {} ({})",
+							spill.file.c_str(), strerror(saved_errno), saved_errno));
+				}
+				close(fd);
+				spill.kept = true;
+			}
+			result.emplace_back(spill.file, spill.size);
+		}
+	return result;
+}
+
+void IntervalRuns::adopt(const std::filesystem::path& file, std::size_t size) {
+	if (std::filesystem::file_size(file) != size * sizeof(Interval))
+		throw std::runtime_error(fmt::format("{} doesn't hold {} intervals", file.c_str(), size));
+	if (size == 0) return;
+	std::lock_guard<std::mutex> lock(mutex_);
+	intervals_ += size;
+	spilled_.push_back({file, size, nullptr, true});
+}
+
+std::size_t IntervalRuns::size() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return intervals_;
+}
+
+std::size_t IntervalRuns::spilled_runs() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return spilled_.size();
+}
+
+std::size_t IntervalRuns::resident_runs() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return runs_.size();
+}
+
+std::uintmax_t IntervalRuns::write(const std::filesystem::path& start_filename, const std::filesystem::path& length_filename, bool direct) {
+	std::unique_lock<std::mutex> lock(mutex_);
+	landed_.wait(lock, [&] {return in_flight_ == 0;});
+	//Each source is a run in memory or a mapped spill file.
+	vector<pair<const Interval*, const Interval*>> sources;
+	for (const auto& run : runs_)
+		sources.emplace_back(run.intervals.data(), run.intervals.data() + run.intervals.size());
+	vector<pair<void*, std::size_t>> mappings;
+	struct Unmapper {
+		vector<pair<void*, std::size_t>>& mappings;
+		~Unmapper() {
+			for (auto [p, size] : mappings)
+				munmap(p, size);
+		}
+	} unmapper{mappings};
+	for (const auto& [file, size, owner, kept] : spilled_) {
+		int fd = open(file.c_str(), O_RDONLY);
+		if (fd == -1) {
+			auto saved_errno = errno;
+			throw std::runtime_error(fmt::format("error opening {}: error {} ({})",
+					file.c_str(), strerror(saved_errno), saved_errno));
+		}
+		std::size_t bytes = size * sizeof(Interval);
+		void* p = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+		auto saved_errno = errno;
+		close(fd);
+		if (p == MAP_FAILED)
+			throw std::runtime_error(fmt::format("error mapping {}: error {} ({})",
+					file.c_str(), strerror(saved_errno), saved_errno));
+		madvise(p, bytes, MADV_SEQUENTIAL);
+		mappings.emplace_back(p, bytes);
+		const Interval* first = static_cast<const Interval*>(p);
+		sources.emplace_back(first, first + size);
+	}
+
+	BulkWriter sf(start_filename, direct), lf(length_filename, direct);
+	auto emit = [&](unsigned long first, unsigned long last) {
+		//If an interval's size is greater than 255 we split it into multiple intervals.
+		for (unsigned long start = first; start < last;) {
+			unsigned long length = std::min(255ul, last - start);
+			sf.write(start);
+			lf.write(static_cast<std::uint8_t>(length));
+			start += length;
+		}
+	};
+
+	//k-way merge by start, with the source index.
+	using Cursor = pair<unsigned long, std::size_t>;
+	std::priority_queue<Cursor, vector<Cursor>, std::greater<>> heap;
+	for (std::size_t i = 0; i < sources.size(); ++i)
+		heap.push(Cursor(sources[i].first->first, i));
+	Interval pending = {0, 0};
+	while (!heap.empty()) {
+		std::size_t i = heap.top().second;
+		heap.pop();
+		//Drain this source while it stays ahead of the others, which is the
+		//common case as runs mostly cover disjoint rank ranges.
+		unsigned long bound = heap.empty() ? std::numeric_limits<unsigned long>::max() : heap.top().first;
+		auto& [p, end] = sources[i];
+		for (; p != end && p->first <= bound; ++p) {
+			if (p->first < pending.second)
+				throw std::logic_error(fmt::format("intervals overlap at {}", p->first));
+			if (p->first == pending.second)
+				pending.second = p->second;
+			else {
+				emit(pending.first, pending.second);
+				pending = *p;
+			}
+		}
+		if (p != end)
+			heap.push(Cursor(p->first, i));
+	}
+	emit(pending.first, pending.second);
+	sf.close();
+	lf.close();
+
+	runs_.clear();
+	resident_bytes_ = 0;
+	remove_spill_files(true);
+	return sf.bytes() + lf.bytes();
+}
+
+}//namespace pushfight
@@ -0,0 +1,108 @@
+#ifndef INTERVAL_RUNS_HPP
+#define INTERVAL_RUNS_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace pushfight {
+
+/**
+ * Collects sorted runs of disjoint intervals from any number of threads and
+ * writes their k-way merge as a .bin/.len pair.  Runs are held in memory until
+ * they'd exceed the memory budget; after that, each added run is spilled to
+ * {spill_prefix}-{n}.run (as raw pairs) and mapped back in for the merge, so
+ * memory is bounded by the budget rather than the output size.
+ *
+ * For checkpointing, runs can be added provisionally on behalf of an owner and
+ * committed once the owner's work is finished; checkpoint() spills the
+ * committed runs and keeps their files for a later process to adopt.
+ *
+ * Committed runs held in memory are folded together as a binomial merge tree
+ * (two runs merge when their sizes have the same bit width) by the adding
+ * threads, outside the lock, so write only merges a few long, already
+ * coalesced runs rather than one per add.
+ */
+class IntervalRuns {
+public:
+	using Interval = std::pair<unsigned long, unsigned long>;
+	IntervalRuns(std::filesystem::path spill_prefix, std::size_t memory_budget);
+	IntervalRuns(const IntervalRuns&) = delete;
+	IntervalRuns& operator=(const IntervalRuns&) = delete;
+	//Removes any spill files.
+	~IntervalRuns();
+
+	//Adds a sorted run of disjoint intervals, which needn't be disjoint from
+	//other runs' ranges.  If owner is non-null, the run is provisional until
+	//commit(owner).  Thread-safe.
+	void add(std::vector<Interval>&& run, const void* owner = nullptr);
+	//Commits the owner's provisional runs.  Thread-safe.
+	void commit(const void* owner);
+	//Spills the committed runs held in memory and returns the committed spill
+	//files and their interval counts.  The destructor leaves those files in
+	//place (though write still removes them).  Thread-safe.
+	std::vector<std::pair<std::filesystem::path, std::size_t>> checkpoint();
+	//Adds a spill file (and its interval count) returned by an earlier
+	//checkpoint, as a committed run.
+	void adopt(const std::filesystem::path& file, std::size_t size);
+	//Intervals added so far.
+	std::size_t size() const;
+	//Runs spilled to disk so far.
+	std::size_t spilled_runs() const;
+	//Runs held in memory, after folding.
+	std::size_t resident_runs() const;
+
+	//Merges the runs, coalescing adjacent intervals and splitting runs longer
+	//than 255, and writes the starts (as unsigned longs) and lengths (as bytes)
+	//through BulkWriters (with O_DIRECT if direct).  Throws if intervals from
+	//different runs overlap.  Frees the in-memory runs and removes the spill
+	//files.  Returns the total bytes written.
+	std::uintmax_t write(const std::filesystem::path& start_filename, const std::filesystem::path& length_filename, bool direct);
+private:
+	struct Run {
+		std::vector<Interval> intervals;
+		//null once committed
+		const void* owner;
+	};
+	struct Spill {
+		std::filesystem::path file;
+		std::size_t size;
+		const void* owner;
+		//returned by checkpoint, so not removed by the destructor
+		bool kept;
+	};
+	void remove_spill_files(bool kept);
+	//Returns a spill file name not in use (or left by an earlier process).
+	//Call with the lock held.
+	std::filesystem::path next_spill_file();
+	//Holds the run in memory if it fits in the budget, or else spills it.
+	//Call with the lock held.
+	void place(std::unique_lock<std::mutex>& lock, std::vector<Interval>&& run, const void* owner);
+	//Takes a committed resident run whose size has the given bit width out of
+	//runs_, if there is one.  Call with the lock held.
+	bool take_committed(std::size_t level, std::vector<Interval>& run);
+	//Merges committed runs into the run until its level is unique, returning
+	//the result to be placed.  Call with the lock held.
+	std::vector<Interval> fold(std::unique_lock<std::mutex>& lock, std::vector<Interval> run);
+	//Runs f with the lock released, counting it in flight.
+	template<typename F>
+	void unlocked(std::unique_lock<std::mutex>& lock, F&& f);
+
+	mutable std::mutex mutex_;
+	std::filesystem::path spill_prefix_;
+	std::size_t memory_budget_, resident_bytes_ = 0, intervals_ = 0;
+	std::vector<Run> runs_;
+	std::vector<Spill> spilled_;
+	std::size_t next_spill_ = 0;
+	//Runs out of runs_ and spilled_ while the lock is released (being merged
+	//or spilled), which checkpoint and write wait for.
+	std::size_t in_flight_ = 0;
+	std::condition_variable landed_;
+};
+
+}//namespace pushfight
+
+#endif /* INTERVAL_RUNS_HPP */
@@ -0,0 +1,68 @@
+#include "precompiled.hpp"
+#include "board.hpp"
+#include "board-defs.inc"
+#include "generation-merge.hpp"
+#include "stopwatch.hpp"
+#include "util.hpp"
+
+using namespace pushfight;
+using namespace std::literals::string_view_literals;
+
+/**
+ * Merges a generation's slice or subslice outputs into win-G.bin/.len and
+ * loss-G.bin/.len (see merge_generation).  With --board, checks that every
+ * slice or subslice of that board is present.
+ */
+int main(int argc, char* argv[]) { //genbuild {'entrypoint': True, 'ldflags': ''}
+	std::optional<unsigned int> generation;
+	std::optional<std::filesystem::path> data_dir;
+	const Board* board = nullptr;
+	GenerationMergeOptions options;
+	options.threads = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 1; i < argc; ++i)
+		if (argv[i] == "--generation"sv)
+			generation = from_string<unsigned int>(argv[++i]);
+		else if (argv[i] == "--data-dir"sv || argv[i] == "--data"sv)
+			data_dir = argv[++i];
+		else if (argv[i] == "--threads"sv)
+			options.threads = from_string<unsigned int>(argv[++i]);
+		else if (argv[i] == "--spill-budget"sv)
+			options.spill_budget = from_string<std::size_t>(argv[++i]) * 1024 * 1024;
+		else if (argv[i] == "--direct-io"sv)
+			options.direct_io = true;
+		else if (argv[i] == "--remove-inputs"sv)
+			options.remove_inputs = true;
+		else if (argv[i] == "--board"sv) {
+			std::string_view name = argv[++i];
+			auto it = std::find_if(std::begin(all_boards), std::end(all_boards), [=](const Board* b) {return b->name() == name;});
+			if (it == std::end(all_boards)) {
+				fmt::print(stderr, "unknown board: {}\n", name);
+				return 1;
+			}
+			board = *it;
+		} else {
+			fmt::print(stderr, "unknown option: {}\n", argv[i]);
+			return 1;
+		}
+	if (!generation || !data_dir) {
+		fmt::print(stderr, "required options not passed\n");
+		return 1;
+	}
+	if (!std::filesystem::is_directory(*data_dir)) {
+		fmt::print(stderr, "data dir not a directory (or does not exist)\n");
+		return 1;
+	}
+
+	Stopwatch stopwatch = Stopwatch::process();
+	auto stats = merge_generation(*data_dir, *generation, board, options);
+	auto times = stopwatch.elapsed();
+	if (stats.recovered)
+		fmt::print("Finished publishing an interrupted merge of generation {}: {} win and {} loss intervals ({} bytes).\n",
+				*generation, stats.win_intervals, stats.loss_intervals, stats.bytes);
+	else
+		fmt::print("Merged {} outputs of generation {} into {} win and {} loss intervals ({} bytes).\n",
+				stats.pieces, *generation, stats.win_intervals, stats.loss_intervals, stats.bytes);
+	fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
+			times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
+	return 0;
+}
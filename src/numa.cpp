@@ -0,0 +1,90 @@
+#include "precompiled.hpp"
+#include "numa.hpp"
+#include "state.hpp"
+#include "util.hpp"
+#include <filesystem>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <sys/mman.h> //for mmap
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using std::vector;
+
+namespace pushfight {
+
+vector<NumaNode> numa_nodes() {
+	vector<NumaNode> nodes;
+	std::filesystem::path dir = "/sys/devices/system/node";
+	std::error_code ec;
+	for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+		std::string name = entry.path().filename();
+		if (!name.starts_with("node") || name.size() == 4 || !std::all_of(name.begin() + 4, name.end(), ::isdigit))
+			continue;
+		std::ifstream in(entry.path() / "cpulist");
+		std::string list;
+		std::getline(in, list);
+		if (list.empty()) continue; //memory-only node
+		nodes.push_back({from_string<unsigned int>(std::string_view(name).substr(4)), parse_cpu_list(list)});
+	}
+	if (nodes.empty()) {
+		NumaNode node = {0, {}};
+		for (unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+			node.cpus.push_back(cpu);
+		nodes.push_back(std::move(node));
+	}
+	std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) {return a.id < b.id;});
+	return nodes;
+}
+
+unsigned int current_numa_node() {
+	unsigned int cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) == -1)
+		return 0;
+	return node;
+}
+
+static unsigned long node_mask(unsigned int node) {
+	if (node >= 8 * sizeof(unsigned long))
+		throw std::logic_error(fmt::format("NUMA node {} out of range", node));
+	return 1UL << node;
+}
+
+void bind_thread_memory(unsigned int node) {
+	unsigned long mask = node_mask(node);
+	if (syscall(SYS_set_mempolicy, MPOL_BIND, &mask, 8 * sizeof(mask)) == -1) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error binding memory to node {}: error {} ({})",
+				node, strerror(saved_errno), saved_errno));
+	}
+}
+
+void* map_node_memory(std::size_t size, unsigned int node) {
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error mapping {} bytes: error {} ({})", size, strerror(saved_errno), saved_errno));
+	}
+	//Bind before anything touches it, so the pages are allocated there.
+	unsigned long mask = node_mask(node);
+	if (syscall(SYS_mbind, p, size, MPOL_BIND, &mask, 8 * sizeof(mask), 0) == -1) {
+		auto saved_errno = errno;
+		munmap(p, size);
+		throw std::runtime_error(fmt::format("error binding memory to node {}: error {} ({})",
+				node, strerror(saved_errno), saved_errno));
+	}
+	return p;
+}
+
+void unmap_node_memory(void* p, std::size_t size) {
+	munmap(p, size);
+}
+
+int memory_node(const void* p) {
+	int node;
+	if (syscall(SYS_get_mempolicy, &node, nullptr, 0, p, MPOL_F_NODE | MPOL_F_ADDR) == -1)
+		return -1;
+	return node;
+}
+
+}//namespace pushfight
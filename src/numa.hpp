@@ -0,0 +1,35 @@
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <cstddef>
+#include <vector>
+
+namespace pushfight {
+
+/**
+ * NUMA support through the raw mbind/set_mempolicy/get_mempolicy system calls,
+ * so nothing needs libnuma.  Machines without NUMA (or without
+ * /sys/devices/system/node) look like a single node 0.
+ */
+struct NumaNode {
+	unsigned int id;
+	std::vector<unsigned int> cpus;
+};
+
+//The nodes with CPUs, in id order.
+std::vector<NumaNode> numa_nodes();
+//The node of the CPU the calling thread is running on.
+unsigned int current_numa_node();
+//Makes the calling thread's future page allocations come from the node.
+void bind_thread_memory(unsigned int node);
+//Maps size bytes of anonymous memory bound to the node.  Free with
+//unmap_node_memory.
+void* map_node_memory(std::size_t size, unsigned int node);
+void unmap_node_memory(void* p, std::size_t size);
+//The node holding the page containing p (faulting it in if need be), or -1 on
+//failure.
+int memory_node(const void* p);
+
+}//namespace pushfight
+
+#endif /* NUMA_HPP */
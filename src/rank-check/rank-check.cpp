@@ -0,0 +1,78 @@
+#include "precompiled.hpp"
+#include "state.hpp"
+#include "board.hpp"
+#include "board-defs.inc"
+#include "stopwatch.hpp"
+#include "util.hpp"
+
+using namespace pushfight;
+using std::vector;
+using namespace std::literals::string_view_literals;
+
+/**
+ * Checks the software and BMI2 rank implementations agree.  Only the anchored
+ * states themselves are ranked; begin() returns false so we never generate
+ * moves or pushes.
+ */
+struct RankCheckVisitor : public ForkableStateVisitor {
+	unsigned long checked = 0, mismatches = 0;
+	vector<State> examples;
+	bool begin(const State& state) override {
+		++checked;
+		if (rank_software(state, traditional) != rank_bmi2(state, traditional)) {
+			++mismatches;
+			if (examples.size() < 10)
+				examples.push_back(state);
+		}
+		return false;
+	}
+	bool accept(const State& state, char removed_piece) override {
+		return true;
+	}
+	void end(const State& state) override {}
+
+	std::unique_ptr<ForkableStateVisitor> clone() const override {
+		return std::make_unique<RankCheckVisitor>();
+	}
+	void merge(std::unique_ptr<ForkableStateVisitor> p) override {
+		RankCheckVisitor& other = dynamic_cast<RankCheckVisitor&>(*p);
+		checked += other.checked;
+		mismatches += other.mismatches;
+		examples.insert(examples.end(), other.examples.begin(), other.examples.end());
+	}
+};
+
+int main(int argc, char* argv[]) { //genbuild {'entrypoint': True, 'ldflags': ''}
+	std::optional<unsigned int> only_slice;
+	for (int i = 1; i < argc; ++i)
+		if (argv[i] == "--slice"sv)
+			only_slice = from_string<unsigned int>(argv[++i]);
+		else {
+			fmt::print(stderr, "unknown option: {}\n", argv[i]);
+			return 1;
+		}
+	if (!__builtin_cpu_supports("bmi2")) {
+		fmt::print(stderr, "CPU does not support BMI2; nothing to check\n");
+		return 1;
+	}
+	fmt::print("rank() is using the {} implementation.\n", cpu_has_fast_pext() ? "BMI2" : "software");
+
+	unsigned long checked = 0, mismatches = 0;
+	for (unsigned int slice = 0; slice < traditional.anchorable_squares(); ++slice) {
+		if (only_slice && slice != *only_slice) continue;
+		RankCheckVisitor visitor;
+		Stopwatch stopwatch = Stopwatch::process();
+		enumerate_anchored_states_threaded(slice, traditional, visitor);
+		auto times = stopwatch.elapsed();
+		fmt::print("slice {}: checked {} states, {} mismatches, {} seconds ({}).\n",
+				slice, visitor.checked, visitor.mismatches, times.seconds(), times.hms());
+		for (const State& s : visitor.examples)
+			fmt::print("  mismatch: {:b} {:b} {:b} {:b} {:b}: software {}, bmi2 {}\n",
+					s.allied_pawns, s.allied_pushers, s.enemy_pawns, s.enemy_pushers, s.anchored_pieces,
+					rank_software(s, traditional), rank_bmi2(s, traditional));
+		checked += visitor.checked;
+		mismatches += visitor.mismatches;
+	}
+	fmt::print("Checked {} states, {} mismatches.\n", checked, mismatches);
+	return mismatches ? 1 : 0;
+}
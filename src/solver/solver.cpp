@@ -2,6 +2,9 @@
 #include "state.hpp"
 #include "board.hpp"
 #include "board-defs.inc"
+#include "database.hpp"
+#include "generation-merge.hpp"
+#include "interval-runs.hpp"
 #include "intervals.hpp"
 #include "interpolation.hpp"
 #include "stopwatch.hpp"
@@ -10,9 +13,11 @@
 #include "hopscotch/hopscotch_map.h"
 #include "ska_sort.hpp"
 #include <filesystem>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/mman.h> //for mmap
+#include <fstream>
+#include <set>
+#include <future>
+#include <sstream>
+#include <unistd.h> //for fsync
 
 using namespace pushfight;
 using std::vector;
@@ -20,11 +25,15 @@ using std::pair;
 using namespace std::literals::string_view_literals;
 
 struct IntervalVisitor : public ForkableStateVisitor {
+	const Board* board;
 	unsigned long wins = 0, losses = 0, visited = 0;
 	bool is_win = false; //set true if we ever push off an enemy piece
 	bool is_loss = true; //set false if we ever make a push that doesn't push off an allied piece
 	vector<unsigned long> win_ranks, loss_ranks;
-	vector<vector<pair<unsigned long, unsigned long>>> win_intervals, loss_intervals;
+	//shared by all clones
+	std::shared_ptr<IntervalRuns> win_runs, loss_runs;
+	IntervalVisitor(const Board& board, std::shared_ptr<IntervalRuns> win_runs, std::shared_ptr<IntervalRuns> loss_runs)
+			: board(&board), win_runs(std::move(win_runs)), loss_runs(std::move(loss_runs)) {}
 	bool begin(const State& state) override {
 		is_win = false;
 		is_loss = true;
@@ -35,43 +44,47 @@ struct IntervalVisitor : public ForkableStateVisitor {
 		++visited;
 		if (is_win) {
 			++wins;
-			//TODO: board should be passed in from elsewhere
-			auto r = rank(state, traditional);
+			auto r = rank(state, *board);
 			if (win_ranks.size() * sizeof(win_ranks.front()) >= 16*1024*1024 &&
 					r != win_ranks.back() + 1) {
-				win_intervals.push_back(maximal_intervals(win_ranks));
+				//provisional until merged, for checkpoints
+				win_runs->add(maximal_intervals(win_ranks), this);
 				win_ranks.clear();
 			}
 			win_ranks.push_back(r);
 		} else if (is_loss) {
 			++losses;
-			auto r = rank(state, traditional);
+			auto r = rank(state, *board);
 			if (loss_ranks.size() * sizeof(loss_ranks.front()) >= 16*1024*1024 &&
 					r != loss_ranks.back() + 1) {
-				loss_intervals.push_back(maximal_intervals(loss_ranks));
+				loss_runs->add(maximal_intervals(loss_ranks), this);
 				loss_ranks.clear();
 			}
 			loss_ranks.push_back(r);
 		}
 	}
 
-	void prepare_for_merge() {
-		//clean up any remainder
+	void finish() override {
+		//clean up any remainder, still provisional until merged
 		if (win_ranks.size())
-			win_intervals.push_back(maximal_intervals(win_ranks));
+			win_runs->add(maximal_intervals(win_ranks), this);
 		if (loss_ranks.size())
-			loss_intervals.push_back(maximal_intervals(loss_ranks));
+			loss_runs->add(maximal_intervals(loss_ranks), this);
+		win_ranks.clear();
+		loss_ranks.clear();
 	}
 
 	void merge(std::unique_ptr<ForkableStateVisitor> p) override {
 		IntervalVisitor& other = dynamic_cast<IntervalVisitor&>(*p);
-		other.prepare_for_merge();
+		other.finish();
+		//Committing with the enumerator's merge lock held keeps checkpoints
+		//consistent with the items it records as finished.
+		win_runs->commit(&other);
+		loss_runs->commit(&other);
 
 		wins += other.wins;
 		losses += other.losses;
 		visited += other.visited;
-		win_intervals.insert(win_intervals.end(), std::move_iterator(other.win_intervals.begin()), std::move_iterator(other.win_intervals.end()));
-		loss_intervals.insert(loss_intervals.end(), std::move_iterator(other.loss_intervals.begin()), std::move_iterator(other.loss_intervals.end()));
 	}
 };
 
@@ -80,6 +93,7 @@ struct IntervalVisitor : public ForkableStateVisitor {
  * or losses, rather than positions they lead to).
  */
 struct InherentValueVisitor : public IntervalVisitor {
+	using IntervalVisitor::IntervalVisitor;
 	bool accept(const State& state, char removed_piece) override {
 		if (removed_piece == 'E' || removed_piece == 'e') {
 			is_win = true;
@@ -89,73 +103,20 @@ struct InherentValueVisitor : public IntervalVisitor {
 		return true;
 	}
 	std::unique_ptr<ForkableStateVisitor> clone() const override {
-		return std::make_unique<InherentValueVisitor>();
-	}
-};
-
-enum GameValue {WIN, LOSS, UNKNOWN};
-struct WinLossUnknownDatabase {
-	struct Data {
-		pair<unsigned long*, unsigned long*> start;
-		pair<std::uint8_t*, std::uint8_t*> length;
-		GameValue v;
-	};
-	vector<Data> data;
-	WinLossUnknownDatabase(vector<std::filesystem::path> starts, vector<std::filesystem::path> lengths, vector<GameValue> values) {
-		if (starts.size() != lengths.size() || lengths.size() != values.size())
-			throw std::logic_error("length mismatch in WinLossUnknownDatabase");
-		for (std::size_t i = 0; i < starts.size(); ++i) {
-			auto ssz = std::filesystem::file_size(starts[i]);
-			auto lsz = std::filesystem::file_size(lengths[i]);
-			if (ssz == 0 && lsz == 0) continue;
-			if (ssz == 0 || lsz == 0)
-				throw std::logic_error(fmt::format("empty/nonempty mismatch between {} and {}",
-						starts[i].c_str(), lengths[i].c_str()));
-
-			int fd = open(starts[i].c_str(), O_RDONLY);
-			void* sv = mmap(nullptr, ssz, PROT_READ, MAP_SHARED_VALIDATE, fd, 0);
-			close(fd);
-
-			fd = open(lengths[i].c_str(), O_RDONLY);
-			void* lv = mmap(nullptr, lsz, PROT_READ, MAP_SHARED_VALIDATE, fd, 0);
-			close(fd);
-
-			//Disable readahead.
-			madvise(sv, ssz, MADV_RANDOM);
-			madvise(lv, lsz, MADV_RANDOM);
-
-			Data d;
-			d.start.first = reinterpret_cast<unsigned long*>(sv);
-			d.start.second = d.start.first + ssz / sizeof(unsigned long);
-			d.length.first = reinterpret_cast<std::uint8_t*>(lv);
-			d.length.second = d.length.first + lsz / sizeof(std::uint8_t);
-			d.v = values[i];
-			data.push_back(d);
-		}
-	}
-
-	GameValue query(unsigned long r) const {
-		for (Data d : data) {
-			auto p = std::upper_bound(d.start.first, d.start.second, r);
-			if (p == d.start.first) continue;
-			--p;
-			auto offset = std::distance(d.start.first, p);
-			auto q = d.length.first;
-			std::advance(q, offset);
-			if (*p <= r && r < (*p + *q)) return d.v;
-		}
-		return UNKNOWN;
+		return std::make_unique<InherentValueVisitor>(*board, win_runs, loss_runs);
 	}
 };
 
 struct CompositeValueVisitor : public IntervalVisitor {
 	const WinLossUnknownDatabase* wldb;
 	tsl::hopscotch_set<unsigned long> already_processed;
-	CompositeValueVisitor(const WinLossUnknownDatabase* wldb) : wldb(wldb) {}
+	CompositeValueVisitor(const Board& board, const WinLossUnknownDatabase* wldb,
+			std::shared_ptr<IntervalRuns> win_runs, std::shared_ptr<IntervalRuns> loss_runs)
+			: IntervalVisitor(board, std::move(win_runs), std::move(loss_runs)), wldb(wldb) {}
 
 	bool begin(const State& state) override {
 		already_processed.clear();
-		auto r = rank(state, traditional);
+		auto r = rank(state, *board);
 		if (wldb->query(r) != UNKNOWN)
 			return false;
 		return IntervalVisitor::begin(state);
@@ -168,7 +129,7 @@ struct CompositeValueVisitor : public IntervalVisitor {
 			//can't rank this because we removed a piece, but it doesn't affect
 			//whether this position is a win or a loss
 			return true;
-		auto r = rank(state, traditional);
+		auto r = rank(state, *board);
 		if (!already_processed.insert(r).second)
 			return true;
 		auto value = wldb->query(r);
@@ -182,71 +143,10 @@ struct CompositeValueVisitor : public IntervalVisitor {
 	}
 
 	std::unique_ptr<ForkableStateVisitor> clone() const override {
-		return std::make_unique<CompositeValueVisitor>(wldb);
+		return std::make_unique<CompositeValueVisitor>(*board, wldb, win_runs, loss_runs);
 	}
 };
 
-void write_intervals(vector<vector<pair<unsigned long, unsigned long>>>&& intervals,
-		std::filesystem::path start_filename, std::filesystem::path length_filename) {
-	FILE* sf = std::fopen(start_filename.c_str(), "w+"),
-			*lf = std::fopen(length_filename.c_str(), "w+");
-	for (vector<pair<unsigned long, unsigned long>> v : intervals) {
-		for (pair<unsigned long, unsigned long> i : v) {
-			//If an interval's size is greater than 255 we split it into multiple intervals.
-			for (unsigned long start = i.first; start < i.second;) {
-				unsigned long length = std::min(255ul, i.second - start);
-				std::size_t written = std::fwrite(&start, sizeof(start), 1, sf);
-				if (written != 1) {
-					auto saved_errno = errno;
-					throw std::runtime_error(fmt::format("error writing {}: failed to write start; error {} ({})",
-							start_filename.c_str(), strerror(saved_errno), saved_errno));
-				}
-				written = std::fwrite(&length, sizeof(std::uint8_t), 1, lf);
-				if (written != 1) {
-					auto saved_errno = errno;
-					throw std::runtime_error(fmt::format("error writing {}: failed to write length; error {} ({})",
-							start_filename.c_str(), strerror(saved_errno), saved_errno));
-				}
-				start += length;
-			}
-		}
-		vector<pair<unsigned long, unsigned long>> free_memory(std::move(v));
-	}
-
-	if (std::fflush(sf)) {
-		auto saved_errno = errno;
-		throw std::runtime_error(fmt::format("error writing {}: failed to flush start file; error {} ({})",
-				start_filename.c_str(), strerror(saved_errno), saved_errno));
-	}
-	if (std::fflush(lf)) {
-		auto saved_errno = errno;
-		throw std::runtime_error(fmt::format("error writing {}: failed to flush length file; error {} ({})",
-				start_filename.c_str(), strerror(saved_errno), saved_errno));
-	}
-
-	if (fsync(fileno(sf))) {
-		auto saved_errno = errno;
-		throw std::runtime_error(fmt::format("error writing {}: failed to sync start file; error {} ({})",
-				start_filename.c_str(), strerror(saved_errno), saved_errno));
-	}
-	if (fsync(fileno(lf))) {
-		auto saved_errno = errno;
-		throw std::runtime_error(fmt::format("error writing {}: failed to sync length file; error {} ({})",
-				start_filename.c_str(), strerror(saved_errno), saved_errno));
-	}
-
-	if (std::fclose(sf)) {
-		auto saved_errno = errno;
-		throw std::runtime_error(fmt::format("error writing {}: failed to close start file; error {} ({})",
-				start_filename.c_str(), strerror(saved_errno), saved_errno));
-	}
-	if (std::fclose(lf)) {
-		auto saved_errno = errno;
-		throw std::runtime_error(fmt::format("error writing {}: failed to close length file; error {} ({})",
-				start_filename.c_str(), strerror(saved_errno), saved_errno));
-	}
-}
-
 struct splitmix64 {
 	//from near bottom of https://nullprogram.com/blog/2018/07/31/
 	std::size_t operator()(unsigned long x) const {
@@ -282,20 +182,37 @@ auto gallop_to_next_first(vector<pair<unsigned long, unsigned long>>::iterator f
 }
 
 struct OutcountingVisitor : public ForkableStateVisitor {
-	vector<vector<pair<unsigned long, unsigned long>>> win_intervals, loss_intervals;
+	const Board* board;
+	//shared by all clones
+	std::shared_ptr<IntervalRuns> win_runs, loss_runs;
 	unsigned long wins = 0, losses = 0, visited = 0;
 	vector<pair<unsigned long, unsigned long>> succ_to_pred;
 	tsl::hopscotch_map<unsigned long, std::uint16_t, splitmix64> outcounts;
 	const WinLossUnknownDatabase* wldb;
 	tsl::hopscotch_set<unsigned long, splitmix64> successors;
 	unsigned long current_rank = 0;
-	OutcountingVisitor(const WinLossUnknownDatabase* wldb) : wldb(wldb) {
-		succ_to_pred.reserve(64*1024*1024);
+	//true if the enumeration only visits unresolved states, so begin() need
+	//not check
+	bool prefiltered;
+	//memory for succ_to_pred, which flushes when full
+	std::size_t pair_budget;
+	OutcountingVisitor(const Board& board, const WinLossUnknownDatabase* wldb,
+			std::shared_ptr<IntervalRuns> win_runs, std::shared_ptr<IntervalRuns> loss_runs, bool prefiltered,
+			std::size_t pair_budget)
+			: board(&board), win_runs(std::move(win_runs)), loss_runs(std::move(loss_runs)), wldb(wldb), prefiltered(prefiltered),
+			pair_budget(pair_budget) {}
+
+	//Pairs to hold before flushing.  The vector is reserved when first used,
+	//so a visitor that only merges clones (like enumerate_rank_intervals's
+	//parent) never allocates it, with room for one more state's successors so
+	//it never grows past the budget.
+	std::size_t pair_limit() const {
+		return std::max<std::size_t>(pair_budget / sizeof(succ_to_pred[0]), 1024 * 1024);
 	}
 
 	bool begin(const State& state) override {
-		current_rank = rank(state, traditional);
-		if (wldb->query(current_rank) != UNKNOWN)
+		current_rank = rank(state, *board);
+		if (!prefiltered && wldb->query(current_rank) != UNKNOWN)
 			return false;
 		successors.clear();
 		return true;
@@ -308,7 +225,7 @@ struct OutcountingVisitor : public ForkableStateVisitor {
 			//can't rank this because we removed a piece, but it doesn't affect
 			//whether this position is a win or a loss
 			return true;
-		auto r = rank(state, traditional);
+		auto r = rank(state, *board);
 		successors.insert(r);
 		return true;
 	}
@@ -318,9 +235,11 @@ struct OutcountingVisitor : public ForkableStateVisitor {
 		if (successors.size() > std::numeric_limits<std::uint16_t>::max())
 			throw std::logic_error(fmt::format("too many successors for {}: {}", current_rank, successors.size()));
 		outcounts[current_rank] = (std::uint16_t)successors.size();
+		if (!succ_to_pred.capacity())
+			succ_to_pred.reserve(pair_limit() + std::numeric_limits<std::uint16_t>::max());
 		for (auto succ : successors)
 			succ_to_pred.push_back({succ, current_rank});
-		if (succ_to_pred.size() > succ_to_pred.capacity() - 25000)
+		if (succ_to_pred.size() >= pair_limit())
 			flush();
 	}
 
@@ -328,19 +247,33 @@ struct OutcountingVisitor : public ForkableStateVisitor {
 		vector<unsigned long> win_ranks;
 
 		ska_sort(succ_to_pred.begin(), succ_to_pred.end(), [](auto& a){return a.first;});
+		//Query the distinct successors in sorted batches, so the database can
+		//merge-join them against its intervals.
+		constexpr std::size_t batch_size = 1024*1024;
+		vector<unsigned long> succs;
+		vector<GameValue> values;
+		succs.reserve(batch_size);
 		for (auto it = succ_to_pred.begin(); it != succ_to_pred.end();) {
-			auto succ = it->first;
-			auto value = wldb->query(succ);
-			if (value == LOSS)
-				do {
-					win_ranks.push_back(it->second);
-				} while ((++it) != succ_to_pred.end() && it->first == succ);
-			else if (value == WIN)
-				do {
-					--outcounts[it->second];
-				} while ((++it) != succ_to_pred.end() && it->first == succ);
-			else
-				it = gallop_to_next_first(it, succ_to_pred.end());
+			succs.clear();
+			for (auto jt = it; jt != succ_to_pred.end() && succs.size() < batch_size;
+					jt = gallop_to_next_first(jt, succ_to_pred.end()))
+				succs.push_back(jt->first);
+			values.resize(succs.size());
+			wldb->query_sorted(succs, values);
+
+			for (std::size_t i = 0; i < succs.size(); ++i) {
+				auto succ = succs[i];
+				if (values[i] == LOSS)
+					do {
+						win_ranks.push_back(it->second);
+					} while ((++it) != succ_to_pred.end() && it->first == succ);
+				else if (values[i] == WIN)
+					do {
+						--outcounts[it->second];
+					} while ((++it) != succ_to_pred.end() && it->first == succ);
+				else
+					it = gallop_to_next_first(it, succ_to_pred.end());
+			}
 		}
 
 		vector<unsigned long> loss_ranks;
@@ -351,40 +284,43 @@ struct OutcountingVisitor : public ForkableStateVisitor {
 		std::sort(win_ranks.begin(), win_ranks.end());
 		win_ranks.erase(std::unique(win_ranks.begin(), win_ranks.end()), win_ranks.end());
 		wins += win_ranks.size();
-		win_intervals.push_back(maximal_intervals(win_ranks));
+		win_runs->add(maximal_intervals(win_ranks));
 		std::sort(loss_ranks.begin(), loss_ranks.end());
 		loss_ranks.erase(std::unique(loss_ranks.begin(), loss_ranks.end()), loss_ranks.end());
 		losses += loss_ranks.size();
-		loss_intervals.push_back(maximal_intervals(loss_ranks));
+		loss_runs->add(maximal_intervals(loss_ranks));
 
 		succ_to_pred.clear();
 		outcounts.clear();
 	}
 
 	std::unique_ptr<ForkableStateVisitor> clone() const override {
-		return std::make_unique<OutcountingVisitor>(wldb);
+		return std::make_unique<OutcountingVisitor>(*board, wldb, win_runs, loss_runs, prefiltered, pair_budget);
+	}
+
+	void finish() override {
+		if (!succ_to_pred.empty())
+			flush();
 	}
 
 	void merge(std::unique_ptr<ForkableStateVisitor> p) override {
-		OutcountingVisitor* other = dynamic_cast<OutcountingVisitor*>(p.get());
-		if (!other->succ_to_pred.empty())
-			other->flush();
+		OutcountingVisitor& other = dynamic_cast<OutcountingVisitor&>(*p);
+		other.finish();
 
-		wins += other->wins;
-		losses += other->losses;
-		visited += other->visited;
-		win_intervals.insert(win_intervals.end(), std::move_iterator(other->win_intervals.begin()), std::move_iterator(other->win_intervals.end()));
-		loss_intervals.insert(loss_intervals.end(), std::move_iterator(other->loss_intervals.begin()), std::move_iterator(other->loss_intervals.end()));
+		wins += other.wins;
+		losses += other.losses;
+		visited += other.visited;
 	}
 };
 
 struct OpeningProcedureVisitor : public ForkableStateVisitor {
+	const Board* board;
 	const WinLossUnknownDatabase* wldb;
 	tsl::hopscotch_set<unsigned long> already_processed;
 	bool is_win = false; //set true if we ever push off an enemy piece
 	bool is_loss = true; //set false if we ever make a push that doesn't push off an allied piece
 	vector<State> winning_openings, losing_openings, drawn_openings;
-	OpeningProcedureVisitor(const WinLossUnknownDatabase* wldb) : wldb(wldb) {}
+	OpeningProcedureVisitor(const Board& board, const WinLossUnknownDatabase* wldb) : board(&board), wldb(wldb) {}
 
 	bool begin(const State& state) override {
 		already_processed.clear();
@@ -403,7 +339,7 @@ struct OpeningProcedureVisitor : public ForkableStateVisitor {
 			//can't rank this because we removed a piece, but it doesn't affect
 			//whether this position is a win or a loss
 			return true;
-		auto r = rank(state, traditional);
+		auto r = rank(state, *board);
 		if (!already_processed.insert(r).second)
 			return true;
 		auto value = wldb->query(r);
@@ -426,7 +362,7 @@ struct OpeningProcedureVisitor : public ForkableStateVisitor {
 	}
 
 	std::unique_ptr<ForkableStateVisitor> clone() const override {
-		return std::make_unique<OpeningProcedureVisitor>(wldb);
+		return std::make_unique<OpeningProcedureVisitor>(*board, wldb);
 	}
 
 	void merge(std::unique_ptr<ForkableStateVisitor> p) override {
@@ -490,10 +426,496 @@ void write_openings(std::filesystem::path data_dir, const OpeningProcedureVisito
 	}
 }
 
+//Call once the queries to count have finished, and before
+//invalidate_query_caches.
+void print_cache_stats(const WinLossUnknownDatabase& wldb) {
+	//The pool's threads outlive main, so they don't publish their counts on exit.
+	publish_query_cache_stats(shared_thread_pool());
+	unsigned long hits = wldb.cache_stats->hits, misses = wldb.cache_stats->misses;
+	if (hits + misses)
+		fmt::print("{} query cache hits, {} misses ({:.1f}% hit rate).\n",
+				hits, misses, 100.0 * (double)hits / (double)(hits + misses));
+}
+
+//Prints the sampled NUMA locality of queries, if counted.
+void print_numa_stats(const WinLossUnknownDatabase& wldb) {
+	if (!wldb.numa_stats) return;
+	unsigned long local = wldb.numa_stats->local, remote = wldb.numa_stats->remote;
+	if (local + remote)
+		fmt::print("Sampled {} node-local and {} remote database reads ({:.1f}% local).\n",
+				local, remote, 100.0 * (double)local / (double)(local + remote));
+}
+
+struct DatabaseOptions {
+	SearchStrategy strategy;
+	std::optional<std::size_t> query_cache_entries;
+	//count local and remote reads
+	bool numa_stats;
+	//copy the hot index to each node
+	bool numa_replicas;
+};
+
+//Applies the options to a freshly loaded (or extended) database.
+void configure_database(WinLossUnknownDatabase& wldb, const DatabaseOptions& options) {
+	wldb.strategy = options.strategy;
+	if (options.query_cache_entries)
+		wldb.cache_entries = *options.query_cache_entries;
+	if (options.numa_stats && !wldb.numa_stats)
+		wldb.numa_stats = std::make_shared<WinLossUnknownDatabase::NumaStats>();
+	if (options.numa_replicas)
+		wldb.replicate_hot_index(numa_nodes());
+}
+
+//Prints how evenly the work was spread over the threads.
+void print_parallel_stats(const ParallelStats& stats) {
+	if (stats.busy.empty()) return;
+	auto [min, max] = std::minmax_element(stats.busy.begin(), stats.busy.end());
+	double mean = std::chrono::duration<double>(std::accumulate(stats.busy.begin(), stats.busy.end(),
+			std::chrono::nanoseconds(0))).count() / (double)stats.busy.size();
+	double max_seconds = std::chrono::duration<double>(*max).count();
+	fmt::print("Thread busy time: min {:.2f}s, mean {:.2f}s, max {:.2f}s ({:.1f}% balanced); {} steals.\n",
+			std::chrono::duration<double>(*min).count(), mean, max_seconds,
+			max_seconds ? 100.0 * mean / max_seconds : 100.0, stats.steals);
+}
+
+//Writes the win and loss intervals concurrently (each through double-buffered
+//BulkWriters) and reports the combined throughput.
+void write_win_loss_intervals(IntervalRuns& win_runs, IntervalRuns& loss_runs,
+		const std::filesystem::path& win_start_file, const std::filesystem::path& win_length_file,
+		const std::filesystem::path& loss_start_file, const std::filesystem::path& loss_length_file, bool direct_io, bool verbose) {
+	std::size_t spilled = win_runs.spilled_runs() + loss_runs.spilled_runs();
+	auto start = std::chrono::steady_clock::now();
+	auto loss_bytes = std::async(std::launch::async, [&]() {
+		return loss_runs.write(loss_start_file, loss_length_file, direct_io);
+	});
+	std::uintmax_t bytes = win_runs.write(win_start_file, win_length_file, direct_io);
+	bytes += loss_bytes.get();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (verbose)
+		fmt::print("Wrote {} bytes of intervals in {:.3f} seconds ({:.2f} GB/s{}), merging {} spilled runs.\n",
+				bytes, seconds, seconds > 0 ? (double)bytes / seconds / 1e9 : 0.0, direct_io ? ", O_DIRECT" : "", spilled);
+}
+
+struct OutputOptions {
+	//memory for result intervals before they spill to disk, split evenly
+	//between wins and losses
+	std::size_t spill_budget;
+	//memory for a subslice's successor-predecessor pairs before they're
+	//resolved against the database
+	std::size_t pair_budget;
+	bool direct_io;
+	//print statistics for each slice or subslice
+	bool verbose;
+	//if nonzero, how often generation 0 slices checkpoint their progress
+	std::chrono::seconds checkpoint_interval{0};
+	//continue generation 0 slices from their checkpoints, if any
+	bool resume = false;
+};
+
+struct SolveResult {
+	//false if the outputs already existed, in which case nothing was done
+	bool solved;
+	unsigned long visited, wins, losses;
+};
+
+/**
+ * Checkpoints a generation 0 slice to data_dir/tmp/checkpoint-0-SS.txt: the
+ * finished work items, the visitor's counts, and the committed spill files of
+ * the win and loss runs (in the same directory), which hold those items'
+ * results.  A checkpoint is
+ * written to a temp file and renamed into place, so an interrupted save leaves
+ * the previous one.
+ */
+class SliceCheckpoint : public EnumerationCheckpoint {
+public:
+	SliceCheckpoint(const std::filesystem::path& data_dir, unsigned int slice, IntervalVisitor& visitor,
+			IntervalRuns& win_runs, IntervalRuns& loss_runs, bool resume)
+			: file_(data_dir / "tmp" / fmt::format("checkpoint-0-{:02}.txt", slice)), slice_(slice),
+			visitor_(visitor), win_runs_(win_runs), loss_runs_(loss_runs), resume_(resume) {}
+
+	vector<std::size_t> finished() override {
+		vector<std::size_t> result;
+		//If we're starting over, the old checkpoint is garbage, and may be
+		//corrupt, so don't read it; the sweep below removes its runs.
+		if (!resume_)
+			remove();
+		bool resuming = std::filesystem::exists(file_);
+		std::ifstream in(file_);
+		std::set<std::string> adopted;
+		std::string line;
+		while (std::getline(in, line)) {
+			std::istringstream fields(line);
+			std::string key;
+			fields >> key;
+			if (key == "counts")
+				fields >> visitor_.visited >> visitor_.wins >> visitor_.losses;
+			else if (key == "finished") {
+				//first-last (inclusive) or just first
+				for (std::size_t first; fields >> first;) {
+					std::size_t last = first;
+					if (fields.peek() == '-' && !(fields.ignore() >> last))
+						break;
+					for (std::size_t index = first; index <= last; ++index)
+						result.push_back(index);
+				}
+				if (!fields.eof())
+					throw std::runtime_error(fmt::format("bad line in {}: {}", file_.c_str(), line));
+				fields.clear();
+			} else if (key == "win" || key == "loss") {
+				std::size_t size;
+				std::string file;
+				fields >> size;
+				std::getline(fields >> std::ws, file);
+				(key == "win" ? win_runs_ : loss_runs_).adopt(file_.parent_path() / file, size);
+				adopted.insert(file);
+			} else
+				throw std::runtime_error(fmt::format("bad line in {}: {}", file_.c_str(), line));
+			if (fields.fail())
+				throw std::runtime_error(fmt::format("bad line in {}: {}", file_.c_str(), line));
+		}
+		//Runs spilled after the last checkpoint, or by a run that crashed
+		//before its first, are garbage too.
+		std::string win_prefix = fmt::format("win-0-{:02}-", slice_), loss_prefix = fmt::format("loss-0-{:02}-", slice_);
+		if (std::filesystem::is_directory(file_.parent_path()))
+			for (const auto& entry : std::filesystem::directory_iterator(file_.parent_path())) {
+				std::string name = entry.path().filename().native();
+				if ((name.starts_with(win_prefix) || name.starts_with(loss_prefix)) && name.ends_with(".run") &&
+						!adopted.contains(name))
+					std::filesystem::remove(entry.path());
+			}
+		if (resuming)
+			fmt::print("Resuming from {} with {} finished work items.\n", file_.c_str(), result.size());
+		return result;
+	}
+
+	void save(const vector<std::size_t>& finished) override {
+		auto win_files = win_runs_.checkpoint(), loss_files = loss_runs_.checkpoint();
+		std::filesystem::path tmp_file = file_;
+		tmp_file += ".tmp";
+		FILE* f = std::fopen(tmp_file.c_str(), "w");
+		if (!f)
+			throw std::runtime_error(fmt::format("error opening {}", tmp_file.c_str()));
+		fmt::print(f, "counts {} {} {}\n", visitor_.visited, visitor_.wins, visitor_.losses);
+		//Threads finish contiguous ranges of items, so write ranges.
+		vector<std::size_t> sorted = finished;
+		std::sort(sorted.begin(), sorted.end());
+		fmt::print(f, "finished");
+		for (auto it = sorted.begin(); it != sorted.end();) {
+			auto last = it;
+			while (last + 1 != sorted.end() && *(last + 1) == *last + 1)
+				++last;
+			if (last == it)
+				fmt::print(f, " {}", *it);
+			else
+				fmt::print(f, " {}-{}", *it, *last);
+			it = last + 1;
+		}
+		fmt::print(f, "\n");
+		for (const auto& [file, size] : win_files)
+			fmt::print(f, "win {} {}\n", size, file.filename().native());
+		for (const auto& [file, size] : loss_files)
+			fmt::print(f, "loss {} {}\n", size, file.filename().native());
+		if (std::fflush(f) || fsync(fileno(f))) {
+			std::fclose(f);
+			throw std::runtime_error(fmt::format("error writing {}", tmp_file.c_str()));
+		}
+		std::fclose(f);
+		std::filesystem::rename(tmp_file, file_);
+	}
+
+	//Removes the checkpoint, once the slice's outputs are written (which
+	//removes the runs).
+	void remove() {
+		std::filesystem::remove(file_);
+	}
+private:
+	std::filesystem::path file_;
+	unsigned int slice_;
+	IntervalVisitor& visitor_;
+	IntervalRuns& win_runs_, & loss_runs_;
+	bool resume_;
+};
+
+//Returns true if all four of a slice's or subslice's output files exist.
+//Otherwise removes any that do, which a crash while renaming them into place
+//can leave, so the caller solves it again.
+bool outputs_exist(const std::array<std::filesystem::path, 4>& files) {
+	if (std::all_of(files.begin(), files.end(), [](const auto& f) {return std::filesystem::exists(f);}))
+		return true;
+	for (const auto& f : files)
+		std::filesystem::remove(f);
+	return false;
+}
+
+//Computes the inherent values of a slice's states, writing win-0-SS.bin/.len
+//and loss-0-SS.bin/.len through data_dir/tmp.  With a checkpoint interval,
+//records progress as it goes (see SliceCheckpoint).
+SolveResult solve_generation0_slice(const std::filesystem::path& data_dir, unsigned int slice, const Board& board,
+		const OutputOptions& options) {
+	std::filesystem::path win_start_file = data_dir / fmt::format("win-0-{:02}.bin", slice),
+		win_length_file = data_dir / fmt::format("win-0-{:02}.len", slice),
+		loss_start_file = data_dir / fmt::format("loss-0-{:02}.bin", slice),
+		loss_length_file = data_dir / fmt::format("loss-0-{:02}.len", slice);
+	if (outputs_exist({win_start_file, win_length_file, loss_start_file, loss_length_file}))
+		return {false, 0, 0, 0};
+	//We go ahead and overwrite these temp files.
+	std::filesystem::path win_start_temp_file = data_dir / "tmp" / win_start_file.filename(),
+		win_length_temp_file = data_dir / "tmp" / win_length_file.filename(),
+		loss_start_temp_file = data_dir / "tmp" / loss_start_file.filename(),
+		loss_length_temp_file = data_dir / "tmp" / loss_length_file.filename();
+	std::filesystem::create_directories(win_start_temp_file.parent_path());
+
+	auto win_runs = std::make_shared<IntervalRuns>(data_dir / "tmp" / fmt::format("win-0-{:02}", slice), options.spill_budget / 2),
+		loss_runs = std::make_shared<IntervalRuns>(data_dir / "tmp" / fmt::format("loss-0-{:02}", slice), options.spill_budget / 2);
+	std::unique_ptr<IntervalVisitor> visitor_ptr;
+	visitor_ptr = std::make_unique<InherentValueVisitor>(board, win_runs, loss_runs);
+	IntervalVisitor& visitor = *visitor_ptr;
+
+	//Even without checkpoints, this cleans up after an earlier checkpointed
+	//run that isn't being resumed.
+	SliceCheckpoint checkpoint(data_dir, slice, visitor, *win_runs, *loss_runs, options.resume);
+	if (options.checkpoint_interval.count())
+		checkpoint.interval = options.checkpoint_interval;
+	else
+		checkpoint.interval = std::chrono::steady_clock::duration::max();
+
+	Stopwatch stopwatch = Stopwatch::process();
+	auto parallel_stats = enumerate_anchored_states_threaded(slice, board, *visitor_ptr, &checkpoint);
+	auto times = stopwatch.elapsed();
+
+	if (options.verbose) {
+		fmt::print("Processed generation 0 slice {}.\n", slice);
+		print_parallel_stats(parallel_stats);
+		fmt::print("Visited {} states, found {} wins ({:.3f}) and {} losses ({:.3f}), total {} ({:.3f}) resolved.\n",
+				visitor.visited,
+				visitor.wins, (double)visitor.wins / (double)visitor.visited,
+				visitor.losses, (double)visitor.losses / (double)visitor.visited,
+				visitor.wins + visitor.losses, (double)(visitor.wins + visitor.losses) / (double)visitor.visited);
+		unsigned long total_win_intervals = win_runs->size(), total_loss_intervals = loss_runs->size();
+		fmt::print("{} win intervals ({:.5f}) and {} loss intervals ({:.5f}).\n",
+				total_win_intervals, (double)visitor.wins / (double)total_win_intervals,
+				total_loss_intervals, (double)visitor.losses / (double)total_loss_intervals);
+		fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
+				times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
+	}
+
+	//IntervalVisitor assumes a given visitor object will either be the parent
+	//being merged into or an actual visitor, not both.  The parent shouldn't
+	//have any singleton ranks of its own because it never visits.  Ideally we
+	//would change the design of ForkableStateVisitor to not inherit from
+	//StateVisitor, but in lieu of that, at least fail noisily.
+	if (visitor.win_ranks.size() || visitor.loss_ranks.size())
+		throw std::logic_error("unmerged singleton ranks?");
+
+	write_win_loss_intervals(*win_runs, *loss_runs,
+			win_start_temp_file, win_length_temp_file, loss_start_temp_file, loss_length_temp_file, options.direct_io, options.verbose);
+	checkpoint.remove();
+	//If we crash after renaming some but not all of these, the next run
+	//removes them and solves the slice again.
+	std::filesystem::rename(win_start_temp_file, win_start_file);
+	std::filesystem::rename(win_length_temp_file, win_length_file);
+	std::filesystem::rename(loss_start_temp_file, loss_start_file);
+	std::filesystem::rename(loss_length_temp_file, loss_length_file);
+	return {true, visitor.visited, visitor.wins, visitor.losses};
+}
+
+//Resolves what it can of a subslice's unresolved states from the database of
+//earlier generations, writing win-G-SS-SSS.bin/.len and loss-G-SS-SSS.bin/.len
+//through data_dir/tmp.
+SolveResult solve_subslice(const std::filesystem::path& data_dir, unsigned int generation, unsigned int slice, unsigned int subslice,
+		const Board& board, const WinLossUnknownDatabase& wldb, const OutputOptions& options) {
+	//Check if the final outputs exist.
+	std::filesystem::path win_start_file = data_dir / fmt::format("win-{}-{:02}-{:03}.bin", generation, slice, subslice),
+		win_length_file = data_dir / fmt::format("win-{}-{:02}-{:03}.len", generation, slice, subslice),
+		loss_start_file = data_dir / fmt::format("loss-{}-{:02}-{:03}.bin", generation, slice, subslice),
+		loss_length_file = data_dir / fmt::format("loss-{}-{:02}-{:03}.len", generation, slice, subslice);
+	if (outputs_exist({win_start_file, win_length_file, loss_start_file, loss_length_file}))
+		return {false, 0, 0, 0};
+	//We go ahead and overwrite these temp files.
+	std::filesystem::path win_start_temp_file = data_dir / "tmp" / fmt::format("win-{}-{:02}-{:03}.bin", generation, slice, subslice),
+		win_length_temp_file = data_dir / "tmp" / fmt::format("win-{}-{:02}-{:03}.len", generation, slice, subslice),
+		loss_start_temp_file = data_dir / "tmp" / fmt::format("loss-{}-{:02}-{:03}.bin", generation, slice, subslice),
+		loss_length_temp_file = data_dir / "tmp" / fmt::format("loss-{}-{:02}-{:03}.len", generation, slice, subslice);
+	std::filesystem::create_directories(win_start_temp_file.parent_path());
+
+	//Only visit the states earlier generations didn't resolve.  In late
+	//generations that's a small fraction of the subslice.
+	Stopwatch stopwatch = Stopwatch::process();
+	auto range = subslice_rank_range(slice, subslice, board);
+	auto known = wldb.known_intervals(range.first, range.second);
+	auto unknown = interval_difference(&range, &range + 1, known.begin(), known.end());
+	auto win_runs = std::make_shared<IntervalRuns>(data_dir / "tmp" / fmt::format("win-{}-{:02}-{:03}", generation, slice, subslice), options.spill_budget / 2),
+		loss_runs = std::make_shared<IntervalRuns>(data_dir / "tmp" / fmt::format("loss-{}-{:02}-{:03}", generation, slice, subslice), options.spill_budget / 2);
+	OutcountingVisitor visitor(board, &wldb, win_runs, loss_runs, true, options.pair_budget);
+	enumerate_rank_intervals(unknown, board, visitor);
+	auto times = stopwatch.elapsed();
+
+	if (options.verbose) {
+		fmt::print("Processed generation {} slice {} subslice {}.\n", generation, slice, subslice);
+		fmt::print("{} of {} ranks in the subslice already resolved, in {} intervals.\n",
+				interval_size(known), range.second - range.first, known.size());
+		fmt::print("Visited {} states, found {} wins ({:.3f}) and {} losses ({:.3f}), total {} ({:.3f}) resolved.\n",
+				visitor.visited,
+				visitor.wins, (double)visitor.wins / (double)visitor.visited,
+				visitor.losses, (double)visitor.losses / (double)visitor.visited,
+				visitor.wins + visitor.losses, (double)(visitor.wins + visitor.losses) / (double)visitor.visited);
+		unsigned long total_win_intervals = win_runs->size(), total_loss_intervals = loss_runs->size();
+		fmt::print("{} win intervals ({:.5f}) and {} loss intervals ({:.5f}).\n",
+				total_win_intervals, (double)visitor.wins / (double)total_win_intervals,
+				total_loss_intervals, (double)visitor.losses / (double)total_loss_intervals);
+		fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
+				times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
+	}
+
+	write_win_loss_intervals(*win_runs, *loss_runs,
+			win_start_temp_file, win_length_temp_file, loss_start_temp_file, loss_length_temp_file, options.direct_io, options.verbose);
+	//If we crash after renaming some but not all of these, the next run
+	//removes them and solves the subslice again.
+	std::filesystem::rename(win_start_temp_file, win_start_file);
+	std::filesystem::rename(win_length_temp_file, win_length_file);
+	std::filesystem::rename(loss_start_temp_file, loss_start_file);
+	std::filesystem::rename(loss_length_temp_file, loss_length_file);
+	return {true, visitor.visited, visitor.wins, visitor.losses};
+}
+
+/**
+ * Solves generation after generation in one process until one resolves no new
+ * states (or max_generations exist), starting after the generations already
+ * in data_dir.  The database stays mapped between generations, each new
+ * generation's merged files being added to it (or, with a dense backend, the
+ * dense table being rebuilt), and later generations' subslices are run on a
+ * persistent thread pool, largest first.  Complete slice or subslice
+ * outputs left by an interrupted run are reused.
+ */
+void solve_all(const std::filesystem::path& data_dir, const Board& board, const Board* dense_board,
+		std::optional<unsigned int> max_generations, const DatabaseOptions& database_options, OutputOptions options) {
+	options.verbose = false;
+	ThreadPool& pool = shared_thread_pool();
+	GenerationMergeOptions merge_options;
+	merge_options.threads = pool.size();
+	merge_options.spill_budget = options.spill_budget;
+	merge_options.direct_io = options.direct_io;
+	merge_options.remove_inputs = true;
+
+	//A crash while publishing a merge can leave a generation's files split
+	//between data_dir and its staging directory, which load would reject.
+	vector<unsigned int> staged;
+	if (std::filesystem::is_directory(data_dir / "tmp"))
+		for (const auto& entry : std::filesystem::directory_iterator(data_dir / "tmp")) {
+			std::string name = entry.path().filename();
+			constexpr std::string_view prefix = "merge-";
+			if (!name.starts_with(prefix)) continue;
+			unsigned int g;
+			const char* first = name.data() + prefix.size(), *last = name.data() + name.size();
+			if (auto [ptr, ec] = std::from_chars(first, last, g, 10); ec == std::errc() && ptr == last)
+				staged.push_back(g);
+		}
+	for (unsigned int g : staged)
+		if (recover_generation_merge(data_dir, g))
+			fmt::print("Finished publishing an interrupted merge of generation {}.\n", g);
+
+	unsigned int generation = 0;
+	while (std::filesystem::exists(data_dir / fmt::format("win-{}.bin", generation)) ||
+			std::filesystem::exists(data_dir / fmt::format("win-{}.ivc", generation)))
+		++generation;
+	if (generation)
+		fmt::print("Generations 0 through {} already solved.\n", generation - 1);
+	std::unique_ptr<WinLossUnknownDatabase> wldb;
+	auto load = [&](unsigned int generations) {
+		wldb = load_database(data_dir, generations, dense_board);
+		configure_database(*wldb, database_options);
+	};
+	load(generation);
+
+	Stopwatch total_stopwatch = Stopwatch::process();
+	for (; !max_generations || generation < *max_generations; ++generation) {
+		Stopwatch stopwatch = Stopwatch::process();
+		std::mutex totals_mutex;
+		SolveResult totals = {true, 0, 0, 0};
+		auto add = [&](const SolveResult& r) {
+			std::lock_guard lock(totals_mutex);
+			totals.visited += r.visited;
+			totals.wins += r.wins;
+			totals.losses += r.losses;
+		};
+		if (generation == 0)
+			//Each slice is already split across threads.
+			for (unsigned int slice = 0; slice < board.anchorable_squares(); ++slice)
+				add(solve_generation0_slice(data_dir, slice, board, options));
+		else {
+			vector<std::tuple<unsigned long, unsigned int, unsigned int>> tasks;
+			for (unsigned int slice = 0; slice < board.anchorable_squares(); ++slice)
+				for (unsigned int subslice = 0; subslice < subslice_count(board); ++subslice) {
+					auto range = subslice_rank_range(slice, subslice, board);
+					tasks.emplace_back(range.second - range.first, slice, subslice);
+				}
+			std::sort(tasks.begin(), tasks.end(), std::greater<>());
+			//Each thread runs a subslice, so they share the memory budgets.
+			OutputOptions subslice_options = options;
+			subslice_options.spill_budget /= pool.size();
+			subslice_options.pair_budget /= pool.size();
+			pool.parallel_for(tasks.size(), [&](std::size_t i) {
+				auto [size, slice, subslice] = tasks[i];
+				add(solve_subslice(data_dir, generation, slice, subslice, board, *wldb, subslice_options));
+			});
+		}
+		auto merged = merge_generation(data_dir, generation, &board, merge_options);
+		auto times = stopwatch.elapsed();
+
+		fmt::print("Generation {}: visited {} states, found {} wins and {} losses; merged into {} win and {} loss intervals.\n",
+				generation, totals.visited, totals.wins, totals.losses, merged.win_intervals, merged.loss_intervals);
+		fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
+				times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
+		print_cache_stats(*wldb);
+		print_numa_stats(*wldb);
+		if (merged.win_intervals + merged.loss_intervals == 0) {
+			fmt::print("Generation {} resolved nothing new; done.\n", generation);
+			break;
+		}
+
+		if (dense_board) {
+			//Queries need the new generation in the table.
+			build_dense_table(data_dir, generation + 1, *dense_board);
+			load(generation + 1);
+			//The new table holds everything the old one did, and tables are
+			//large, so don't keep one per generation.
+			std::filesystem::remove(data_dir / fmt::format("dense-{}.bits", generation));
+		} else {
+			wldb->add_generation(data_dir / fmt::format("win-{}.bin", generation),
+					data_dir / fmt::format("win-{}.len", generation), WIN, generation);
+			wldb->add_generation(data_dir / fmt::format("loss-{}.bin", generation),
+					data_dir / fmt::format("loss-{}.len", generation), LOSS, generation);
+			//Adding dropped any replicas.
+			configure_database(*wldb, database_options);
+			wldb->invalidate_query_caches();
+		}
+	}
+	auto times = total_stopwatch.elapsed();
+	fmt::print("Total: {} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
+			times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
+}
+
+//Boards whose dense table is at most this large use the dense backend by default.
+constexpr std::size_t DENSE_TABLE_MAX_BYTES = 4UL*1024*1024*1024;
+//Default memory for result intervals before they spill to disk, split evenly
+//between wins and losses.
+constexpr std::size_t DEFAULT_SPILL_BUDGET_MIB = 2048;
+
 int main(int argc, char* argv[]) { //genbuild {'entrypoint': True, 'ldflags': ''}
 	std::optional<unsigned int> generation, slice, subslice;
 	std::optional<std::filesystem::path> data_dir;
-	bool do_opening_procedure = false;
+	bool do_opening_procedure = false, do_build_index = false, do_build_btree = false, do_build_bloom = false, do_build_dense = false, do_compress = false, direct_io = false, do_solve_all = false, resume = false, numa = false, numa_replicas = false;
+	SearchStrategy search_strategy = SearchStrategy::BTREE;
+	const Board* board = &traditional;
+	std::string_view backend = "auto";
+	std::optional<std::size_t> query_cache_entries;
+	std::size_t spill_budget_mib = DEFAULT_SPILL_BUDGET_MIB;
+	//seconds between generation 0 checkpoints, or 0 for none
+	std::chrono::seconds checkpoint_interval{0};
+	//for the shared thread pool; by default, one thread per CPU in cpus or
+	//(if none) per hardware thread
+	unsigned int threads = 0;
+	std::vector<unsigned int> cpus;
 	for (int i = 1; i < argc; ++i)
 		if (argv[i] == "--generation"sv)
 			generation = from_string<unsigned int>(argv[++i]);
@@ -505,11 +927,63 @@ int main(int argc, char* argv[]) { //genbuild {'entrypoint': True, 'ldflags': ''
 			data_dir = argv[++i];
 		else if (argv[i] == "--opening"sv || argv[i] == "--openings"sv)
 			do_opening_procedure = true;
-		else {
+		else if (argv[i] == "--build-index"sv)
+			do_build_index = true;
+		else if (argv[i] == "--build-btree"sv)
+			do_build_btree = true;
+		else if (argv[i] == "--build-bloom"sv)
+			do_build_bloom = true;
+		else if (argv[i] == "--build-dense"sv)
+			do_build_dense = true;
+		else if (argv[i] == "--compress"sv)
+			do_compress = true;
+		else if (argv[i] == "--direct-io"sv)
+			direct_io = true;
+		else if (argv[i] == "--solve-all"sv)
+			do_solve_all = true;
+		else if (argv[i] == "--checkpoint"sv)
+			checkpoint_interval = std::chrono::seconds(from_string<unsigned long>(argv[++i]));
+		else if (argv[i] == "--resume"sv)
+			resume = true;
+		else if (argv[i] == "--walk-pushes"sv)
+			generator_options().push_tables = false;
+		else if (argv[i] == "--expand-moves"sv)
+			generator_options().shift_fill = false;
+		else if (argv[i] == "--fill-per-piece"sv)
+			generator_options().share_fills = false;
+		else if (argv[i] == "--expand-transpositions"sv)
+			generator_options().dedupe_transpositions = false;
+		else if (argv[i] == "--generic-boards"sv)
+			generator_options().compiled_boards = false;
+		else if (argv[i] == "--threads"sv)
+			threads = from_string<unsigned int>(argv[++i]);
+		else if (argv[i] == "--cpus"sv)
+			cpus = parse_cpu_list(argv[++i]);
+		else if (argv[i] == "--numa"sv)
+			numa = true;
+		else if (argv[i] == "--numa-replicas"sv)
+			numa = numa_replicas = true;
+		else if (argv[i] == "--spill-budget"sv)
+			spill_budget_mib = from_string<std::size_t>(argv[++i]);
+		else if (argv[i] == "--search"sv)
+			search_strategy = search_strategy_from_string(argv[++i]);
+		else if (argv[i] == "--query-cache"sv)
+			query_cache_entries = from_string<std::size_t>(argv[++i]);
+		else if (argv[i] == "--backend"sv)
+			backend = argv[++i];
+		else if (argv[i] == "--board"sv) {
+			std::string_view name = argv[++i];
+			auto it = std::find_if(std::begin(all_boards), std::end(all_boards), [=](const Board* b) {return b->name() == name;});
+			if (it == std::end(all_boards)) {
+				fmt::print(stderr, "unknown board: {}\n", name);
+				return 1;
+			}
+			board = *it;
+		} else {
 			fmt::print(stderr, "unknown option: {}\n", argv[i]);
 			return 1;
 		}
-	if (!generation || !slice || !data_dir) {
+	if ((!generation && !do_solve_all) || (!slice && !do_solve_all && !do_build_index && !do_build_btree && !do_build_bloom && !do_build_dense && !do_compress) || !data_dir) {
 		fmt::print(stderr, "required options not passed\n");
 		return 1;
 	}
@@ -517,38 +991,90 @@ int main(int argc, char* argv[]) { //genbuild {'entrypoint': True, 'ldflags': ''
 		fmt::print(stderr, "data dir not a directory (or does not exist)\n");
 		return 1;
 	}
+	//Queries use a dense table (if one has been built) when the board's is
+	//small enough to hold in memory.
+	const Board* dense_board;
+	if (backend == "dense"sv || (backend == "auto"sv && dense_table_bytes(*board) <= DENSE_TABLE_MAX_BYTES))
+		dense_board = board;
+	else if (backend == "intervals"sv || backend == "auto"sv)
+		dense_board = nullptr;
+	else {
+		fmt::print(stderr, "unknown backend: {}\n", backend);
+		return 1;
+	}
+	configure_shared_thread_pool(threads, std::move(cpus), numa);
+	DatabaseOptions database_options = {search_strategy, query_cache_entries, numa, numa_replicas};
+	//Successor pairs get half as much again as the result intervals, as much
+	//as the 64Mi pairs they used to reserve at the default budget.
+	OutputOptions output_options = {spill_budget_mib * 1024 * 1024, spill_budget_mib * 1024 * 1024 / 2, direct_io, true, checkpoint_interval, resume};
 	
-	if (do_opening_procedure) {
-		vector<std::filesystem::path> starts, lengths;
-		vector<GameValue> values;
-		for (unsigned int g = 0; ; ++g) {
-			std::filesystem::path ws = *data_dir / fmt::format("win-{}.bin", g),
-					wl = *data_dir / fmt::format("win-{}.len", g),
-					ls = *data_dir / fmt::format("loss-{}.bin", g),
-					ll = *data_dir / fmt::format("loss-{}.len", g);
-			int present_count = 0;
-			for (std::filesystem::path p : {ws, wl, ls, ll})
-				if (!std::filesystem::is_regular_file(p))
-					++present_count;
-			if (present_count == 0)
-				break;
-			else if (present_count != 4)
-				for (std::filesystem::path p : {ws, wl, ls, ll})
-					if (!std::filesystem::is_regular_file(p))
-						throw std::runtime_error(fmt::format("expected {} to exist", p.c_str()));
-			starts.push_back(ws);
-			lengths.push_back(wl);
-			values.push_back(WIN);
-			starts.push_back(ls);
-			lengths.push_back(ll);
-			values.push_back(LOSS);
+	if (do_solve_all) {
+		//--generation, if given, limits the number of generations.
+		solve_all(*data_dir, *board, dense_board, generation, database_options, output_options);
+	} else if (do_build_index) {
+		//Merge generations [0, generation) so queries do one search instead of
+		//one per generation file.
+		Stopwatch stopwatch = Stopwatch::process();
+		build_merged_index(*data_dir, *generation);
+		auto times = stopwatch.elapsed();
+		fmt::print("Merged generations 0 through {} into merged-{}.\n", *generation - 1, *generation);
+		fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
+				times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
+	} else if (do_build_btree || do_build_bloom) {
+		//Index generations [0, generation) and any merged index among them.
+		Stopwatch stopwatch = Stopwatch::process();
+		vector<std::filesystem::path> files;
+		for (unsigned int g = 0; g < *generation; ++g) {
+			files.push_back(*data_dir / fmt::format("win-{}.bin", g));
+			files.push_back(*data_dir / fmt::format("loss-{}.bin", g));
+		}
+		for (unsigned int g = 1; g <= *generation; ++g)
+			if (std::filesystem::is_regular_file(*data_dir / fmt::format("merged-{}.bin", g)))
+				files.push_back(*data_dir / fmt::format("merged-{}.bin", g));
+		for (const auto& file : files) {
+			if (do_build_btree)
+				build_btree_index(file);
+			if (do_build_bloom) {
+				std::filesystem::path lengths = file;
+				build_bloom_filter(file, lengths.replace_extension(".len"));
+			}
+		}
+		auto times = stopwatch.elapsed();
+		fmt::print("Built {}{}{} for {} files.\n", do_build_btree ? "B+tree indices" : "",
+				do_build_btree && do_build_bloom ? " and " : "", do_build_bloom ? "Bloom filters" : "", files.size());
+		fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
+				times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
+	} else if (do_compress) {
+		//Replace the .bin/.len files of generations [0, generation) and
+		//merged-{generation} with .ivc files.  Build any Bloom filters first, as
+		//they're built from the uncompressed files.
+		Stopwatch stopwatch = Stopwatch::process();
+		auto [before, after] = compress_database(*data_dir, *generation);
+		auto times = stopwatch.elapsed();
+		fmt::print("Compressed generations 0 through {}: {} bytes to {} bytes ({:.1f}%).\n", *generation - 1,
+				before, after, before ? 100.0 * (double)after / (double)before : 100.0);
+		fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
+				times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
+	} else if (do_build_dense) {
+		if (!dense_board) {
+			fmt::print(stderr, "{} would need a {:.2f} GiB dense table; pass --backend dense to build it anyway\n",
+					board->name(), (double)dense_table_bytes(*board) / (1024.0*1024*1024));
+			return 1;
 		}
-		std::unique_ptr<WinLossUnknownDatabase> wldb;
-		wldb = std::make_unique<WinLossUnknownDatabase>(std::move(starts), std::move(lengths), std::move(values));
-		OpeningProcedureVisitor visitor(wldb.get());
+		Stopwatch stopwatch = Stopwatch::process();
+		build_dense_table(*data_dir, *generation, *board);
+		auto times = stopwatch.elapsed();
+		fmt::print("Wrote generations 0 through {} into dense-{} ({:.2f} GiB).\n", *generation - 1, *generation,
+				(double)dense_table_bytes(*board) / (1024.0*1024*1024));
+		fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
+				times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
+	} else if (do_opening_procedure) {
+		auto wldb = load_database(*data_dir, std::nullopt, dense_board);
+		configure_database(*wldb, database_options);
+		OpeningProcedureVisitor visitor(*board, wldb.get());
 
 		Stopwatch stopwatch = Stopwatch::process();
-		opening_procedure(traditional, visitor);
+		auto parallel_stats = opening_procedure(*board, visitor);
 		auto times = stopwatch.elapsed();
 
 		fmt::print("Processed {} openings ({} won, {} lost, {} drawn).\n",
@@ -556,131 +1082,26 @@ int main(int argc, char* argv[]) { //genbuild {'entrypoint': True, 'ldflags': ''
 				visitor.winning_openings.size(), visitor.losing_openings.size(), visitor.drawn_openings.size());
 		fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
 				times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
+		print_parallel_stats(parallel_stats);
+		print_cache_stats(*wldb);
+		print_numa_stats(*wldb);
 
 		write_openings(*data_dir, visitor);
 	} else if (*generation == 0) {
-		std::filesystem::path win_start_file = *data_dir / fmt::format("win-{}-{:02}.bin", *generation, *slice),
-			win_length_file = *data_dir / fmt::format("win-{}-{:02}.len", *generation, *slice),
-			loss_start_file = *data_dir / fmt::format("loss-{}-{:02}.bin", *generation, *slice),
-			loss_length_file = *data_dir / fmt::format("loss-{}-{:02}.len", *generation, *slice);
-		if (std::filesystem::exists(win_start_file) || std::filesystem::exists(loss_start_file) ||
-				std::filesystem::exists(win_length_file) || std::filesystem::exists(loss_length_file)) {
+		if (!solve_generation0_slice(*data_dir, *slice, *board, output_options).solved) {
 			fmt::print(stderr, "win or loss files exist; not overwriting\n");
 			return 1;
 		}
-
-		std::unique_ptr<IntervalVisitor> visitor_ptr;
-		visitor_ptr = std::make_unique<InherentValueVisitor>();
-		IntervalVisitor& visitor = *visitor_ptr;
-
-		Stopwatch stopwatch = Stopwatch::process();
-		enumerate_anchored_states_threaded(*slice, traditional, *visitor_ptr);
-		auto times = stopwatch.elapsed();
-
-		fmt::print("Processed generation {} slice {}.\n", *generation, *slice);
-		fmt::print("Visited {} states, found {} wins ({:.3f}) and {} losses ({:.3f}), total {} ({:.3f}) resolved.\n",
-				visitor.visited,
-				visitor.wins, (double)visitor.wins / (double)visitor.visited,
-				visitor.losses, (double)visitor.losses / (double)visitor.visited,
-				visitor.wins + visitor.losses, (double)(visitor.wins + visitor.losses) / (double)visitor.visited);
-		unsigned long total_win_intervals = 0, total_loss_intervals = 0;
-		for (auto& v : visitor.win_intervals)
-			total_win_intervals += v.size();
-		for (auto& v : visitor.loss_intervals)
-			total_loss_intervals += v.size();
-		fmt::print("{} win intervals ({:.5f}) and {} loss intervals ({:.5f}).\n",
-				total_win_intervals, (double)visitor.wins / (double)total_win_intervals,
-				total_loss_intervals, (double)visitor.losses / (double)total_loss_intervals);
-		fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
-				times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
-
-		//We no longer merge in order, so we need to sort.
-		std::sort(visitor.win_intervals.begin(), visitor.win_intervals.end());
-		std::sort(visitor.loss_intervals.begin(), visitor.loss_intervals.end());
-		//IntervalVisitor assumes a given visitor object will either be the parent
-		//being merged into or an actual visitor, not both.  The parent shouldn't
-		//have any singleton ranks of its own because it never visits.  Ideally we
-		//would change the design of ForkableStateVisitor to not inherit from
-		//StateVisitor, but in lieu of that, at least fail noisily.
-		if (visitor.win_ranks.size() || visitor.loss_ranks.size())
-			throw std::logic_error("unmerged singleton ranks?");
-
-		write_intervals(std::move(visitor.win_intervals), win_start_file, win_length_file);
-		write_intervals(std::move(visitor.loss_intervals), loss_start_file, loss_length_file);
-		return 0;
 	} else {
-		//Check if the final outputs exist.
-		std::filesystem::path win_start_file = *data_dir / fmt::format("win-{}-{:02}-{:03}.bin", *generation, *slice, *subslice),
-			win_length_file = *data_dir / fmt::format("win-{}-{:02}-{:03}.len", *generation, *slice, *subslice),
-			loss_start_file = *data_dir / fmt::format("loss-{}-{:02}-{:03}.bin", *generation, *slice, *subslice),
-			loss_length_file = *data_dir / fmt::format("loss-{}-{:02}-{:03}.len", *generation, *slice, *subslice);
-		if (std::filesystem::exists(win_start_file) || std::filesystem::exists(loss_start_file) ||
-				std::filesystem::exists(win_length_file) || std::filesystem::exists(loss_length_file)) {
+		auto wldb = load_database(*data_dir, *generation, dense_board);
+		configure_database(*wldb, database_options);
+		if (wldb->dense)
+			fmt::print("Using the dense table backend.\n");
+		if (!solve_subslice(*data_dir, *generation, *slice, *subslice, *board, *wldb, output_options).solved) {
 			fmt::print(stderr, "win or loss files exist; not overwriting\n");
 			return 1;
 		}
-		//We go ahead and overwrite these temp files.
-		std::filesystem::path win_start_temp_file = *data_dir / "tmp" / fmt::format("win-{}-{:02}-{:03}.bin", *generation, *slice, *subslice),
-			win_length_temp_file = *data_dir / "tmp" / fmt::format("win-{}-{:02}-{:03}.len", *generation, *slice, *subslice),
-			loss_start_temp_file = *data_dir / "tmp" / fmt::format("loss-{}-{:02}-{:03}.bin", *generation, *slice, *subslice),
-			loss_length_temp_file = *data_dir / "tmp" / fmt::format("loss-{}-{:02}-{:03}.len", *generation, *slice, *subslice);
-
-		vector<std::filesystem::path> starts, lengths;
-		vector<GameValue> values;
-		for (unsigned int g = 0; g < *generation; ++g) {
-			std::filesystem::path ws = *data_dir / fmt::format("win-{}.bin", g),
-					wl = *data_dir / fmt::format("win-{}.len", g),
-					ls = *data_dir / fmt::format("loss-{}.bin", g),
-					ll = *data_dir / fmt::format("loss-{}.len", g);
-			for (std::filesystem::path p : {ws, wl, ls, ll})
-				if (!std::filesystem::is_regular_file(p))
-					throw std::runtime_error(fmt::format("expected {} to exist", p.c_str()));
-			starts.push_back(ws);
-			lengths.push_back(wl);
-			values.push_back(WIN);
-			starts.push_back(ls);
-			lengths.push_back(ll);
-			values.push_back(LOSS);
-		}
-		std::unique_ptr<WinLossUnknownDatabase> wldb;
-		wldb = std::make_unique<WinLossUnknownDatabase>(std::move(starts), std::move(lengths), std::move(values));
-
-		OutcountingVisitor visitor(wldb.get());
-		Stopwatch stopwatch = Stopwatch::process();
-		enumerate_anchored_states_subslice(*slice, *subslice, traditional, visitor);
-		auto times = stopwatch.elapsed();
-
-		fmt::print("Processed generation {} slice {} subslice {}.\n", *generation, *slice, *subslice);
-		fmt::print("Visited {} states, found {} wins ({:.3f}) and {} losses ({:.3f}), total {} ({:.3f}) resolved.\n",
-				visitor.visited,
-				visitor.wins, (double)visitor.wins / (double)visitor.visited,
-				visitor.losses, (double)visitor.losses / (double)visitor.visited,
-				visitor.wins + visitor.losses, (double)(visitor.wins + visitor.losses) / (double)visitor.visited);
-		unsigned long total_win_intervals = 0, total_loss_intervals = 0;
-		for (auto& v : visitor.win_intervals)
-			total_win_intervals += v.size();
-		for (auto& v : visitor.loss_intervals)
-			total_loss_intervals += v.size();
-		fmt::print("{} win intervals ({:.5f}) and {} loss intervals ({:.5f}).\n",
-				total_win_intervals, (double)visitor.wins / (double)total_win_intervals,
-				total_loss_intervals, (double)visitor.losses / (double)total_loss_intervals);
-		fmt::print("{} seconds ({}), {} cpu-seconds ({:.2f}), {:.2f} GiB, {} hard faults.\n",
-				times.seconds(), times.hms(), times.cpuSeconds(), times.utilization(), times.highwaterGibibytes(), times.hardFaults());
-
-		//We no longer merge in order, so we need to sort.
-		std::sort(visitor.win_intervals.begin(), visitor.win_intervals.end());
-		std::sort(visitor.loss_intervals.begin(), visitor.loss_intervals.end());
-
-		write_intervals(std::move(visitor.win_intervals), win_start_temp_file, win_length_temp_file);
-		write_intervals(std::move(visitor.loss_intervals), loss_start_temp_file, loss_length_temp_file);
-		//We're screwed if we crash after partially but not completely renaming these...
-		//I guess we can manually check when concatenating them that we have the
-		//same number of each type of file.
-		std::filesystem::rename(win_start_temp_file, win_start_file);
-		std::filesystem::rename(win_length_temp_file, win_length_file);
-		std::filesystem::rename(loss_start_temp_file, loss_start_file);
-		std::filesystem::rename(loss_length_temp_file, loss_length_file);
+		print_cache_stats(*wldb);
+		print_numa_stats(*wldb);
 	}
-
-	
 }
@@ -2,8 +2,12 @@
 #include "state.hpp"
 #include "board.hpp"
 #include "set_bits_range.hpp"
+#include "numa.hpp"
+#include "util.hpp"
 #include <thread>
-#include <future>
+#include <deque>
+#include <pthread.h> //for pthread_setaffinity_np
+#include <immintrin.h>
 
 using std::uint32_t;
 using std::vector;
@@ -11,6 +15,9 @@ using std::unique_ptr;
 
 namespace pushfight {
 
+//The boards are defined in this namespace, so CompiledGeometry can name them.
+#include "board-defs.inc"
+
 //adapted from http://www.talkchess.com/forum3/viewtopic.php?t=48220&start=2
 template<typename Integer>
 Integer pext0(Integer val, Integer mask) {
@@ -56,7 +63,22 @@ Integer pext2(Integer val, Integer mask) {
 	return res;
 }
 
-unsigned long rank(State state, const Board& board) {
+struct SoftwarePext {
+	uint32_t operator()(uint32_t val, uint32_t mask) const {
+		return pext2(val, mask);
+	}
+};
+
+struct HardwarePext {
+	[[gnu::target("bmi2")]] uint32_t operator()(uint32_t val, uint32_t mask) const {
+		return _pext_u32(val, mask);
+	}
+};
+
+//always_inline so the pext calls get inlined into the bmi2-targeted caller;
+//GCC won't inline a bmi2 function into a function compiled without bmi2.
+template<typename Pext>
+[[gnu::always_inline]] inline unsigned long rank_impl(State state, const Board& board, Pext pext) {
 	if (state.allied_pawns & state.allied_pushers ||
 			state.allied_pawns & state.enemy_pawns ||
 			state.allied_pawns & state.enemy_pushers ||
@@ -88,7 +110,7 @@ unsigned long rank(State state, const Board& board) {
 	//instead of squares.  That results in slices overlapping in rank numbers.
 
 	auto enemy_pushers = state.enemy_pushers & ~state.anchored_pieces;
-	enemy_pushers = pext2(enemy_pushers, pext_mask);
+	enemy_pushers = pext(enemy_pushers, pext_mask);
 	pext_mask &= ~state.enemy_pushers;
 	while (enemy_pushers) {
 		int low_bit = std::countr_zero(enemy_pushers);
@@ -98,7 +120,7 @@ unsigned long rank(State state, const Board& board) {
 		enemy_pushers >>= low_bit + 1;
 	}
 
-	auto enemy_pawns = pext2(state.enemy_pawns, pext_mask);
+	auto enemy_pawns = pext(state.enemy_pawns, pext_mask);
 	pext_mask &= ~state.enemy_pawns;
 	while (enemy_pawns) {
 		int low_bit = std::countr_zero(enemy_pawns);
@@ -108,7 +130,7 @@ unsigned long rank(State state, const Board& board) {
 		enemy_pawns >>= low_bit + 1;
 	}
 
-	auto allied_pushers = pext2(state.allied_pushers, pext_mask);
+	auto allied_pushers = pext(state.allied_pushers, pext_mask);
 	pext_mask &= ~state.allied_pushers;
 	while (allied_pushers) {
 		int low_bit = std::countr_zero(allied_pushers);
@@ -118,7 +140,7 @@ unsigned long rank(State state, const Board& board) {
 		allied_pushers >>= low_bit + 1;
 	}
 
-	auto allied_pawns = pext2(state.allied_pawns, pext_mask);
+	auto allied_pawns = pext(state.allied_pawns, pext_mask);
 	pext_mask &= ~state.allied_pawns;
 	while (allied_pawns) {
 		int low_bit = std::countr_zero(allied_pawns);
@@ -131,11 +153,368 @@ unsigned long rank(State state, const Board& board) {
 	return result;
 }
 
+unsigned long rank_software(State state, const Board& board) {
+	return rank_impl(state, board, SoftwarePext{});
+}
+
+[[gnu::target("bmi2")]] unsigned long rank_bmi2(State state, const Board& board) {
+	return rank_impl(state, board, HardwarePext{});
+}
 
+bool cpu_has_fast_pext() {
+	//This may run during static initialization, before the CPU model is known.
+	__builtin_cpu_init();
+	//Zen 1 and 2 implement pext in microcode, slower than the software loop.
+	return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("znver1") && !__builtin_cpu_is("znver2");
+}
+
+//Chosen once at startup instead of checking CPUID on every call.
+static unsigned long (*const rank_dispatch)(State, const Board&) = cpu_has_fast_pext() ? rank_bmi2 : rank_software;
+
+unsigned long rank(State state, const Board& board) {
+	return rank_dispatch(state, board);
+}
+
+//adapted from the pext loops above, with the roles of val and mask swapped
+template<typename Integer>
+Integer pdep0(Integer val, Integer mask) {
+	Integer res = 0;
+	for (Integer bit = 1; mask; bit += bit) {
+		if (val & bit)
+			res |= mask & -mask;
+		mask &= mask - 1;
+	}
+	return res;
+}
+
+struct SoftwarePdep {
+	uint32_t operator()(uint32_t val, uint32_t mask) const {
+		return pdep0(val, mask);
+	}
+};
+
+struct HardwarePdep {
+	[[gnu::target("bmi2")]] uint32_t operator()(uint32_t val, uint32_t mask) const {
+		return _pdep_u32(val, mask);
+	}
+};
+
+//binomial[n][k] is n choose k.
+static constexpr auto binomial = []() {
+	std::array<std::array<unsigned long, 33>, 33> b{};
+	for (unsigned int n = 0; n < b.size(); ++n) {
+		b[n][0] = 1;
+		for (unsigned int k = 1; k <= n; ++k)
+			b[n][k] = b[n-1][k-1] + b[n-1][k];
+	}
+	return b;
+}();
+
+Unranker::Unranker(const Board& board) : board_(&board),
+		pieces_(2 * (board.pushers() + board.pawns())), use_bmi2_(cpu_has_fast_pext()) {
+	if (pieces_ > MAX_PIECES || pieces_ >= board.squares())
+		throw std::logic_error(fmt::format("Unranker: can't handle {} pieces on {} squares", pieces_, board.squares()));
+	group_begin_ = {0, 1, board.pushers(), board.pushers() + board.pawns(),
+			2 * board.pushers() + board.pawns(), pieces_};
+	for (unsigned int g = 0; g < 5; ++g)
+		for (unsigned int i = group_begin_[g]; i < group_begin_[g+1]; ++i)
+			group_of_digit_[i] = g;
+
+	//Digit i (for i > 0) is placed after i pieces, so has radix squares - i.
+	//We need squares - i >= 2 for the reciprocal to fit in 64 bits, hence the
+	//check above that the board has an empty square.
+	unsigned long weight = 1;
+	for (unsigned int i = pieces_; i-- > 1;) {
+		weights_[i] = weight;
+		unsigned long d = board.squares() - i;
+		divisors_[i] = {d, ~0UL / d + 1};
+		if (__builtin_mul_overflow(weight, d, &weight))
+			throw std::logic_error("Unranker: rank space too large");
+	}
+	weights_[0] = weight;
+	divisors_[0] = {0, 0};
+	if (__builtin_mul_overflow(weight, board.squares(), &rank_limit_))
+		throw std::logic_error("Unranker: rank space too large");
+	//Divisor::quotient needs n * d < 2^64 for every n it sees.
+	unsigned long unused;
+	if (__builtin_mul_overflow(rank_limit_, board.squares(), &unused))
+		throw std::logic_error("Unranker: rank space too large for reciprocal division");
+
+	group_combinations_[0] = dense_limit_ = board.anchorable_squares();
+	for (unsigned int g = 1; g < 5; ++g) {
+		group_combinations_[g] = binomial[board.squares() - group_begin_[g]][group_begin_[g+1] - group_begin_[g]];
+		dense_limit_ *= group_combinations_[g];
+	}
+}
+
+unsigned long Unranker::dense_index(unsigned long rank) const {
+	Digits digits;
+	split(rank, digits);
+	if (digits[0] >= board_->squares())
+		throw std::logic_error(fmt::format("dense_index: {} is not a rank", rank));
+	if (digits[0] >= board_->anchorable_squares())
+		return dense_limit_;
+	unsigned long index = digits[0];
+	for (unsigned int g = 1; g < 5; ++g) {
+		//The j'th piece (from 1) at position p contributes p choose j.
+		//As in place_group, positions are among the squares left by earlier groups.
+		unsigned int available = board_->squares() - group_begin_[g];
+		unsigned long combination = 0;
+		unsigned int position = 0;
+		for (unsigned int i = group_begin_[g]; i < group_begin_[g+1]; ++i) {
+			position += digits[i];
+			if (position >= available)
+				throw std::logic_error(fmt::format("dense_index: {} is not a rank", rank));
+			combination += binomial[position][i - group_begin_[g] + 1];
+			++position;
+		}
+		index = index * group_combinations_[g] + combination;
+	}
+	return index;
+}
+
+void Unranker::split(unsigned long rank, Digits& digits) const {
+	for (unsigned int i = pieces_; i-- > 1;) {
+		unsigned long q = divisors_[i].quotient(rank);
+		digits[i] = static_cast<unsigned int>(rank - q * divisors_[i].d);
+		rank = q;
+	}
+	//may be out of range; place_group checks
+	digits[0] = static_cast<unsigned int>(std::min(rank, static_cast<unsigned long>(board_->squares())));
+}
+
+std::pair<unsigned long, unsigned long> Unranker::enemy_pusher_range(uint32_t anchored_pieces, uint32_t enemy_pushers) const {
+	assert(std::popcount(anchored_pieces) == 1 && (anchored_pieces & enemy_pushers));
+	//Same as the first digits of rank().
+	unsigned long prefix = std::countr_zero(anchored_pieces);
+	uint32_t avail = static_cast<uint32_t>((1UL << board_->squares()) - 1) & ~anchored_pieces;
+	uint32_t compressed = pext2(enemy_pushers & ~anchored_pieces, avail);
+	for (unsigned int i = 1; i < group_begin_[2]; ++i) {
+		int low_bit = std::countr_zero(compressed);
+		prefix = prefix * divisors_[i].d + low_bit;
+		compressed >>= low_bit + 1;
+	}
+	unsigned long weight = weights_[group_begin_[2] - 1];
+	return {prefix * weight, (prefix + 1) * weight};
+}
+
+//Places group g's pieces into state, removing their squares from avail.
+//Returns false (setting bad_digit) if the digits run off the end of the board.
+template<typename Pdep>
+[[gnu::always_inline]] inline bool Unranker::place_group(unsigned int group, const Digits& digits, State& state, uint32_t& avail, unsigned int& bad_digit, Pdep pdep) const {
+	static constexpr uint32_t State::* targets[] = {
+		&State::enemy_pushers, &State::enemy_pawns, &State::allied_pushers, &State::allied_pawns
+	};
+	if (group == 0) {
+		if (digits[0] >= board_->squares()) {
+			bad_digit = 0;
+			return false;
+		}
+		state = {};
+		state.anchored_pieces = state.enemy_pushers = 1u << digits[0];
+		avail = static_cast<uint32_t>((1UL << board_->squares()) - 1) & ~state.anchored_pieces;
+		return true;
+	}
+	//Each digit is the gap from the previous piece of this kind, in the
+	//coordinates left after removing the squares used by earlier groups.
+	unsigned int available = board_->squares() - group_begin_[group];
+	uint32_t compressed = 0;
+	unsigned int pos = 0;
+	for (unsigned int i = group_begin_[group]; i < group_begin_[group+1]; ++i) {
+		pos += digits[i];
+		if (pos >= available) {
+			bad_digit = i;
+			return false;
+		}
+		compressed |= 1u << pos;
+		++pos;
+	}
+	uint32_t squares = pdep(compressed, avail);
+	state.*targets[group-1] |= squares;
+	avail &= ~squares;
+	return true;
+}
+
+template<typename Pdep>
+[[gnu::always_inline]] inline std::size_t Unranker::unrank_impl(unsigned long first, unsigned long last, State* out, unsigned long* ranks, Pdep pdep) const {
+	last = std::min(last, rank_limit_);
+	if (first >= last)
+		return 0;
+	Digits digits;
+	split(first, digits);
+	//partial[g] and avail[g] are the state and unused squares before placing
+	//group g.  When we step to the next rank, only groups from the one holding
+	//the most significant changed digit onward need to be placed again.
+	std::array<State, 6> partial;
+	std::array<uint32_t, 6> avail;
+	unsigned int dirty = 0;
+	std::size_t count = 0;
+	unsigned long r = first;
+	while (r < last) {
+		unsigned int bad_digit = pieces_, g;
+		for (g = dirty; g < 5; ++g) {
+			partial[g+1] = partial[g];
+			avail[g+1] = avail[g];
+			if (!place_group(g, digits, partial[g+1], avail[g+1], bad_digit, pdep))
+				break;
+		}
+
+		//The digit to increment: the last one for a valid rank, or the bad
+		//digit, skipping every number that shares the bad prefix.
+		unsigned int i;
+		if (g == 5) {
+			out[count] = partial[5];
+			if (ranks)
+				ranks[count] = r;
+			++count;
+			i = pieces_ - 1;
+			++r;
+		} else {
+			if (bad_digit == 0)
+				break; //anchored square is off the board; no more ranks
+			i = bad_digit;
+			unsigned long low = 0;
+			for (unsigned int j = i + 1; j < pieces_; ++j) {
+				low += digits[j] * weights_[j];
+				digits[j] = 0;
+			}
+			r += weights_[i] - low;
+		}
+		//Increment digit i, carrying into more significant digits.  The
+		//anchored square has no radix; place_group rejects it if too large.
+		dirty = group_of_digit_[i];
+		while (++digits[i] == divisors_[i].d && i > 0) {
+			digits[i] = 0;
+			dirty = group_of_digit_[--i];
+		}
+	}
+	return count;
+}
+
+std::size_t Unranker::unrank_software(unsigned long first, unsigned long last, State* out, unsigned long* ranks) const {
+	return unrank_impl(first, last, out, ranks, SoftwarePdep{});
+}
+
+[[gnu::target("bmi2")]] std::size_t Unranker::unrank_bmi2(unsigned long first, unsigned long last, State* out, unsigned long* ranks) const {
+	return unrank_impl(first, last, out, ranks, HardwarePdep{});
+}
+
+std::size_t Unranker::unrank(unsigned long first, unsigned long last, State* out, unsigned long* ranks) const {
+	return use_bmi2_ ? unrank_bmi2(first, last, out, ranks) : unrank_software(first, last, out, ranks);
+}
+
+bool Unranker::try_unrank(unsigned long rank, State& state) const {
+	//A one-element range is as cheap as a special case would be.
+	if (rank == std::numeric_limits<unsigned long>::max())
+		return false;
+	return unrank(rank, rank + 1, &state) == 1;
+}
+
+State Unranker::unrank(unsigned long rank) const {
+	State state;
+	if (!try_unrank(rank, state))
+		throw std::logic_error(fmt::format("no state has rank {} on board with {} squares", rank, board_->squares()));
+	return state;
+}
+
+static const Unranker& cached_unranker(const Board& board) {
+	thread_local std::optional<Unranker> unranker;
+	if (!unranker || &unranker->board() != &board)
+		unranker.emplace(board);
+	return *unranker;
+}
+
+State unrank(unsigned long rank, const Board& board) {
+	return cached_unranker(board).unrank(rank);
+}
+
+std::size_t unrank(unsigned long first, unsigned long last, const Board& board, State* out, unsigned long* ranks) {
+	return cached_unranker(board).unrank(first, last, out, ranks);
+}
+
+
+
+GeneratorOptions& generator_options() {
+	static GeneratorOptions options;
+	return options;
+}
+
+//Lays the squares out on a row-major grid, where each direction's neighbor is
+//a constant shift away, for connected_empty_space_fill.
+struct GridLayout {
+	std::array<unsigned int, 26> bit = {};
+	//the shift to the square above or below
+	unsigned int row = 0;
+	//for each direction, the squares with a neighbor that way
+	std::array<std::uint64_t, 4> exits = {};
+	unsigned int bytes = 0;
+};
+
+//Returns nullopt if the board isn't a grid of at most 64 cells (with each
+//neighbor adjacent on it), for which connected_empty_space_expand is used.
+constexpr std::optional<GridLayout> grid_layout(const Board& b) {
+	unsigned int min_row = std::numeric_limits<unsigned int>::max(), min_col = min_row, max_row = 0, max_col = 0;
+	for (unsigned int s = 0; s < b.squares(); ++s) {
+		auto [row, col] = b.coord_for_square(s);
+		min_row = std::min(min_row, row);
+		max_row = std::max(max_row, row);
+		min_col = std::min(min_col, col);
+		max_col = std::max(max_col, col);
+	}
+	unsigned int rows = max_row - min_row + 1, cols = max_col - min_col + 1;
+	if (rows * cols > 64)
+		return std::nullopt;
+	GridLayout grid;
+	for (unsigned int s = 0; s < b.squares(); ++s) {
+		auto [row, col] = b.coord_for_square(s);
+		grid.bit[s] = (row - min_row) * cols + (col - min_col);
+	}
+	grid.row = cols;
+	for (unsigned int s = 0; s < b.squares(); ++s)
+		for (Dir d : {LEFT, UP, RIGHT, DOWN}) {
+			unsigned int n = b.neighbor(s, d);
+			if (n == VOID || n == RAIL) continue;
+			unsigned int shift = d == LEFT || d == RIGHT ? 1 : grid.row;
+			if (grid.bit[n] != (d == LEFT || d == UP ? grid.bit[s] - shift : grid.bit[s] + shift))
+				return std::nullopt;
+			grid.exits[d] |= std::uint64_t{1} << grid.bit[s];
+		}
+	grid.bytes = (rows * cols + 7) / 8;
+	return grid;
+}
+
+//Expanding a placement after d moves covers expanding it after more moves iff
+//d is at least this: pushes are allowed after d moves and every count of moves
+//after.
+constexpr unsigned int transposition_floor(const Board& b) {
+	unsigned int floor = b.max_moves();
+	while (floor > 0 && (b.allowed_moves_mask() & (1u << (floor - 1))))
+		--floor;
+	return floor;
+}
+
+struct SharedWorkspace;
+//Visits a root's successors with next_states, specialized for the board if
+//it's one board_compiler.py compiled in.
+using Generator = bool (*)(const State, const SharedWorkspace&, StateVisitor&);
+Generator select_generator(const Board& board, const GeneratorOptions& options);
 
 struct SharedWorkspace {
-	SharedWorkspace(const Board& b) : board(b), max_moves(board.max_moves()),
-			allowable_moves_mask(board.allowed_moves_mask()) {
+	SharedWorkspace(const Board& b) : board(b), options(generator_options()),
+			max_moves(board.max_moves()), allowable_moves_mask(board.allowed_moves_mask()),
+			transposition_floor(pushfight::transposition_floor(b)) {
+		if (options.shift_fill) {
+			if (auto layout = grid_layout(b))
+				grid = *layout;
+			else {
+				static std::once_flag warned;
+				std::call_once(warned, [&]() {
+					fmt::print(stderr, "{} doesn't fit a 64-bit grid; finding moves by expansion instead\n", b.name());
+				});
+				options.shift_fill = false;
+			}
+		}
+		generator = select_generator(b, options);
 		assert(b.squares() <= neighbor_masks.size());
 		for (unsigned int s = 0; s < b.squares(); ++s)
 			neighbor_masks[s] = b.neighbors_mask(s);
@@ -162,6 +541,40 @@ struct SharedWorkspace {
 			adjacent_to_rail[d] = r;
 		}
 
+		for (unsigned int s = 0; s < b.squares(); ++s)
+			for (Dir d : {LEFT, UP, RIGHT, DOWN}) {
+				PushRay& ray = push_rays[s][d];
+				ray.prefix[0] = 1u << s;
+				unsigned int prev = s, next;
+				while ((next = b.neighbor(prev, d)) != VOID && next != RAIL) {
+					if (ray.length == ray.squares.size())
+						throw std::logic_error(fmt::format("{}: push ray from {} doesn't reach an edge", b.name(), s));
+					int stride = static_cast<int>(next) - static_cast<int>(prev);
+					auto step = std::find_if(ray.steps.begin(), ray.steps.begin() + ray.step_count, [=](const auto& p) {return p.first == stride;});
+					if (step == ray.steps.begin() + ray.step_count)
+						*step = {stride, 0}, ++ray.step_count;
+					step->second |= 1u << prev;
+					ray.squares[ray.length] = static_cast<std::uint8_t>(next);
+					ray.mask |= 1u << next;
+					ray.prefix[ray.length + 1] = ray.prefix[ray.length] | 1u << next;
+					++ray.length;
+					prev = next;
+				}
+				ray.into_void = next == VOID;
+			}
+
+		if (options.shift_fill) {
+			for (unsigned int byte = 0; byte < 4; ++byte)
+				for (unsigned int value = 0; value < 256; ++value)
+					for (unsigned int i : set_bits_range(value))
+						if (unsigned int s = 8 * byte + i; s < b.squares())
+							to_grid_bytes[byte][value] |= std::uint64_t{1} << grid.bit[s];
+			for (unsigned int s = 0; s < b.squares(); ++s)
+				for (unsigned int value = 0; value < 256; ++value)
+					if (value & (1u << grid.bit[s] % 8))
+						from_grid_bytes[grid.bit[s] / 8][value] |= 1u << s;
+		}
+
 		placement0_mask = 0;
 		for (const unsigned int* i = board.placement0_begin(); i != board.placement0_end(); ++i)
 			placement0_mask |= 1 << *i;
@@ -205,15 +618,102 @@ struct SharedWorkspace {
 	}
 
 	const Board& board;
+	GeneratorOptions options;
 	std::array<uint32_t, 26> neighbor_masks;
 	//for each direction, a mask of the squares immediately adjacent to VOID or RAIL
 	std::array<uint32_t, 4> adjacent_to_void, adjacent_to_rail;
+	//The squares a push from a square in a direction passes through, up to
+	//the edge of the board.
+	struct PushRay {
+		//in push order
+		std::array<std::uint8_t, 26> squares;
+		unsigned int length = 0;
+		uint32_t mask = 0;
+		//prefix[k] is the starting square and the first k squares
+		std::array<uint32_t, 27> prefix;
+		//false if the ray ends at a rail
+		bool into_void;
+		//Pushing moves a piece from a square to the next one, changing its
+		//index by a stride; each step is a stride and the squares moving by it.
+		std::array<std::pair<int, uint32_t>, 26> steps;
+		unsigned int step_count = 0;
+	};
+	std::array<std::array<PushRay, 4>, 26> push_rays;
+	//The squares as bits of a row-major grid, for connected_empty_space_fill.
+	//Masks convert a byte at a time.  Only built if options.shift_fill (which
+	//is cleared if the board has no grid layout).
+	GridLayout grid;
+	std::array<std::array<std::uint64_t, 256>, 4> to_grid_bytes = {};
+	std::array<std::array<uint32_t, 256>, 8> from_grid_bytes = {};
+
+	std::uint64_t to_grid(uint32_t mask) const {
+		return to_grid_bytes[0][mask & 0xff] | to_grid_bytes[1][(mask >> 8) & 0xff] |
+				to_grid_bytes[2][(mask >> 16) & 0xff] | to_grid_bytes[3][mask >> 24];
+	}
+	//bytes is grid.bytes, or a constant for a compiled board
+	uint32_t from_grid(std::uint64_t bits, unsigned int bytes) const {
+		uint32_t mask = 0;
+		for (unsigned int byte = 0; byte < bytes; ++byte)
+			mask |= from_grid_bytes[byte][(bits >> (8 * byte)) & 0xff];
+		return mask;
+	}
 	//board_choose_masks[i] is (squares choose i) masks for the position generator
 	std::array<std::vector<uint32_t>, 4> board_choose_masks;
 	unsigned int max_moves;
 	unsigned int allowable_moves_mask;
+	unsigned int transposition_floor;
 	std::array<uint32_t, 26> canonicalize_180;
 	unsigned int placement0_mask, placement1_mask;
+	Generator generator;
+
+	//returns true iff we should continue visiting
+	bool next_states(const State root, StateVisitor& sv) const {
+		return generator(root, *this, sv);
+	}
+};
+
+//The board properties the move generator uses in its inner loops.
+//RuntimeGeometry reads them from the SharedWorkspace.  CompiledGeometry folds
+//them into constants for a board from board-defs.inc, so loop bounds and masks
+//are known to the compiler.  Its move numbers are std::integral_constants, so
+//each depth of next_states is its own function with the move checks folded.
+struct RuntimeGeometry {
+	static constexpr unsigned int first_move() {return 0;}
+	static unsigned int next_move(unsigned int move_number) {return move_number + 1;}
+	static unsigned int squares(const SharedWorkspace& work) {return work.board.squares();}
+	static unsigned int neighbor(const SharedWorkspace& work, unsigned int square, Dir dir) {return work.board.neighbor(square, dir);}
+	static uint32_t neighbor_mask(const SharedWorkspace& work, unsigned int square) {return work.neighbor_masks[square];}
+	static const GridLayout& grid(const SharedWorkspace& work) {return work.grid;}
+	static unsigned int max_moves(const SharedWorkspace& work) {return work.max_moves;}
+	static unsigned int allowable_moves_mask(const SharedWorkspace& work) {return work.allowable_moves_mask;}
+	static unsigned int transposition_floor(const SharedWorkspace& work) {return work.transposition_floor;}
+};
+
+template<const Board& B>
+struct CompiledGeometry {
+	template<unsigned int N>
+	using Move = std::integral_constant<unsigned int, N>;
+	static constexpr Move<0> first_move() {return {};}
+	//Stops at max_moves so instantiation terminates; next_states doesn't move
+	//from there.
+	template<unsigned int N>
+	static constexpr auto next_move(Move<N>) {return Move<std::min(N + 1, B.max_moves())>{};}
+	static constexpr unsigned int squares(const SharedWorkspace&) {return B.squares();}
+	static constexpr unsigned int neighbor(const SharedWorkspace&, unsigned int square, Dir dir) {return B.neighbor(square, dir);}
+	static constexpr uint32_t neighbor_mask(const SharedWorkspace&, unsigned int square) {return neighbor_masks[square];}
+	static constexpr const GridLayout& grid(const SharedWorkspace&) {return grid_;}
+	static constexpr unsigned int max_moves(const SharedWorkspace&) {return B.max_moves();}
+	static constexpr unsigned int allowable_moves_mask(const SharedWorkspace&) {return B.allowed_moves_mask();}
+	static constexpr unsigned int transposition_floor(const SharedWorkspace&) {return pushfight::transposition_floor(B);}
+private:
+	//unused (as shift_fill is cleared) if B has no grid layout
+	static constexpr GridLayout grid_ = grid_layout(B).value_or(GridLayout{});
+	static constexpr std::array<uint32_t, 26> neighbor_masks = [] {
+		std::array<uint32_t, 26> masks = {};
+		for (unsigned int s = 0; s < B.squares(); ++s)
+			masks[s] = B.neighbors_mask(s);
+		return masks;
+	}();
 };
 
 char remove_piece(State& state, unsigned int index) {
@@ -254,11 +754,12 @@ void move_piece(State& state, unsigned int from, unsigned int to) {
 }
 
 //returns true iff we should continue visiting
-bool do_all_pushes(const State source, const SharedWorkspace& swork, StateVisitor& sv) {
+template<typename G>
+bool do_all_pushes_walk(const State source, const SharedWorkspace& swork, StateVisitor& sv) {
 	std::array<unsigned int, 10> chain;
 	unsigned int chain_length = 0;
 	for (unsigned int start : set_bits_range(source.allied_pushers)) {
-		if (!(swork.neighbor_masks[start] & (source.blockers() & ~source.anchored_pieces)))
+		if (!(G::neighbor_mask(swork, start) & (source.blockers() & ~source.anchored_pieces)))
 			continue; //no non-anchored pieces to push, in any direction
 		for (Dir dir : {LEFT, UP, RIGHT, DOWN}) {
 			chain_length = 0;
@@ -267,7 +768,7 @@ bool do_all_pushes(const State source, const SharedWorkspace& swork, StateVisito
 			char removed_piece = ' ';
 
 			while (true) {
-				unsigned int next = swork.board.neighbor(chain[chain_length-1], dir);
+				unsigned int next = G::neighbor(swork, chain[chain_length-1], dir);
 				if (swork.adjacent_to_void[dir] & (1 << chain[chain_length-1])) {
 					removed_piece = remove_piece(succ, chain[chain_length-1]);
 					break;
@@ -306,16 +807,82 @@ bool do_all_pushes(const State source, const SharedWorkspace& swork, StateVisito
 	return true;
 }
 
-uint32_t connected_empty_space(unsigned int source, uint32_t blockers, const SharedWorkspace& work) {
-	uint32_t result = (work.neighbor_masks[source] & ~blockers) | (1 << source);
+//As do_all_pushes_walk, but finding each chain's end by scanning the push ray's
+//squares against a mask, and moving the chain with a shift per stride.
+template<typename G>
+bool do_all_pushes_tables(const State source, const SharedWorkspace& swork, StateVisitor& sv) {
+	const uint32_t blockers = source.blockers();
+	//A chain ends at the first empty square; reaching an anchored piece first
+	//makes the push impossible.
+	const uint32_t stops = ~blockers | source.anchored_pieces;
+	for (unsigned int start : set_bits_range(source.allied_pushers)) {
+		if (!(G::neighbor_mask(swork, start) & (blockers & ~source.anchored_pieces)))
+			continue; //no non-anchored pieces to push, in any direction
+		for (Dir dir : {LEFT, UP, RIGHT, DOWN}) {
+			const auto& ray = swork.push_rays[start][dir];
+			//the index in the ray of the square the chain ends at, or its
+			//length if the last piece is pushed off
+			unsigned int end = 0;
+			if (ray.mask & stops) {
+				while (!(stops & (1u << ray.squares[end])))
+					++end;
+				if (source.anchored_pieces & (1u << ray.squares[end]))
+					continue;
+			} else if (ray.into_void && ray.length)
+				end = ray.length;
+			else
+				continue; //full up to a rail, or the pusher is at the edge
+
+			State succ = source;
+			char removed_piece = ' ';
+			uint32_t moving = ray.prefix[end];
+			if (end == ray.length) {
+				removed_piece = remove_piece(succ, ray.squares[end-1]);
+				moving = ray.prefix[end-1];
+			}
+			//"Pushing nothing" (end 0) moves just the pusher, like any push.
+			std::array<uint32_t*, 4> masks = {&succ.allied_pushers, &succ.allied_pawns, &succ.enemy_pushers, &succ.enemy_pawns};
+			std::array<uint32_t, 4> moved = {};
+			for (unsigned int i = 0; i < ray.step_count; ++i) {
+				auto [stride, squares] = ray.steps[i];
+				squares &= moving;
+				for (unsigned int m = 0; m < 4; ++m) {
+					uint32_t from = *masks[m] & squares;
+					moved[m] |= stride > 0 ? from << stride : from >> -stride;
+				}
+			}
+			for (unsigned int m = 0; m < 4; ++m)
+				*masks[m] = (*masks[m] & ~moving) | moved[m];
+			succ.anchored_pieces = 1u << ray.squares[0]; //anchor where the pusher moved to
+			std::swap(succ.allied_pushers, succ.enemy_pushers);
+			std::swap(succ.allied_pawns, succ.enemy_pawns);
+
+			succ = swork.canonicalize(succ);
+
+			if (!sv.accept(succ, removed_piece))
+				return false;
+		}
+	}
+	return true;
+}
+
+//returns true iff we should continue visiting
+template<typename G>
+bool do_all_pushes(const State source, const SharedWorkspace& swork, StateVisitor& sv) {
+	return swork.options.push_tables ? do_all_pushes_tables<G>(source, swork, sv) : do_all_pushes_walk<G>(source, swork, sv);
+}
+
+template<typename G>
+uint32_t connected_empty_space_expand(unsigned int source, uint32_t blockers, const SharedWorkspace& work) {
+	uint32_t result = (G::neighbor_mask(work, source) & ~blockers) | (1 << source);
 	uint32_t expanded = 1 << source;
 //	fmt::print("{:b} {:b}\n", result, expanded);
 
 	while (expanded != result) {
 		uint32_t old_result = result, unexpanded = result & ~expanded;
 		for (unsigned int bit : set_bits_range(unexpanded)) {
-			assert(bit < work.board.squares());
-			result |= work.neighbor_masks[bit] & ~blockers;
+			assert(bit < G::squares(work));
+			result |= G::neighbor_mask(work, bit) & ~blockers;
 //			fmt::print("{} {:b} {:b}\n", bit, result, expanded);
 		}
 		expanded = old_result;
@@ -326,40 +893,166 @@ uint32_t connected_empty_space(unsigned int source, uint32_t blockers, const Sha
 	return result;
 }
 
+//As connected_empty_space_expand, but on the grid, dilating the reached set
+//in all four directions at once until it stops growing.
+template<typename G>
+uint32_t connected_empty_space_fill(unsigned int source, uint32_t blockers, const SharedWorkspace& work) {
+	std::uint64_t empty = work.to_grid(~blockers), reached = work.to_grid(1u << source);
+	const GridLayout& grid = G::grid(work);
+	const auto& exits = grid.exits;
+	const unsigned int row = grid.row;
+	for (std::uint64_t before = 0; before != reached;) {
+		before = reached;
+		reached |= empty & ((reached & exits[LEFT]) >> 1 | (reached & exits[UP]) >> row |
+				(reached & exits[RIGHT]) << 1 | (reached & exits[DOWN]) << row);
+	}
+	uint32_t result = work.from_grid(reached, grid.bytes) & ~(1u << source);
+	assert(!(result & blockers));
+	return result;
+}
+
+template<typename G>
+uint32_t connected_empty_space(unsigned int source, uint32_t blockers, const SharedWorkspace& work) {
+	return work.options.shift_fill ? connected_empty_space_fill<G>(source, blockers, work) : connected_empty_space_expand<G>(source, blockers, work);
+}
+
+//The connected components of a node's empty space.  Pieces bordering the
+//same component reach the same squares, so each component is filled once.
+template<typename G>
+struct EmptyComponents {
+	std::array<uint32_t, 26> masks;
+	unsigned int count = 0;
+
+	EmptyComponents(uint32_t blockers, const SharedWorkspace& work) {
+		uint32_t unfilled = ~blockers & ((1u << G::squares(work)) - 1);
+		while (unfilled) {
+			unsigned int seed = std::countr_zero(unfilled);
+			uint32_t component = connected_empty_space<G>(seed, blockers, work) | (1u << seed);
+			masks[count++] = component;
+			unfilled &= ~component;
+		}
+	}
+
+	//the squares the piece on from can move to
+	uint32_t reach(unsigned int from, const SharedWorkspace& work) const {
+		uint32_t result = 0;
+		for (unsigned int i = 0; i < count; ++i)
+			if (masks[i] & G::neighbor_mask(work, from))
+				result |= masks[i];
+		return result;
+	}
+};
+
+//The placements of the allied pieces next_states has expanded under the
+//current root, with the fewest moves made when it did.  Open addressing with
+//linear probing; slots are stamped, so clearing for each root is O(1).
+class TranspositionSet {
+public:
+	TranspositionSet() : slots_(std::size_t{1} << 12) {}
+
+	void clear() {
+		if (++stamp_ == 0) {
+			std::fill(slots_.begin(), slots_.end(), Slot{});
+			stamp_ = 1;
+		}
+		size_ = 0;
+	}
+
+	//Returns true if the placement needs expanding after move_number moves,
+	//recording it if so.
+	bool expand(std::uint64_t key, unsigned int move_number, unsigned int floor) {
+		Slot& slot = find(key);
+		if (slot.stamp == stamp_) {
+			if (slot.move_number == move_number || (slot.move_number < move_number && slot.move_number >= floor))
+				return false;
+			slot.move_number = std::min(slot.move_number, move_number);
+			return true;
+		}
+		slot = {key, stamp_, move_number};
+		if (++size_ * 2 > slots_.size())
+			grow();
+		return true;
+	}
+
+private:
+	struct Slot {
+		std::uint64_t key = 0;
+		std::uint32_t stamp = 0;
+		unsigned int move_number = 0;
+	};
+
+	Slot& find(std::uint64_t key) {
+		std::size_t mask = slots_.size() - 1;
+		for (std::size_t i = (key * 0x9e3779b97f4a7c15ul) >> shift_;; i = (i + 1) & mask)
+			if (slots_[i].stamp != stamp_ || slots_[i].key == key)
+				return slots_[i];
+	}
+
+	void grow() {
+		std::vector<Slot> old(slots_.size() * 2);
+		old.swap(slots_);
+		--shift_;
+		for (const Slot& slot : old)
+			if (slot.stamp == stamp_)
+				find(slot.key) = slot;
+	}
+
+	std::vector<Slot> slots_;
+	std::uint32_t stamp_ = 1;
+	unsigned int shift_ = 64 - 12;
+	std::size_t size_ = 0;
+};
+static thread_local TranspositionSet transpositions;
+
 //returns true iff we should continue visiting
-bool next_states(const State source, unsigned int move_number, const SharedWorkspace& swork, StateVisitor& sv) {
+template<typename G, typename MoveNumber>
+bool next_states(const State source, MoveNumber move_number, const SharedWorkspace& swork, StateVisitor& sv) {
 	bool returning_early = false;
-	if (move_number == 0)
+	if (move_number == 0) {
 		if (!sv.begin(source))
 			return false; //do not call sv.end
-
-	if (swork.allowable_moves_mask & (1 << move_number))
-		if (!do_all_pushes(source, swork, sv)) {
+		if (swork.options.dedupe_transpositions)
+			transpositions.clear();
+	}
+	//Enemy and anchored pieces don't change until the push, so the allied
+	//pieces determine what follows.
+	if (swork.options.dedupe_transpositions &&
+			!transpositions.expand(std::uint64_t{source.allied_pushers} << 32 | source.allied_pawns, move_number, G::transposition_floor(swork)))
+		return true;
+
+	if (G::allowable_moves_mask(swork) & (1 << move_number))
+		if (!do_all_pushes<G>(source, swork, sv)) {
 			returning_early = true;
 			goto end;
 		}
 
-	if (move_number < swork.max_moves) {
+	if (move_number < G::max_moves(swork)) {
+		std::optional<EmptyComponents<G>> components;
+		if (swork.options.share_fills)
+			components.emplace(source.blockers(), swork);
+		auto reach = [&](unsigned int from) {
+			return components ? components->reach(from, swork) : connected_empty_space<G>(from, source.blockers(), swork);
+		};
 		//Make a move.
 		for (unsigned int from : set_bits_range(source.allied_pushers)) {
-			uint32_t all_to = connected_empty_space(from, source.blockers(), swork);
+			uint32_t all_to = reach(from);
 			for (unsigned int to : set_bits_range(all_to)) {
 				State next = source;
 				next.allied_pushers &= ~(1 << from);
 				next.allied_pushers |= (1 << to);
-				if (!next_states(next, move_number+1, swork, sv)) {
+				if (!next_states<G>(next, G::next_move(move_number), swork, sv)) {
 					returning_early = true;
 					goto end;
 				}
 			}
 		}
 		for (unsigned int from : set_bits_range(source.allied_pawns)) {
-			uint32_t all_to = connected_empty_space(from, source.blockers(), swork);
+			uint32_t all_to = reach(from);
 			for (unsigned int to : set_bits_range(all_to)) {
 				State next = source;
 				next.allied_pawns &= ~(1 << from);
 				next.allied_pawns |= (1 << to);
-				if (!next_states(next, move_number+1, swork, sv)) {
+				if (!next_states<G>(next, G::next_move(move_number), swork, sv)) {
 					returning_early = true;
 					goto end;
 				}
@@ -375,6 +1068,43 @@ bool next_states(const State source, unsigned int move_number, const SharedWorks
 
 
 
+template<typename G>
+bool generate(const State root, const SharedWorkspace& swork, StateVisitor& sv) {
+	return next_states<G>(root, G::first_move(), swork, sv);
+}
+
+//Each translation unit including board-defs.inc has its own copies of the
+//boards, so the board is matched to a compiled one by what CompiledGeometry
+//reads from it.
+bool same_geometry(const Board& a, const Board& b) {
+	if (a.squares() != b.squares() || a.allowed_moves_mask() != b.allowed_moves_mask())
+		return false;
+	for (unsigned int s = 0; s < a.squares(); ++s)
+		if (a.neighbors(s) != b.neighbors(s) || a.coord_for_square(s) != b.coord_for_square(s))
+			return false;
+	return true;
+}
+
+template<const Board& B>
+Generator compiled_generator(const Board& board) {
+	//larger boards don't fit SharedWorkspace's tables
+	if constexpr (B.squares() <= 26)
+		if (same_geometry(board, B))
+			return generate<CompiledGeometry<B>>;
+	return nullptr;
+}
+
+template<const Board&... Boards>
+Generator select_generator(const Board& board, BoardList<Boards...>) {
+	Generator generator = nullptr;
+	(void)((generator = compiled_generator<Boards>(board)) || ...);
+	return generator ? generator : generate<RuntimeGeometry>;
+}
+
+Generator select_generator(const Board& board, const GeneratorOptions& options) {
+	return options.compiled_boards ? select_generator(board, compiled_boards{}) : generate<RuntimeGeometry>;
+}
+
 void enumerate_anchored_states(const Board& board, StateVisitor& sv) {
 	SharedWorkspace swork(board);
 	unsigned long count = 0;
@@ -400,7 +1130,7 @@ void enumerate_anchored_states(const Board& board, StateVisitor& sv) {
 						if (apa_mask & state.blockers()) continue;
 						state.allied_pawns = apa_mask;
 						++count;
-						next_states(state, 0, swork, sv);
+						swork.next_states(state, sv);
 						state.allied_pawns = 0;
 					}
 
@@ -419,63 +1149,187 @@ void enumerate_anchored_states(const Board& board, StateVisitor& sv) {
 	fmt::print("{}\n", count);
 }
 
-void enumerate_anchored_states_threaded(unsigned int slice, const Board& board, ForkableStateVisitor& sv) {
+namespace {
+//A thread's deque of ranges for work_stealing_for.  Ranges are split often
+//enough that a mutex costs little next to running them.
+class RangeDeque {
+public:
+	using Range = std::pair<std::size_t, std::size_t>;
+	void push(Range r) {
+		std::lock_guard lock(mutex_);
+		ranges_.push_back(r);
+	}
+	std::optional<Range> pop() {
+		std::lock_guard lock(mutex_);
+		if (ranges_.empty()) return std::nullopt;
+		Range r = ranges_.back();
+		ranges_.pop_back();
+		return r;
+	}
+	std::optional<Range> steal() {
+		std::lock_guard lock(mutex_);
+		if (ranges_.empty()) return std::nullopt;
+		Range r = ranges_.front();
+		ranges_.pop_front();
+		return r;
+	}
+private:
+	std::mutex mutex_;
+	std::deque<Range> ranges_;
+};
+}
+
+ParallelStats work_stealing_for(ThreadPool& pool, std::size_t count, std::size_t grain,
+		const std::function<void(unsigned int, std::size_t, std::size_t)>& f) {
+	unsigned int threads = pool.size();
+	grain = std::max(grain, std::size_t(1));
+	ParallelStats stats;
+	stats.busy.resize(threads);
+	auto deques = std::make_unique<RangeDeque[]>(threads);
+	for (unsigned int t = 0; t < threads; ++t) {
+		std::size_t first = count * t / threads, last = count * (t + 1) / threads;
+		if (first != last)
+			deques[t].push({first, last});
+	}
+
+	std::atomic<std::size_t> remaining(count), steals(0);
+	std::atomic<bool> failed(false);
+	pool.run_on_each([&](unsigned int t) {
+		try {
+			std::chrono::nanoseconds busy(0);
+			while (remaining.load() > 0 && !failed.load()) {
+				auto range = deques[t].pop();
+				for (unsigned int i = 1; i < threads && !range; ++i)
+					if ((range = deques[(t + i) % threads].steal()))
+						++steals;
+				if (!range) {
+					//Everything left is running; wait for it to finish (or
+					//be split for us).
+					std::this_thread::sleep_for(std::chrono::microseconds(100));
+					continue;
+				}
+				auto [first, last] = *range;
+				//Work on the lowest part, leaving the rest for ourselves next
+				//or for thieves.
+				while (last - first > grain) {
+					std::size_t middle = first + (last - first) / 2;
+					deques[t].push({middle, last});
+					last = middle;
+				}
+				auto start = std::chrono::steady_clock::now();
+				f(t, first, last);
+				busy += std::chrono::steady_clock::now() - start;
+				remaining -= last - first;
+			}
+			stats.busy[t] = busy;
+		} catch (...) {
+			failed = true;
+			throw;
+		}
+	});
+	stats.steals = steals;
+	return stats;
+}
+
+ParallelStats enumerate_anchored_states_threaded(unsigned int slice, const Board& board, ForkableStateVisitor& sv,
+		EnumerationCheckpoint* checkpoint) {
 	assert(slice < board.anchorable_squares());
 	SharedWorkspace swork(board);
 	State base_state = {};
 	base_state.enemy_pushers = 1 << slice;
 	base_state.anchored_pieces = base_state.enemy_pushers;
+	const auto& epu_masks = swork.board_choose_masks[swork.board.pushers() - 1];
+	const auto& epa_masks = swork.board_choose_masks[swork.board.pawns()];
 
-	auto work_function = [&](std::size_t index) -> unique_ptr<ForkableStateVisitor> {
-		unsigned int epu_mask = swork.board_choose_masks[swork.board.pushers() - 1][index];
-		if (epu_mask & base_state.blockers()) return nullptr;
-		unique_ptr<ForkableStateVisitor> result = sv.clone();
+	auto work_function = [&](std::size_t index, StateVisitor& visitor) {
+		unsigned int epu_mask = epu_masks[index / epa_masks.size()];
+		if (epu_mask & base_state.blockers()) return;
 		State state = base_state;
 		state.enemy_pushers |= epu_mask;
 		assert(std::popcount(state.enemy_pushers) == swork.board.pushers());
-
-		for (unsigned int epa_mask : swork.board_choose_masks[swork.board.pawns()]) {
-			if (epa_mask & state.blockers()) continue;
-			state.enemy_pawns = epa_mask;
-
-			for (unsigned int apu_mask : swork.board_choose_masks[swork.board.pushers()]) {
-				if (apu_mask & state.blockers()) continue;
-				state.allied_pushers = apu_mask;
-
-				for (unsigned int apa_mask : swork.board_choose_masks[swork.board.pawns()]) {
-					if (apa_mask & state.blockers()) continue;
-					state.allied_pawns = apa_mask;
-					next_states(state, 0, swork, *result);
-					state.allied_pawns = 0;
-				}
-
-				state.allied_pushers = 0;
+		unsigned int epa_mask = epa_masks[index % epa_masks.size()];
+		if (epa_mask & state.blockers()) return;
+		state.enemy_pawns = epa_mask;
+
+		for (unsigned int apu_mask : swork.board_choose_masks[swork.board.pushers()]) {
+			if (apu_mask & state.blockers()) continue;
+			state.allied_pushers = apu_mask;
+
+			for (unsigned int apa_mask : swork.board_choose_masks[swork.board.pawns()]) {
+				if (apa_mask & state.blockers()) continue;
+				state.allied_pawns = apa_mask;
+				swork.next_states(state, visitor);
+				state.allied_pawns = 0;
 			}
 
-			state.enemy_pawns = 0;
+			state.allied_pushers = 0;
 		}
-		return result;
 	};
 
-	auto task_count = swork.board_choose_masks[swork.board.pushers() - 1].size();
+	std::size_t task_count = epu_masks.size() * epa_masks.size();
+	//Only written before the threads start.
+	vector<char> skip(task_count);
+	vector<std::size_t> finished;
+	auto last_save = std::chrono::steady_clock::now();
+	if (checkpoint)
+		for (std::size_t index : checkpoint->finished()) {
+			if (index >= task_count || skip[index])
+				throw std::logic_error(fmt::format("bad finished work item {} of {}", index, task_count));
+			skip[index] = true;
+			finished.push_back(index);
+		}
+
+	//Each thread's clone covers the contiguous items [first, next).
+	struct ThreadState {
+		unique_ptr<ForkableStateVisitor> visitor;
+		std::size_t first, next;
+		std::chrono::steady_clock::time_point cloned;
+	};
+	ThreadPool& pool = shared_thread_pool();
+	vector<ThreadState> thread_states(pool.size());
+	//Only the bookkeeping is serialized; clones finish on their own threads.
 	std::mutex merge_mutex;
-	std::atomic<std::size_t> index_dispenser(0);
-	vector<std::future<void>> futures;
-	std::size_t num_threads = std::thread::hardware_concurrency();
-	for (std::size_t i = 0; i < num_threads && i < task_count; ++i)
-		futures.push_back(std::async(std::launch::async, [&]() {
-			for (std::size_t index = index_dispenser++; index < task_count; index = index_dispenser++) {
-				auto result = work_function(index);
-				if (result) {
-					std::lock_guard lock(merge_mutex);
-					sv.merge(std::move(result));
-				}
-			}
-		}));
-	for (std::size_t i = 0; i < futures.size(); ++i) {
-		futures[i].wait();
-		futures[i].get(); //rethrow any exception from the thread
-	}
+	auto merge = [&](ThreadState& ts) {
+		std::lock_guard lock(merge_mutex);
+		sv.merge(std::move(ts.visitor));
+		if (!checkpoint) return;
+		for (std::size_t index = ts.first; index < ts.next; ++index)
+			if (!skip[index])
+				finished.push_back(index);
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_save >= checkpoint->interval) {
+			checkpoint->save(finished);
+			last_save = now;
+		}
+	};
+	auto merge_interval = checkpoint ? checkpoint->interval : std::chrono::steady_clock::duration::max();
+
+	//Items are small enough that a few hundred ranges per thread balance
+	//the load, while the per-range overhead stays negligible on small boards.
+	auto stats = work_stealing_for(pool, task_count, task_count / (pool.size() * 256), [&](unsigned int thread, std::size_t first, std::size_t last) {
+		ThreadState& ts = thread_states[thread];
+		if (ts.visitor && (ts.next != first || std::chrono::steady_clock::now() - ts.cloned >= merge_interval)) {
+			ts.visitor->finish();
+			merge(ts);
+		}
+		if (!ts.visitor) {
+			ts.visitor = sv.clone();
+			ts.first = ts.next = first;
+			ts.cloned = std::chrono::steady_clock::now();
+		}
+		for (std::size_t index = first; index < last; ++index)
+			if (!skip[index])
+				work_function(index, *ts.visitor);
+		ts.next = last;
+	});
+	pool.run_on_each([&](unsigned int thread) {
+		if (thread_states[thread].visitor)
+			thread_states[thread].visitor->finish();
+	});
+	for (auto& ts : thread_states)
+		if (ts.visitor)
+			merge(ts);
+	return stats;
 }
 
 void enumerate_anchored_states_subslice(unsigned int slice, unsigned int subslice, const Board& board, ForkableStateVisitor& sv) {
@@ -504,7 +1358,7 @@ void enumerate_anchored_states_subslice(unsigned int slice, unsigned int subslic
 				for (unsigned int apa_mask : swork.board_choose_masks[swork.board.pawns()]) {
 					if (apa_mask & state.blockers()) continue;
 					state.allied_pawns = apa_mask;
-					next_states(state, 0, swork, *result);
+					swork.next_states(state, *result);
 					state.allied_pawns = 0;
 				}
 
@@ -520,7 +1374,190 @@ void enumerate_anchored_states_subslice(unsigned int slice, unsigned int subslic
 		sv.merge(std::move(result));
 }
 
-void opening_procedure(const Board& board, ForkableStateVisitor& sv) {
+//Set in the pool's threads, to catch run_on_each calls that would deadlock.
+static thread_local const ThreadPool* current_pool = nullptr;
+
+ThreadPool::ThreadPool(unsigned int threads, std::vector<unsigned int> cpus, bool numa) {
+	vector<Placement> placements;
+	if (numa) {
+		vector<NumaNode> groups;
+		std::size_t group_cpus = 0;
+		for (NumaNode& node : numa_nodes()) {
+			if (!cpus.empty())
+				std::erase_if(node.cpus, [&](unsigned int cpu) {return std::find(cpus.begin(), cpus.end(), cpu) == cpus.end();});
+			if (node.cpus.empty()) continue;
+			group_cpus += node.cpus.size();
+			groups.push_back(std::move(node));
+		}
+		if (groups.empty())
+			throw std::logic_error("no NUMA node has any of the given CPUs");
+		if (!threads)
+			threads = static_cast<unsigned int>(group_cpus);
+		for (std::size_t g = 0; g < groups.size(); ++g)
+			for (std::size_t i = threads * g / groups.size(); i < threads * (g + 1) / groups.size(); ++i)
+				placements.push_back({groups[g].cpus, groups[g].id});
+	} else {
+		if (!threads)
+			threads = cpus.empty() ? std::max(1u, std::thread::hardware_concurrency()) : static_cast<unsigned int>(cpus.size());
+		for (unsigned int i = 0; i < threads; ++i)
+			placements.push_back({cpus.empty() ? vector<unsigned int>{} : vector<unsigned int>{cpus[i % cpus.size()]}, std::nullopt});
+	}
+	for (unsigned int i = 0; i < threads; ++i)
+		workers_.emplace_back([this, i, placement = std::move(placements[i])]() {work(i, placement);});
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard lock(mutex_);
+		stopping_ = true;
+	}
+	start_.notify_all();
+	for (auto& t : workers_)
+		t.join();
+}
+
+void ThreadPool::work(unsigned int thread, Placement placement) {
+	current_pool = this;
+	if (!placement.cpus.empty()) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned int cpu : placement.cpus)
+			CPU_SET(cpu, &set);
+		//Failure (say, a CPU outside our cpuset) leaves the thread unpinned,
+		//which is only slower.
+		if (int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fmt::print(stderr, "couldn't pin thread {} to CPUs {}: {}\n", thread, fmt::join(placement.cpus, ","), strerror(error));
+	}
+	if (placement.node)
+		try {
+			bind_thread_memory(*placement.node);
+		} catch (std::exception& e) {
+			fmt::print(stderr, "thread {}: {}\n", thread, e.what());
+		}
+	unsigned long seen_run = 0;
+	while (true) {
+		{
+			std::unique_lock lock(mutex_);
+			start_.wait(lock, [&]() {return stopping_ || run_ != seen_run;});
+			if (stopping_) return;
+			seen_run = run_;
+		}
+		try {
+			(*f_)(thread);
+		} catch (...) {
+			std::lock_guard lock(mutex_);
+			if (!exception_)
+				exception_ = std::current_exception();
+		}
+		std::lock_guard lock(mutex_);
+		if (--busy_workers_ == 0)
+			done_.notify_all();
+	}
+}
+
+void ThreadPool::run_on_each(const std::function<void(unsigned int)>& f) {
+	if (current_pool == this)
+		throw std::logic_error("ThreadPool::run_on_each called from the pool's own thread");
+	std::lock_guard run_lock(run_mutex_);
+	std::unique_lock lock(mutex_);
+	f_ = &f;
+	exception_ = nullptr;
+	busy_workers_ = size();
+	++run_;
+	start_.notify_all();
+	done_.wait(lock, [&]() {return busy_workers_ == 0;});
+	f_ = nullptr;
+	if (exception_)
+		std::rethrow_exception(std::exchange(exception_, nullptr));
+}
+
+void ThreadPool::parallel_for(std::size_t count, const std::function<void(std::size_t)>& f) {
+	std::atomic<std::size_t> next_index(0);
+	run_on_each([&](unsigned int) {
+		try {
+			for (std::size_t index = next_index++; index < count; index = next_index++)
+				f(index);
+		} catch (...) {
+			//Stop the others claiming more.
+			next_index = count;
+			throw;
+		}
+	});
+}
+
+static std::mutex shared_pool_mutex;
+static std::unique_ptr<ThreadPool> shared_pool;
+static unsigned int shared_pool_threads = 0;
+static std::vector<unsigned int> shared_pool_cpus;
+static bool shared_pool_numa = false;
+
+void configure_shared_thread_pool(unsigned int threads, std::vector<unsigned int> cpus, bool numa) {
+	std::lock_guard lock(shared_pool_mutex);
+	if (shared_pool)
+		throw std::logic_error("shared thread pool already started");
+	shared_pool_threads = threads;
+	shared_pool_cpus = std::move(cpus);
+	shared_pool_numa = numa;
+}
+
+ThreadPool& shared_thread_pool() {
+	std::lock_guard lock(shared_pool_mutex);
+	if (!shared_pool)
+		shared_pool = std::make_unique<ThreadPool>(shared_pool_threads, shared_pool_cpus, shared_pool_numa);
+	return *shared_pool;
+}
+
+vector<unsigned int> parse_cpu_list(std::string_view list) {
+	vector<unsigned int> cpus;
+	while (!list.empty()) {
+		auto comma = list.find(',');
+		std::string_view item = list.substr(0, comma);
+		list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+		auto dash = item.find('-');
+		unsigned int first = from_string<unsigned int>(item.substr(0, dash)), last = first;
+		if (dash != std::string_view::npos)
+			last = from_string<unsigned int>(item.substr(dash + 1));
+		if (last < first || last >= CPU_SETSIZE)
+			throw std::logic_error(fmt::format("bad CPU range {}", item));
+		for (unsigned int cpu = first; cpu <= last; ++cpu)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+unsigned int subslice_count(const Board& board) {
+	return static_cast<unsigned int>(binomial[board.squares()][board.pushers() - 1]);
+}
+
+std::pair<unsigned long, unsigned long> subslice_rank_range(unsigned int slice, unsigned int subslice, const Board& board) {
+	assert(slice < board.anchorable_squares());
+	SharedWorkspace swork(board);
+	uint32_t anchored = 1u << slice;
+	uint32_t epu_mask = swork.board_choose_masks[swork.board.pushers() - 1].at(subslice);
+	if (epu_mask & anchored) return {0, 0};
+	return Unranker(board).enemy_pusher_range(anchored, anchored | epu_mask);
+}
+
+void enumerate_rank_intervals(const std::vector<std::pair<unsigned long, unsigned long>>& intervals, const Board& board, ForkableStateVisitor& sv) {
+	SharedWorkspace swork(board);
+	Unranker unranker(board);
+	unique_ptr<ForkableStateVisitor> result = sv.clone();
+	//Decode a bounded number of ranks at a time so the buffer stays small;
+	//restarting the decode costs one split per chunk.
+	constexpr unsigned long chunk = 64 * 1024;
+	vector<State> states(chunk);
+	for (auto [first, last] : intervals)
+		while (first < last) {
+			unsigned long chunk_last = last - first > chunk ? first + chunk : last;
+			std::size_t count = unranker.unrank(first, chunk_last, states.data());
+			for (std::size_t i = 0; i < count; ++i)
+				swork.next_states(states[i], *result);
+			first = chunk_last;
+		}
+	sv.merge(std::move(result));
+}
+
+ParallelStats opening_procedure(const Board& board, ForkableStateVisitor& sv) {
 	SharedWorkspace swork(board);
 	vector<State> allied_halfstates, enemy_halfstates;
 	{
@@ -539,37 +1576,40 @@ void opening_procedure(const Board& board, ForkableStateVisitor& sv) {
 		}
 	}
 
-	auto work_function = [&](std::size_t index) -> unique_ptr<ForkableStateVisitor> {
-		unique_ptr<ForkableStateVisitor> result = sv.clone();
-		State allied_halfstate = allied_halfstates[index];
-		for (State enemy_halfstate : enemy_halfstates) {
-			State state = allied_halfstate;
+	//Each thread's clone covers contiguous (allied, enemy) pairs.  They're
+	//merged in order, as write_openings expects each allied half's openings
+	//together.
+	ThreadPool& pool = shared_thread_pool();
+	vector<std::pair<std::size_t, unique_ptr<ForkableStateVisitor>>> thread_visitors(pool.size()), done;
+	vector<std::size_t> next(pool.size());
+	std::mutex done_mutex;
+	auto stats = work_stealing_for(pool, allied_halfstates.size() * enemy_halfstates.size(), enemy_halfstates.size(),
+			[&](unsigned int thread, std::size_t first, std::size_t last) {
+		auto& [visitor_first, visitor] = thread_visitors[thread];
+		if (visitor && next[thread] != first) {
+			std::lock_guard lock(done_mutex);
+			done.emplace_back(visitor_first, std::move(visitor));
+		}
+		if (!visitor) {
+			visitor = sv.clone();
+			visitor_first = first;
+		}
+		for (std::size_t index = first; index < last; ++index) {
+			State state = allied_halfstates[index / enemy_halfstates.size()];
+			const State& enemy_halfstate = enemy_halfstates[index % enemy_halfstates.size()];
 			state.enemy_pushers = enemy_halfstate.enemy_pushers;
 			state.enemy_pawns = enemy_halfstate.enemy_pawns;
-			next_states(state, 0, swork, *result);
+			swork.next_states(state, *visitor);
 		}
-		return result;
-	};
-
-	auto task_count = allied_halfstates.size();
-	std::mutex merge_mutex;
-	std::atomic<std::size_t> index_dispenser(0);
-	vector<std::future<void>> futures;
-	std::size_t num_threads = std::thread::hardware_concurrency();
-	for (std::size_t i = 0; i < num_threads && i < task_count; ++i)
-		futures.push_back(std::async(std::launch::async, [&]() {
-			for (std::size_t index = index_dispenser++; index < task_count; index = index_dispenser++) {
-				auto result = work_function(index);
-				if (result) {
-					std::lock_guard lock(merge_mutex);
-					sv.merge(std::move(result));
-				}
-			}
-		}));
-	for (std::size_t i = 0; i < futures.size(); ++i) {
-		futures[i].wait();
-		futures[i].get(); //rethrow any exception from the thread
-	}
+		next[thread] = last;
+	});
+	for (auto& tv : thread_visitors)
+		if (tv.second)
+			done.push_back(std::move(tv));
+	std::sort(done.begin(), done.end(), [](const auto& a, const auto& b) {return a.first < b.first;});
+	for (auto& [first, visitor] : done)
+		sv.merge(std::move(visitor));
+	return stats;
 }
 
 } //namespace pushfight
\ No newline at end of file
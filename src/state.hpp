@@ -1,7 +1,17 @@
 #ifndef STATE_HPP
 #define STATE_HPP
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
 #include "board.hpp"
 
 namespace pushfight {
@@ -12,9 +22,89 @@ struct State {
 	uint32_t blockers() const {
 		return enemy_pushers | enemy_pawns | allied_pushers | allied_pawns;
 	}
+	bool operator==(const State& other) const = default;
 };
 
 unsigned long rank(State state, const Board& board);
+//rank() dispatches to one of these at startup, using rank_bmi2 iff
+//cpu_has_fast_pext().  Exposed for checking they agree; rank_bmi2 requires a
+//CPU supporting BMI2.
+unsigned long rank_software(State state, const Board& board);
+unsigned long rank_bmi2(State state, const Board& board);
+bool cpu_has_fast_pext();
+
+/**
+ * Inverts rank() for one board.  Ranks are mixed-radix numbers whose digits
+ * are the gaps between pieces, so most numbers below rank_limit() are not the
+ * rank of any state (e.g., two gaps that sum past the end of the board).
+ * Construction precomputes a reciprocal for each digit's radix, so decoding
+ * takes multiplies rather than divisions.
+ */
+class Unranker {
+public:
+	explicit Unranker(const Board& board);
+	const Board& board() const {return *board_;}
+	//One more than the largest number that could be a rank.
+	unsigned long rank_limit() const {return rank_limit_;}
+	//Returns false if no state has the given rank.
+	bool try_unrank(unsigned long rank, State& state) const;
+	//Throws std::logic_error if no state has the given rank.
+	State unrank(unsigned long rank) const;
+	//The number of states the enumeration visits, and a bijection from their
+	//ranks onto [0, dense_limit()) numbering each group's placement in the
+	//combinatorial number system, for tables with an entry per state.
+	//dense_index returns dense_limit() for states anchored on an unanchorable
+	//square (which can arise as successors) and throws std::logic_error if it
+	//detects rank is not a state's rank.
+	unsigned long dense_limit() const {return dense_limit_;}
+	unsigned long dense_index(unsigned long rank) const;
+	//Returns the [first, last) range of ranks of the states with the given
+	//anchored square and enemy pushers (which must include the anchored square).
+	std::pair<unsigned long, unsigned long> enemy_pusher_range(uint32_t anchored_pieces, uint32_t enemy_pushers) const;
+	//Decodes every state whose rank is in [first, last) into out, in rank
+	//order, skipping numbers that aren't ranks.  If ranks is non-null, each
+	//state's rank is written to the corresponding index.  Returns the number
+	//of states written, at most last - first.
+	std::size_t unrank(unsigned long first, unsigned long last, State* out, unsigned long* ranks = nullptr) const;
+private:
+	struct Divisor {
+		unsigned long d, magic;
+		unsigned long quotient(unsigned long n) const {
+			//Exact as long as n * d < 2^64, which the constructor checks.
+			__extension__ using uint128 = unsigned __int128;
+			return static_cast<unsigned long>((static_cast<uint128>(n) * magic) >> 64);
+		}
+	};
+	static constexpr unsigned int MAX_PIECES = 32;
+	//digits[0] is the anchored square, then one digit per remaining piece.
+	using Digits = std::array<unsigned int, MAX_PIECES>;
+	void split(unsigned long rank, Digits& digits) const;
+	template<typename Pdep> bool place_group(unsigned int group, const Digits& digits, State& state, uint32_t& avail, unsigned int& bad_digit, Pdep pdep) const;
+	template<typename Pdep> std::size_t unrank_impl(unsigned long first, unsigned long last, State* out, unsigned long* ranks, Pdep pdep) const;
+	std::size_t unrank_software(unsigned long first, unsigned long last, State* out, unsigned long* ranks) const;
+	std::size_t unrank_bmi2(unsigned long first, unsigned long last, State* out, unsigned long* ranks) const;
+
+	const Board* board_;
+	unsigned int pieces_;
+	unsigned long rank_limit_;
+	bool use_bmi2_;
+	//indexed by digit; divisors[0] is unused because the anchored square is
+	//the most significant digit
+	std::array<Divisor, MAX_PIECES> divisors_;
+	//weights_[i] is the place value of digit i
+	std::array<unsigned long, MAX_PIECES> weights_;
+	//group 0 is the anchored square, then enemy pushers, enemy pawns, allied
+	//pushers, allied pawns; group g's digits are [group_begin_[g], group_begin_[g+1])
+	std::array<unsigned int, 6> group_begin_;
+	std::array<unsigned int, MAX_PIECES> group_of_digit_;
+	//the number of ways to place each group (group 0 being anchorable squares)
+	std::array<unsigned long, 5> group_combinations_;
+	unsigned long dense_limit_;
+};
+
+//Convenience wrappers that cache an Unranker per thread for the last board used.
+State unrank(unsigned long rank, const Board& board);
+std::size_t unrank(unsigned long first, unsigned long last, const Board& board, State* out, unsigned long* ranks = nullptr);
 
 struct StateVisitor {
 	virtual bool begin(const State& state) = 0;
@@ -26,13 +116,155 @@ struct StateVisitor {
 
 struct ForkableStateVisitor : public StateVisitor {
 	virtual std::unique_ptr<ForkableStateVisitor> clone() const = 0;
+	//Called on a clone, on the thread that filled it, before it's merged, for
+	//the work merging needn't serialize.  Clones may finish concurrently with
+	//each other and with merges.  merge must cope with unfinished clones.
+	virtual void finish() {}
 	virtual void merge(std::unique_ptr<ForkableStateVisitor> other) = 0;
 };
 
+/**
+ * A fixed set of worker threads that run parallel loops, so callers running
+ * many of them (like the solver's --solve-all) don't start threads for each.
+ * The threads can be pinned to CPUs, so several solvers can share a machine
+ * without oversubscribing it, and grouped by NUMA node.
+ */
+class ThreadPool {
+public:
+	//0 threads means one per CPU in cpus, or if cpus is empty,
+	//std::thread::hardware_concurrency().  If cpus is nonempty, the threads are
+	//pinned to its CPUs round robin.  With numa, the threads are instead split
+	//evenly into a group per NUMA node (with CPUs in cpus, if nonempty), each
+	//thread pinned to its group's CPUs and its memory bound to the node.
+	explicit ThreadPool(unsigned int threads = 0, std::vector<unsigned int> cpus = {}, bool numa = false);
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	~ThreadPool();
+	unsigned int size() const {return static_cast<unsigned int>(workers_.size());}
+	//Calls f(thread) once on each of the pool's threads, numbered from 0, and
+	//returns once all calls finish, rethrowing the first exception.  Calls from
+	//several threads are serialized; calls from the pool's own threads throw,
+	//as they would deadlock.
+	void run_on_each(const std::function<void(unsigned int)>& f);
+	//Calls f(index) for each index in [0, count) on the pool's threads, which
+	//claim indices in increasing order.  Returns once all calls finish,
+	//rethrowing the first exception (after which no more indices are claimed).
+	void parallel_for(std::size_t count, const std::function<void(std::size_t)>& f);
+private:
+	struct Placement {
+		//empty if not pinned
+		std::vector<unsigned int> cpus;
+		std::optional<unsigned int> node;
+	};
+	void work(unsigned int thread, Placement placement);
+	std::vector<std::thread> workers_;
+	//held by run_on_each's caller throughout
+	std::mutex run_mutex_;
+	std::mutex mutex_;
+	std::condition_variable start_, done_;
+	//incremented for each run, so workers can tell a new run from a spurious
+	//wakeup
+	unsigned long run_ = 0;
+	bool stopping_ = false;
+	const std::function<void(unsigned int)>* f_ = nullptr;
+	unsigned int busy_workers_ = 0;
+	std::exception_ptr exception_;
+};
+
+//Sets the thread count, CPUs and NUMA mode (as for ThreadPool's constructor)
+//of the pool returned by shared_thread_pool.  Throws if that pool has already
+//started.
+void configure_shared_thread_pool(unsigned int threads, std::vector<unsigned int> cpus, bool numa = false);
+//The pool enumerate_anchored_states_threaded, opening_procedure and the
+//solver's --solve-all run on, started on first use.
+ThreadPool& shared_thread_pool();
+//Parses a CPU list like "0-7,16-23", as in taskset(1) and /sys.
+std::vector<unsigned int> parse_cpu_list(std::string_view list);
+
+//Per-thread statistics from work_stealing_for.
+struct ParallelStats {
+	//time each thread spent running work, rather than looking for it
+	std::vector<std::chrono::nanoseconds> busy;
+	//ranges taken from another thread's deque
+	std::size_t steals = 0;
+};
+
+/**
+ * Calls f(thread, first, last) for disjoint ranges covering [0, count) on the
+ * pool's threads, returning once all have returned.  Each thread starts with
+ * an equal share of the range in its own deque.  It splits whatever it takes
+ * from the deque in half, pushing the upper half back, until at most grain
+ * indices are left to run; when its deque is empty it steals the oldest (so
+ * largest) range from another thread's.  As a thread pops its own deque from
+ * the bottom, consecutive ranges it runs are contiguous unless another thread
+ * stole in between.  Rethrows the first exception thrown by f, after the other
+ * threads stop.
+ */
+ParallelStats work_stealing_for(ThreadPool& pool, std::size_t count, std::size_t grain,
+		const std::function<void(unsigned int, std::size_t, std::size_t)>& f);
+
+/**
+ * Lets enumerate_anchored_states_threaded record which of its work items have
+ * finished, so an interrupted enumeration can be resumed.  Work items are pairs
+ * of the non-anchored enemy pushers' and the enemy pawns' choose-masks for the
+ * board, numbered pusher_index * pawn_mask_count + pawn_index.
+ */
+class EnumerationCheckpoint {
+public:
+	virtual ~EnumerationCheckpoint() = default;
+	//Work items finished by an earlier enumeration, whose results the visitor
+	//already holds.  They are skipped.
+	virtual std::vector<std::size_t> finished() = 0;
+	//Records that the given work items (including those from finished()) have
+	//finished.  Called at most every interval, with the merge lock held, so
+	//the visitor holds exactly those items' results.
+	virtual void save(const std::vector<std::size_t>& finished) = 0;
+	std::chrono::steady_clock::duration interval = std::chrono::minutes(10);
+};
+
+/**
+ * Selects between equivalent move generator implementations, so a new one can
+ * be checked against the old (visitors see the same calls in the same order)
+ * and benchmarked.  Enumerations read the options when they start.
+ */
+struct GeneratorOptions {
+	//Find push chains from per-square ray tables and move them with mask
+	//shifts, rather than walking each chain a square at a time.
+	bool push_tables = true;
+	//Find the empty squares a piece can move to with shift-based fills on a
+	//grid bitboard, rather than expanding the reached set a square at a time.
+	bool shift_fill = true;
+	//Fill each connected component of a node's empty space once, and move a
+	//piece to the components it borders, rather than filling from each piece.
+	bool share_fills = true;
+	//Skip placements of the allied pieces already expanded under the same
+	//root (transposed move sequences), rather than pushing from them again.
+	bool dedupe_transpositions = true;
+	//Use next_states specialized at compile time for the board, if
+	//board_compiler.py emitted it, rather than the generic one.
+	bool compiled_boards = true;
+};
+GeneratorOptions& generator_options();
+
 void enumerate_anchored_states(const Board& board, StateVisitor& sv);
-void enumerate_anchored_states_threaded(unsigned int slice, const Board& board, ForkableStateVisitor& sv);
+//Visits a slice's states on a work_stealing_for loop over the work items
+//described at EnumerationCheckpoint.  Each thread merges its clone of sv when
+//the items it runs stop being contiguous (and, with a checkpoint, at least
+//every checkpoint interval), so each clone visits states in rank order.
+ParallelStats enumerate_anchored_states_threaded(unsigned int slice, const Board& board, ForkableStateVisitor& sv,
+		EnumerationCheckpoint* checkpoint = nullptr);
 void enumerate_anchored_states_subslice(unsigned int slice, unsigned int subslice, const Board& board, ForkableStateVisitor& sv);
-void opening_procedure(const Board& board, ForkableStateVisitor& sv);
+//The number of subslices of each slice, which enumerate_anchored_states_subslice
+//splits by the positions of the enemy pushers other than the anchored one.
+unsigned int subslice_count(const Board& board);
+//The ranks of the states enumerate_anchored_states_subslice would visit.  The
+//range is empty if the subslice's enemy pushers overlap the anchored square.
+std::pair<unsigned long, unsigned long> subslice_rank_range(unsigned int slice, unsigned int subslice, const Board& board);
+//Visits the states whose ranks are in the given sorted, disjoint intervals (in
+//rank order, by unranking), skipping numbers in the intervals that aren't ranks.
+void enumerate_rank_intervals(const std::vector<std::pair<unsigned long, unsigned long>>& intervals, const Board& board, ForkableStateVisitor& sv);
+//Visits the opening positions, working on (allied half, enemy half) pairs.
+ParallelStats opening_procedure(const Board& board, ForkableStateVisitor& sv);
 
 }//namespace pushfight
 
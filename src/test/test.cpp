@@ -116,4 +116,657 @@ TEST_CASE("Interpolation_UpperBound03") {
 		if (actual != haystack.end() && expected != haystack.end())
 			CHECK_EQ(*actual, *expected);
 	}
-}
\ No newline at end of file
+}
+
+#include "state.hpp"
+#include "board.hpp"
+using namespace pushfight;
+#include "board-defs.inc"
+
+//Collects the states anchored on square 0 without generating their moves.
+struct SliceZeroCollector : public StateVisitor {
+	vector<std::pair<unsigned long, State>> states;
+	const Board& board;
+	SliceZeroCollector(const Board& board) : board(board) {}
+	bool begin(const State& state) override {
+		if (state.anchored_pieces == 1)
+			states.emplace_back(rank(state, board), state);
+		return false;
+	}
+	bool accept(const State& state, char removed_piece) override {return true;}
+	void end(const State& state) override {}
+};
+
+TEST_CASE("Unrank_Mini") {
+	SliceZeroCollector collector(mini);
+	enumerate_anchored_states(mini, collector);
+	auto& expected = collector.states;
+	std::sort(expected.begin(), expected.end(), [](auto& a, auto& b){return a.first < b.first;});
+	REQUIRE_UNARY(!expected.empty());
+
+	Unranker unranker(mini);
+	unsigned long mismatches = 0;
+	for (auto& p : expected)
+		if (!(unranker.unrank(p.first) == p.second))
+			++mismatches;
+	CHECK_EQ(mismatches, 0);
+
+	//The anchored square is the most significant digit, so slice 0's states
+	//are exactly the states with rank below its largest.
+	unsigned long slice_end = expected.back().first + 1;
+	vector<State> actual(slice_end);
+	vector<unsigned long> actual_ranks(slice_end);
+	std::size_t count = unranker.unrank(0, slice_end, actual.data(), actual_ranks.data());
+	REQUIRE_EQ(count, expected.size());
+	mismatches = 0;
+	for (std::size_t i = 0; i < count; ++i)
+		if (actual_ranks[i] != expected[i].first || !(actual[i] == expected[i].second))
+			++mismatches;
+	CHECK_EQ(mismatches, 0);
+
+	State s;
+	CHECK_UNARY(!unranker.try_unrank(expected.front().first + 1, s) || rank(s, mini) == expected.front().first + 1);
+	CHECK_UNARY(!unranker.try_unrank(unranker.rank_limit(), s));
+}
+
+TEST_CASE("DenseIndex_Mini") {
+	struct DenseIndexChecker : public StateVisitor {
+		Unranker unranker{mini};
+		vector<bool> seen = vector<bool>(unranker.dense_limit());
+		unsigned long visited = 0, duplicates = 0;
+		bool begin(const State& state) override {
+			++visited;
+			auto index = unranker.dense_index(rank(state, mini));
+			if (index >= seen.size() || seen[index])
+				++duplicates;
+			else
+				seen[index] = true;
+			return false;
+		}
+		bool accept(const State& state, char removed_piece) override {return true;}
+		void end(const State& state) override {}
+	} checker;
+	enumerate_anchored_states(mini, checker);
+	CHECK_EQ(checker.visited, checker.unranker.dense_limit());
+	CHECK_EQ(checker.duplicates, 0);
+}
+
+TEST_CASE("DenseIndex_NotARank") {
+	//Slice 0 is anchored on an anchorable square, so every number below its
+	//largest rank that isn't a rank must throw rather than index the table.
+	//The low ranks vary the last groups' digits, which have the fewest
+	//squares available, so checking a prefix of the slice suffices.
+	SliceZeroCollector collector(mini);
+	enumerate_anchored_states(mini, collector);
+	REQUIRE_UNARY(!collector.states.empty());
+	unsigned long slice_end = std::max_element(collector.states.begin(), collector.states.end(),
+			[](auto& a, auto& b){return a.first < b.first;})->first + 1;
+	Unranker unranker(mini);
+	State s;
+	unsigned long non_ranks = 0, unthrown = 0;
+	for (unsigned long r = 0; r < std::min(slice_end, 1UL << 16); ++r) {
+		if (unranker.try_unrank(r, s)) continue;
+		++non_ranks;
+		try {
+			unranker.dense_index(r);
+			++unthrown;
+		} catch (std::logic_error&) {}
+	}
+	CHECK_GT(non_ranks, 0);
+	CHECK_EQ(unthrown, 0);
+}
+
+TEST_CASE("GeneratorOptions_Agree") {
+	//Hashes the visitor calls in order.
+	struct CallHasher : public ForkableStateVisitor {
+		unsigned long hash = 0, accepted = 0;
+		void mix(const State& state, unsigned long extra) {
+			for (uint32_t x : {state.enemy_pushers, state.enemy_pawns, state.allied_pushers, state.allied_pawns, state.anchored_pieces})
+				hash = (hash ^ x) * 0x100000001b3ul;
+			hash = (hash ^ extra) * 0x100000001b3ul;
+		}
+		bool begin(const State& state) override {mix(state, 1); return true;}
+		bool accept(const State& state, char removed_piece) override {
+			++accepted;
+			mix(state, static_cast<unsigned char>(removed_piece));
+			return true;
+		}
+		void end(const State& state) override {mix(state, 2);}
+		std::unique_ptr<ForkableStateVisitor> clone() const override {return std::make_unique<CallHasher>();}
+		void merge(std::unique_ptr<ForkableStateVisitor> other) override {
+			auto& o = dynamic_cast<CallHasher&>(*other);
+			hash = hash * 31 + o.hash;
+			accepted += o.accepted;
+		}
+	};
+	auto run = [](GeneratorOptions options, unsigned int slice, unsigned int subslice) {
+		generator_options() = options;
+		CallHasher hasher;
+		enumerate_anchored_states_subslice(slice, subslice, mini, hasher);
+		generator_options() = {};
+		return std::pair(hasher.hash, hasher.accepted);
+	};
+	GeneratorOptions walk_pushes, expand_moves, fill_per_piece, generic_boards;
+	walk_pushes.push_tables = false;
+	expand_moves.shift_fill = false;
+	fill_per_piece.share_fills = false;
+	generic_boards.compiled_boards = false;
+	for (auto [slice, subslice] : {std::pair(0u, 3u), std::pair(3u, 5u), std::pair(7u, 12u)}) {
+		auto current = run({}, slice, subslice);
+		CHECK(current.second > 0);
+		CHECK_EQ(current, run(walk_pushes, slice, subslice));
+		CHECK_EQ(current, run(expand_moves, slice, subslice));
+		CHECK_EQ(current, run(fill_per_piece, slice, subslice));
+		CHECK_EQ(current, run(generic_boards, slice, subslice));
+	}
+}
+
+TEST_CASE("Transpositions_SameSuccessors") {
+	//Hashes each root's distinct successors, which deduping transpositions
+	//mustn't change, and counts accepts, which it should reduce.
+	struct SuccessorHasher : public ForkableStateVisitor {
+		unsigned long hash = 0, accepted = 0;
+		vector<std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, char>> successors;
+		bool begin(const State& state) override {
+			successors.clear();
+			return true;
+		}
+		bool accept(const State& state, char removed_piece) override {
+			++accepted;
+			successors.emplace_back(state.enemy_pushers, state.enemy_pawns, state.allied_pushers, state.allied_pawns, state.anchored_pieces, removed_piece);
+			return true;
+		}
+		void end(const State& state) override {
+			std::sort(successors.begin(), successors.end());
+			successors.erase(std::unique(successors.begin(), successors.end()), successors.end());
+			unsigned long h = rank(state, mini);
+			for (const auto& [a, b, c, d, e, f] : successors)
+				for (unsigned long x : {a, b, c, d, e, static_cast<uint32_t>(static_cast<unsigned char>(f))})
+					h = (h ^ x) * 0x100000001b3ul;
+			//order-independent, as clones merge in any order
+			hash += h;
+		}
+		std::unique_ptr<ForkableStateVisitor> clone() const override {return std::make_unique<SuccessorHasher>();}
+		void merge(std::unique_ptr<ForkableStateVisitor> other) override {
+			auto& o = dynamic_cast<SuccessorHasher&>(*other);
+			hash += o.hash;
+			accepted += o.accepted;
+		}
+	};
+	auto run = [](bool dedupe, unsigned int slice, unsigned int subslice) {
+		generator_options().dedupe_transpositions = dedupe;
+		SuccessorHasher hasher;
+		enumerate_anchored_states_subslice(slice, subslice, mini, hasher);
+		generator_options() = {};
+		return std::pair(hasher.hash, hasher.accepted);
+	};
+	for (auto [slice, subslice] : {std::pair(0u, 3u), std::pair(3u, 5u)}) {
+		auto deduped = run(true, slice, subslice), expanded = run(false, slice, subslice);
+		CHECK_EQ(deduped.first, expanded.first);
+		CHECK(deduped.second < expanded.second);
+	}
+}
+
+TEST_CASE("WorkStealingFor_CoversOnce") {
+	//More threads than cores, and uneven work, so threads steal.
+	constexpr std::size_t count = 10000, grain = 7;
+	vector<std::atomic<unsigned int>> runs(count);
+	std::atomic<bool> oversized = false;
+	ThreadPool pool(4);
+	auto stats = work_stealing_for(pool, count, grain, [&](unsigned int thread, std::size_t first, std::size_t last) {
+		if (last - first > grain)
+			oversized = true;
+		for (std::size_t i = first; i < last; ++i)
+			++runs[i];
+		if (first < count / 4)
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+	});
+	CHECK_FALSE(oversized);
+	CHECK(std::all_of(runs.begin(), runs.end(), [](const auto& r) {return r == 1;}));
+	CHECK_EQ(stats.busy.size(), 4);
+	CHECK(stats.steals > 0);
+}
+
+#include "compressed-intervals.hpp"
+#include <unistd.h>
+
+//An empty directory for a test's files, removed (with them) even if the test
+//fails.
+struct TempDir {
+	std::filesystem::path path;
+	explicit TempDir(std::string_view test_name)
+			: path(std::filesystem::temp_directory_path() / fmt::format("pushfight-test-{}-{}", getpid(), test_name)) {
+		std::filesystem::remove_all(path);
+		std::filesystem::create_directories(path);
+	}
+	TempDir(const TempDir&) = delete;
+	TempDir& operator=(const TempDir&) = delete;
+	~TempDir() {
+		std::error_code ec;
+		std::filesystem::remove_all(path, ec);
+	}
+};
+
+//Writes intervals (start, length) as a .bin/.len pair named stem.
+static void write_interval_files(const std::filesystem::path& stem, const vector<std::pair<unsigned long, std::uint8_t>>& intervals) {
+	std::ofstream starts(std::filesystem::path(stem).replace_extension(".bin"), std::ios::binary),
+			lengths(std::filesystem::path(stem).replace_extension(".len"), std::ios::binary);
+	for (auto [start, length] : intervals) {
+		starts.write(reinterpret_cast<const char*>(&start), sizeof(start));
+		lengths.write(reinterpret_cast<const char*>(&length), sizeof(length));
+	}
+}
+
+TEST_CASE("CompressedIntervals_RoundTrip") {
+	std::mt19937_64 prng(7);
+	vector<CompressedIntervals::Interval> expected;
+	CompressedIntervalWriter writer(true);
+	unsigned long next = 5;
+	for (int i = 0; i < 1000; ++i) {
+		//Gaps of 0 with a different tag aren't coalesced; some gaps need several varint bytes.
+		unsigned long first = next + (i % 3 ? prng() % 300 : prng() % (1UL << 40));
+		unsigned long last = first + 1 + prng() % 1000;
+		std::uint8_t tag = static_cast<std::uint8_t>(i % 2);
+		writer.add(first, last, tag);
+		expected.push_back({first, last, tag});
+		next = last;
+	}
+	TempDir temp("CompressedIntervals_RoundTrip");
+	const std::filesystem::path& dir = temp.path;
+	writer.write(dir / "test.ivc");
+	std::ifstream in(dir / "test.ivc", std::ios::binary);
+	vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+	CompressedIntervals intervals(bytes.data(), bytes.size(), "test.ivc");
+	CHECK_EQ(intervals.size(), expected.size());
+	vector<unsigned long> probes;
+	for (const auto& e : expected)
+		probes.insert(probes.end(), {e.first - 1, e.first, e.last - 1, e.last});
+	std::sort(probes.begin(), probes.end());
+	CompressedIntervals::Cursor cursor(intervals);
+	std::size_t mismatches = 0;
+	for (unsigned long r : probes) {
+		auto it = std::find_if(expected.begin(), expected.end(), [=](const auto& i) {return i.first <= r && r < i.last;});
+		auto found = intervals.find(r), cursor_found = cursor.find(r);
+		if (found.has_value() != (it != expected.end()) || (found && (found->first != it->first || found->tag != it->tag)))
+			++mismatches;
+		if (cursor_found.has_value() != found.has_value() || (found && cursor_found->first != found->first))
+			++mismatches;
+	}
+	CHECK_EQ(mismatches, 0);
+	std::size_t visited = 0;
+	intervals.for_each(expected[100].last - 1, expected[200].first + 1, [&](const auto&) {++visited;});
+	CHECK_EQ(visited, 101);
+}
+
+#include "interval-runs.hpp"
+
+TEST_CASE("IntervalRuns_CheckpointAdopt") {
+	TempDir temp("IntervalRuns_CheckpointAdopt");
+	const std::filesystem::path& dir = temp.path;
+	vector<std::pair<std::filesystem::path, std::size_t>> kept;
+	{
+		//With no budget, every run spills.
+		IntervalRuns runs(dir / "runs", 0);
+		int owner;
+		runs.add({{0, 10}, {20, 30}});
+		runs.add({{40, 50}}, &owner);
+		kept = runs.checkpoint();
+	}
+	REQUIRE_EQ(kept.size(), 1);
+	CHECK_EQ(kept[0].second, 2);
+	CHECK(std::filesystem::exists(kept[0].first));
+
+	IntervalRuns resumed(dir / "runs", 1024);
+	resumed.adopt(kept[0].first, kept[0].second);
+	resumed.add({{10, 20}, {60, 70}});
+	CHECK_EQ(resumed.size(), 4);
+	resumed.write(dir / "out.bin", dir / "out.len", false);
+	CHECK_FALSE(std::filesystem::exists(kept[0].first));
+	std::ifstream in(dir / "out.bin", std::ios::binary);
+	vector<unsigned long> starts(2);
+	in.read(reinterpret_cast<char*>(starts.data()), 2 * sizeof(unsigned long));
+	CHECK_EQ(std::filesystem::file_size(dir / "out.len"), 2);
+	CHECK_EQ(starts, vector<unsigned long>({0, 60}));
+}
+
+TEST_CASE("IntervalRuns_FoldsRuns") {
+	TempDir temp("IntervalRuns_FoldsRuns");
+	const std::filesystem::path& dir = temp.path;
+	//Adjacent single-interval runs in shuffled order, some provisional (and
+	//committed right away, as a merged clone's would be).
+	constexpr unsigned long count = 1000;
+	vector<unsigned long> order(count);
+	std::iota(order.begin(), order.end(), 0);
+	std::shuffle(order.begin(), order.end(), std::mt19937(1));
+	IntervalRuns runs(dir / "runs", 1024*1024);
+	int owner;
+	for (unsigned long i : order)
+		if (i % 3) {
+			runs.add({{2 * i, 2 * i + 2}});
+		} else {
+			runs.add({{2 * i, 2 * i + 2}}, &owner);
+			runs.commit(&owner);
+		}
+	CHECK(runs.resident_runs() < 50);
+	CHECK_EQ(runs.size(), count);
+	runs.write(dir / "out.bin", dir / "out.len", false);
+	//[0, 2000) in lengths of at most 255
+	CHECK_EQ(std::filesystem::file_size(dir / "out.len"), 8);
+	std::ifstream in(dir / "out.bin", std::ios::binary);
+	vector<unsigned long> starts(8);
+	in.read(reinterpret_cast<char*>(starts.data()), 8 * sizeof(unsigned long));
+	CHECK_EQ(starts.back(), 7 * 255);
+}
+
+#include "database.hpp"
+
+TEST_CASE("BtreeLevelSizes") {
+	CHECK(btree_level_sizes(0).empty());
+	for (std::size_t n : {1, 8, 9, 64, 65, 512, 513, 4096, 4097, 100000}) {
+		CAPTURE(n);
+		auto sizes = btree_level_sizes(n);
+		REQUIRE(!sizes.empty());
+		CHECK_EQ(sizes.front(), BTREE_NODE_KEYS);
+		//Each level has a key per node of the level below, padded to whole nodes.
+		std::size_t keys = (n + BTREE_NODE_KEYS - 1) / BTREE_NODE_KEYS;
+		for (std::size_t i = sizes.size(); i-- > 0;) {
+			CHECK_EQ(sizes[i], (keys + BTREE_NODE_KEYS - 1) / BTREE_NODE_KEYS * BTREE_NODE_KEYS);
+			if (i) CHECK(keys > BTREE_NODE_KEYS);
+			keys = (keys + BTREE_NODE_KEYS - 1) / BTREE_NODE_KEYS;
+		}
+	}
+}
+
+TEST_CASE("SearchStrategies_Floor") {
+	constexpr SearchStrategy strategies[] = {SearchStrategy::BINARY, SearchStrategy::INTERPOLATION,
+			SearchStrategy::HYBRID, SearchStrategy::BTREE};
+	WinLossUnknownDatabase::Data empty = {};
+	for (SearchStrategy s : strategies)
+		CHECK_EQ(empty.floor(42, s), -1);
+
+	TempDir temp("SearchStrategies_Floor");
+	const std::filesystem::path& dir = temp.path;
+	std::mt19937_64 prng(3);
+	//Sizes around B+tree node and level boundaries; the last is skewed, with
+	//most keys bunched at the start, so interpolation guesses badly.
+	for (std::size_t n : {1, 2, 8, 9, 64, 65, 513, 20000, 4097}) {
+		CAPTURE(n);
+		bool skewed = n == 4097;
+		std::uniform_int_distribution<unsigned long> dist(0, skewed ? 1UL << 20 : 1UL << 40);
+		vector<unsigned long> haystack;
+		while (haystack.size() < n - skewed) {
+			for (std::size_t i = haystack.size(); i < n - skewed; ++i)
+				haystack.push_back(dist(prng));
+			std::sort(haystack.begin(), haystack.end());
+			haystack.erase(std::unique(haystack.begin(), haystack.end()), haystack.end());
+		}
+		if (skewed)
+			haystack.push_back(1UL << 50);
+		vector<std::pair<unsigned long, std::uint8_t>> intervals;
+		for (unsigned long s : haystack)
+			intervals.emplace_back(s, 1);
+		write_interval_files(dir / "win-0", intervals);
+		build_btree_index(dir / "win-0.bin");
+		WinLossUnknownDatabase wldb;
+		wldb.add_generation(dir / "win-0.bin", dir / "win-0.len", WIN, 0);
+		REQUIRE_EQ(wldb.data.size(), 1);
+		const auto& d = wldb.data[0];
+		CHECK_EQ(d.btree_levels.size(), btree_level_sizes(n).size());
+
+		vector<unsigned long> needles = {0, haystack.back() + 1, ~0UL - 1};
+		for (unsigned long s : haystack)
+			needles.insert(needles.end(), {s - 1, s, s + 1});
+		for (int i = 0; i < 1000; ++i)
+			needles.push_back(dist(prng));
+		std::size_t mismatches = 0;
+		for (unsigned long r : needles) {
+			auto expected = std::distance(haystack.begin(), std::upper_bound(haystack.begin(), haystack.end(), r)) - 1;
+			for (SearchStrategy s : strategies)
+				mismatches += d.floor(r, s) != expected;
+		}
+		CHECK_EQ(mismatches, 0);
+	}
+}
+
+TEST_CASE("QuerySorted_MatchesBruteForce") {
+	TempDir temp("QuerySorted_MatchesBruteForce");
+	const std::filesystem::path& dir = temp.path;
+	std::mt19937_64 prng(5);
+	//Disjoint intervals, some adjacent, each a win or loss of generation 0 or 1.
+	vector<std::pair<unsigned long, std::uint8_t>> files[4];
+	vector<std::tuple<unsigned long, unsigned long, GameValue>> all;
+	unsigned long next = 10;
+	for (int i = 0; i < 5000; ++i) {
+		unsigned long start = next + (i % 4 ? prng() % 300 : prng() % 100000);
+		auto length = static_cast<std::uint8_t>(1 + prng() % 255);
+		unsigned int file = static_cast<unsigned int>(prng() % 4);
+		files[file].emplace_back(start, length);
+		all.emplace_back(start, start + length, file % 2 ? LOSS : WIN);
+		next = start + length;
+	}
+	WinLossUnknownDatabase wldb;
+	for (unsigned int file = 0; file < 4; ++file) {
+		std::string name = fmt::format("{}-{}", file % 2 ? "loss" : "win", file / 2);
+		write_interval_files(dir / name, files[file]);
+		wldb.add_generation(dir / (name + ".bin"), dir / (name + ".len"), file % 2 ? LOSS : WIN, file / 2);
+	}
+
+	//Every start, last and end, plus random ranks (some repeated) beyond them.
+	vector<unsigned long> ranks = {0, next, next + 1000};
+	for (auto [first, last, v] : all)
+		ranks.insert(ranks.end(), {first - 1, first, last - 1, last});
+	for (int i = 0; i < 5000; ++i)
+		ranks.push_back(prng() % (next + 1000));
+	ranks.insert(ranks.end(), ranks.begin(), ranks.begin() + 100);
+	std::sort(ranks.begin(), ranks.end());
+	vector<GameValue> values(ranks.size());
+	wldb.query_sorted(ranks, values);
+
+	std::size_t mismatches = 0;
+	for (std::size_t i = 0; i < ranks.size(); ++i) {
+		auto it = std::find_if(all.begin(), all.end(), [&](const auto& t) {return std::get<0>(t) <= ranks[i] && ranks[i] < std::get<1>(t);});
+		GameValue expected = it == all.end() ? UNKNOWN : std::get<2>(*it);
+		mismatches += values[i] != expected;
+		mismatches += wldb.query_resolution(ranks[i]).value != expected;
+	}
+	CHECK_EQ(mismatches, 0);
+	//Empty and single-rank batches.
+	wldb.query_sorted({}, {});
+	GameValue last_value;
+	unsigned long last_rank = std::get<1>(all.back()) - 1;
+	wldb.query_sorted({&last_rank, 1}, {&last_value, 1});
+	CHECK_EQ(last_value, std::get<2>(all.back()));
+}
+
+TEST_CASE("BloomFilter_NoFalseNegatives") {
+	TempDir temp("BloomFilter_NoFalseNegatives");
+	const std::filesystem::path& dir = temp.path;
+	std::mt19937_64 prng(9);
+	//Intervals over many buckets, some straddling bucket boundaries.
+	vector<std::pair<unsigned long, std::uint8_t>> intervals;
+	unsigned long next = 1000;
+	for (int i = 0; i < 2000; ++i) {
+		unsigned long start = next + prng() % 5000;
+		auto length = static_cast<std::uint8_t>(1 + prng() % 255);
+		intervals.emplace_back(start, length);
+		next = start + length;
+	}
+	write_interval_files(dir / "win-0", intervals);
+	build_bloom_filter(dir / "win-0.bin", dir / "win-0.len");
+	{
+		WinLossUnknownDatabase wldb;
+		wldb.add_generation(dir / "win-0.bin", dir / "win-0.len", WIN, 0);
+		REQUIRE_EQ(wldb.data.size(), 1);
+		CHECK_FALSE(wldb.data[0].bloom.empty());
+		//A rank the filter rejected would come back unknown.
+		std::size_t rejected = 0, gaps_found = 0;
+		unsigned long previous_end = 0;
+		for (auto [start, length] : intervals) {
+			for (unsigned long r = start; r < start + length; ++r)
+				rejected += wldb.query_resolution(r).value != WIN;
+			for (unsigned long r : {previous_end, start - 1})
+				if (r >= previous_end && r < start)
+					gaps_found += wldb.query_resolution(r).value != UNKNOWN;
+			previous_end = start + length;
+		}
+		CHECK_EQ(rejected, 0);
+		CHECK_EQ(gaps_found, 0);
+	}
+
+	//The filter is refused once the intervals beside it change: a different
+	//last interval, first interval or count.
+	auto last_changed = intervals, first_changed = intervals, count_changed = intervals;
+	last_changed.back().second = static_cast<std::uint8_t>(last_changed.back().second == 1 ? 2 : 1);
+	first_changed.front().first -= 1;
+	count_changed.erase(count_changed.begin() + 1000);
+	for (const auto& stale : {last_changed, first_changed, count_changed}) {
+		write_interval_files(dir / "win-0", stale);
+		WinLossUnknownDatabase wldb;
+		CHECK_THROWS_AS(wldb.add_generation(dir / "win-0.bin", dir / "win-0.len", WIN, 0), std::logic_error);
+	}
+}
+
+TEST_CASE("MergedIndex_RoundTrip") {
+	TempDir temp("MergedIndex_RoundTrip");
+	const std::filesystem::path& dir = temp.path;
+	std::mt19937_64 prng(11);
+	//Disjoint intervals, some adjacent, each a win or loss of generation 0, 1
+	//or 2.
+	constexpr unsigned int generations = 3;
+	vector<std::pair<unsigned long, std::uint8_t>> files[2 * generations];
+	vector<std::tuple<unsigned long, unsigned long, Resolution>> all;
+	unsigned long next = 10;
+	for (int i = 0; i < 3000; ++i) {
+		unsigned long start = next + (i % 4 ? prng() % 300 : prng() % 100000);
+		auto length = static_cast<std::uint8_t>(1 + prng() % 255);
+		unsigned int file = static_cast<unsigned int>(prng() % (2 * generations));
+		files[file].emplace_back(start, length);
+		all.emplace_back(start, start + length, Resolution{file % 2 ? LOSS : WIN, file / 2});
+		next = start + length;
+	}
+	for (unsigned int file = 0; file < 2 * generations; ++file)
+		write_interval_files(dir / fmt::format("{}-{}", file % 2 ? "loss" : "win", file / 2), files[file]);
+	build_merged_index(dir, generations);
+
+	auto wldb = load_database(dir, generations);
+	REQUIRE_EQ(wldb->data.size(), 1);
+	CHECK(wldb->data[0].tag != nullptr);
+	//Every start, last and end, plus random ranks in the gaps and beyond.
+	vector<unsigned long> ranks = {0, next, next + 1000};
+	for (auto [first, last, resolution] : all)
+		ranks.insert(ranks.end(), {first - 1, first, last - 1, last});
+	for (int i = 0; i < 5000; ++i)
+		ranks.push_back(prng() % (next + 1000));
+	std::size_t mismatches = 0, found = 0;
+	for (unsigned long r : ranks) {
+		auto it = std::find_if(all.begin(), all.end(), [&](const auto& t) {return std::get<0>(t) <= r && r < std::get<1>(t);});
+		Resolution actual = wldb->query_resolution(r);
+		if (it == all.end())
+			mismatches += actual.value != UNKNOWN;
+		else {
+			++found;
+			mismatches += actual.value != std::get<2>(*it).value || actual.generation != std::get<2>(*it).generation;
+		}
+	}
+	CHECK_GT(found, 0);
+	CHECK_EQ(mismatches, 0);
+}
+
+#include "generation-merge.hpp"
+
+//Reads the intervals of a .bin/.len pair named stem.
+static vector<std::pair<unsigned long, std::uint8_t>> read_interval_files(const std::filesystem::path& stem) {
+	std::ifstream starts(std::filesystem::path(stem).replace_extension(".bin"), std::ios::binary),
+			lengths(std::filesystem::path(stem).replace_extension(".len"), std::ios::binary);
+	vector<std::pair<unsigned long, std::uint8_t>> intervals;
+	unsigned long start;
+	std::uint8_t length;
+	while (starts.read(reinterpret_cast<char*>(&start), sizeof(start)) && lengths.read(reinterpret_cast<char*>(&length), sizeof(length)))
+		intervals.emplace_back(start, length);
+	return intervals;
+}
+
+//Writes two generation 0 slices' outputs whose intervals coalesce across them.
+static void write_coalescing_slices(const std::filesystem::path& dir) {
+	write_interval_files(dir / "win-0-00", {{10, 10}});
+	write_interval_files(dir / "win-0-01", {{20, 10}, {100, 10}});
+	write_interval_files(dir / "loss-0-00", {{50, 10}});
+	write_interval_files(dir / "loss-0-01", {{60, 10}});
+}
+
+TEST_CASE("GenerationMerge_CoalescesAcrossInputs") {
+	TempDir temp("GenerationMerge_CoalescesAcrossInputs");
+	const std::filesystem::path& dir = temp.path;
+	write_coalescing_slices(dir);
+	GenerationMergeOptions options;
+	options.threads = 4;
+	options.remove_inputs = true;
+	auto stats = merge_generation(dir, 0, nullptr, options);
+	CHECK_FALSE(stats.recovered);
+	CHECK_EQ(stats.pieces, 2);
+	CHECK_EQ(stats.win_intervals, 2);
+	CHECK_EQ(stats.loss_intervals, 1);
+	vector<std::pair<unsigned long, std::uint8_t>> wins = {{10, 20}, {100, 10}}, losses = {{50, 20}};
+	CHECK_EQ(read_interval_files(dir / "win-0"), wins);
+	CHECK_EQ(read_interval_files(dir / "loss-0"), losses);
+	CHECK(std::filesystem::exists(dir / "win-0.bloom"));
+	CHECK(std::filesystem::exists(dir / "loss-0.bloom"));
+	CHECK_FALSE(std::filesystem::exists(dir / "win-0-00.bin"));
+	CHECK_FALSE(std::filesystem::exists(dir / "loss-0-01.len"));
+	CHECK_FALSE(std::filesystem::exists(dir / "tmp" / "merge-0"));
+	//Merging again finds the outputs already there.
+	CHECK_THROWS_AS(merge_generation(dir, 0, nullptr, options), std::runtime_error);
+}
+
+TEST_CASE("GenerationMerge_RejectsOverlap") {
+	TempDir temp("GenerationMerge_RejectsOverlap");
+	const std::filesystem::path& dir = temp.path;
+	write_interval_files(dir / "win-0-00", {{10, 10}});
+	write_interval_files(dir / "loss-0-00", {});
+	write_interval_files(dir / "win-0-01", {});
+	write_interval_files(dir / "loss-0-01", {{15, 10}});
+	GenerationMergeOptions options;
+	options.remove_inputs = true;
+	CHECK_THROWS_AS(merge_generation(dir, 0, nullptr, options), std::logic_error);
+	//Nothing was published or removed, and recovery discards the staged files.
+	CHECK_FALSE(std::filesystem::exists(dir / "win-0.bin"));
+	CHECK(std::filesystem::exists(dir / "win-0-00.bin"));
+	CHECK_FALSE(recover_generation_merge(dir, 0));
+	CHECK_FALSE(std::filesystem::exists(dir / "tmp" / "merge-0"));
+}
+
+TEST_CASE("GenerationMerge_RecoversPartialPublish") {
+	TempDir temp("GenerationMerge_RecoversPartialPublish");
+	const std::filesystem::path& dir = temp.path;
+	write_coalescing_slices(dir);
+	merge_generation(dir, 0, nullptr, {});
+	auto wins = read_interval_files(dir / "win-0"), losses = read_interval_files(dir / "loss-0");
+
+	//Put things back as a crash after renaming win-0.bin would have left them:
+	//the rest staged, behind a marker saying to remove the inputs.
+	std::filesystem::path staging = dir / "tmp" / "merge-0";
+	std::filesystem::create_directories(staging);
+	for (const char* name : {"win-0.len", "win-0.bloom", "loss-0.bin", "loss-0.len", "loss-0.bloom"})
+		std::filesystem::rename(dir / name, staging / name);
+	std::ofstream(staging / "complete") << "remove-inputs";
+
+	auto stats = merge_generation(dir, 0, nullptr, {});
+	CHECK(stats.recovered);
+	CHECK_EQ(stats.win_intervals, wins.size());
+	CHECK_EQ(stats.loss_intervals, losses.size());
+	CHECK_EQ(read_interval_files(dir / "win-0"), wins);
+	CHECK_EQ(read_interval_files(dir / "loss-0"), losses);
+	CHECK(std::filesystem::exists(dir / "win-0.bloom"));
+	CHECK(std::filesystem::exists(dir / "loss-0.bloom"));
+	for (const char* name : {"win-0-00.bin", "win-0-00.len", "loss-0-00.bin", "loss-0-00.len",
+			"win-0-01.bin", "win-0-01.len", "loss-0-01.bin", "loss-0-01.len"})
+		CHECK_FALSE(std::filesystem::exists(dir / name));
+	CHECK_FALSE(std::filesystem::exists(staging));
+	CHECK_FALSE(recover_generation_merge(dir, 0));
+	//The published generation loads, with its Bloom filters.
+	auto wldb = load_database(dir, 1);
+	CHECK_EQ(wldb->query(25), WIN);
+	CHECK_EQ(wldb->query(65), LOSS);
+	CHECK_EQ(wldb->query(40), UNKNOWN);
+}
@@ -0,0 +1,43 @@
+#include "precompiled.hpp"
+#include "unique-file.hpp"
+#include <unistd.h> //for fsync
+
+namespace pushfight {
+
+UniqueFile open_or_throw(const std::filesystem::path& file, const char* mode) {
+	UniqueFile f(std::fopen(file.c_str(), mode), &std::fclose);
+	if (!f) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error opening {}: error {} ({})",
+				file.c_str(), strerror(saved_errno), saved_errno));
+	}
+	return f;
+}
+
+UniqueFile open_for_writing(const std::filesystem::path& file) {
+	return open_or_throw(file, "w+");
+}
+
+void write_or_throw(const void* p, std::size_t size, std::size_t count, FILE* f, const std::filesystem::path& file) {
+	if (std::fwrite(p, size, count, f) != count) {
+		auto saved_errno = errno;
+		throw std::runtime_error(fmt::format("error writing {}: error {} ({})",
+				file.c_str(), strerror(saved_errno), saved_errno));
+	}
+}
+
+void sync_and_close(UniqueFile f, const std::filesystem::path& file) {
+	FILE* raw = f.release();
+	bool failed = std::fflush(raw) || fsync(fileno(raw));
+	auto saved_errno = errno;
+	if (std::fclose(raw) && !failed) {
+		failed = true;
+		saved_errno = errno;
+	}
+	if (failed) {
+		throw std::runtime_error(fmt::format("error writing {}: failed to flush, sync or close; error {} ({})",
+				file.c_str(), strerror(saved_errno), saved_errno));
+	}
+}
+
+}//namespace pushfight
@@ -0,0 +1,25 @@
+#ifndef UNIQUE_FILE_HPP
+#define UNIQUE_FILE_HPP
+
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+
+namespace pushfight {
+
+//Closes the file if an exception unwinds past it.
+using UniqueFile = std::unique_ptr<FILE, decltype(&std::fclose)>;
+
+//Opens the file with the given fopen mode, or throws.
+UniqueFile open_or_throw(const std::filesystem::path& file, const char* mode);
+//Creates or truncates the file for writing, or throws.
+UniqueFile open_for_writing(const std::filesystem::path& file);
+//Writes count objects of the given size, or throws.
+void write_or_throw(const void* p, std::size_t size, std::size_t count, FILE* f, const std::filesystem::path& file);
+//Flushes, syncs and closes the file, closing it even if the flush or sync
+//fails, and throws if any of them failed.
+void sync_and_close(UniqueFile f, const std::filesystem::path& file);
+
+}//namespace pushfight
+
+#endif /* UNIQUE_FILE_HPP */